@@ -0,0 +1,229 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Micro-benchmarks for every pTensor primitive: encrypt/decrypt, the arithmetic operators for each kind of RHS,
+ *  dot, encryptedDot, sum, T, hstack and applyGradient. Every benchmark sweeps the ring dimension (one crypto bundle
+ *  per ring dimension, cached next to the binary) and the shape of its operands, named in the arguments, e.g.
+ *      BM_BinaryOp/mult_cipher/ringDim:16384/rows:32/cols:256
+ *
+ *  Build with the ptensor_bench target (needs google-benchmark) and run e.g.
+ *      ./ptensor_bench --benchmark_filter='Dot/ringDim:8192'
+ *      ./ptensor_bench --benchmark_out=ptensor_bench.json --benchmark_out_format=json
+ *  or `make bench_json`. Two JSON runs can be diffed with google-benchmark's tools/compare.py.
+ *
+ *  NOTE: the ring dimensions are forced (see cryptoBundle::generate) so the smaller ones are not 128-bit secure.
+ */
+#include "benchmark/benchmark.h"
+#include "../src/p_tensor.h"
+#include "../src/crypto_bundle.h"
+#include "../src/parallel_utils.h"
+#include "palisade.h"
+#include <functional>
+#include <string>
+
+namespace {
+
+const uint32_t kMultDepth = 4;
+const uint32_t kScalingFactorBits = 40;
+const std::vector<int64_t> kRingDims = {8192, 16384, 32768};
+const std::vector<int64_t> kRows = {4, 32};
+const std::vector<int64_t> kCols = {16, 256};
+
+/**
+ * Switch to the CKKS context (and all the keys pTensor needs) for the ring dimension in range(0). The bundles are
+ *    loaded, or generated once, only when the ring dimension changes
+ */
+void setUp(const benchmark::State &state) {
+    static uint32_t currentRingDim = 0;
+    auto ringDim = static_cast<uint32_t>(state.range(0));
+    if (ringDim == currentRingDim) {
+        return;
+    }
+    // Every slot of the ring, pTensor works with half of them plus their repeat (see pTensor::getBatchSize())
+    cryptoBundle::loadOrGenerate("ptensor_bench_crypto_bundle_" + std::to_string(ringDim) + ".bin",
+                                 kMultDepth, kScalingFactorBits, ringDim / 2, ringDim);
+    currentRingDim = ringDim;
+}
+
+unsigned int rowsOf(const benchmark::State &state) { return static_cast<unsigned int>(state.range(1)); }
+unsigned int colsOf(const benchmark::State &state) { return static_cast<unsigned int>(state.range(2)); }
+
+/**
+ * The (ringDim, rows, cols) sweep every benchmark runs over
+ */
+void shapes(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"ringDim", "rows", "cols"})
+        ->ArgsProduct({kRingDims, kRows, kCols})
+        ->Unit(benchmark::kMillisecond);
+}
+
+void BM_Encrypt(benchmark::State &state) {
+    setUp(state);
+    auto X = pTensor::randomUniform(rowsOf(state), colsOf(state));
+    for (auto _: state) {
+        benchmark::DoNotOptimize(X.encrypt());
+    }
+    state.SetItemsProcessed(state.iterations() * rowsOf(state) * colsOf(state));
+}
+BENCHMARK(BM_Encrypt)->Apply(shapes);
+
+void BM_Decrypt(benchmark::State &state) {
+    setUp(state);
+    auto X = pTensor::randomUniform(rowsOf(state), colsOf(state)).encrypt();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(X.decrypt());
+    }
+    state.SetItemsProcessed(state.iterations() * rowsOf(state) * colsOf(state));
+}
+BENCHMARK(BM_Decrypt)->Apply(shapes);
+
+// The RHS of an operator. The LHS is always an encrypted (rows, cols) tensor
+enum class rhsKind {
+  cipher,        // encrypted (rows, cols)
+  plain,         // (rows, cols) messageTensor
+  rowBroadcast,  // (1, cols) messageVector, broadcast down the rows
+  scalar         // messageScalar, broadcast everywhere
+};
+
+/**
+ * X op RHS, for op one of +, -, *. The plaintext RHS are encoded once and then come out of the plaintext cache, the
+ *    same as they would in a training loop
+ */
+template<class op>
+void BM_BinaryOp(benchmark::State &state, op apply, rhsKind kind) {
+    setUp(state);
+    auto rows = rowsOf(state);
+    auto cols = colsOf(state);
+    auto X = pTensor::randomUniform(rows, cols).encrypt();
+    auto Y = pTensor::randomUniform(rows, cols);
+    auto encryptedY = Y.encrypt();
+    auto plain = Y.getMessage();
+    auto row = plain[0];
+    messageScalar scalar = 0.5;
+
+    for (auto _: state) {
+        switch (kind) {
+            case rhsKind::cipher: benchmark::DoNotOptimize(apply(X, encryptedY));
+                break;
+            case rhsKind::plain: benchmark::DoNotOptimize(apply(X, plain));
+                break;
+            case rhsKind::rowBroadcast: benchmark::DoNotOptimize(apply(X, row));
+                break;
+            case rhsKind::scalar: benchmark::DoNotOptimize(apply(X, scalar));
+                break;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * rows * cols);
+}
+BENCHMARK_CAPTURE(BM_BinaryOp, add_cipher, std::plus<>(), rhsKind::cipher)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_BinaryOp, add_plain, std::plus<>(), rhsKind::plain)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_BinaryOp, add_row, std::plus<>(), rhsKind::rowBroadcast)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_BinaryOp, add_scalar, std::plus<>(), rhsKind::scalar)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_BinaryOp, sub_cipher, std::minus<>(), rhsKind::cipher)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_BinaryOp, sub_plain, std::minus<>(), rhsKind::plain)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_BinaryOp, sub_row, std::minus<>(), rhsKind::rowBroadcast)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_BinaryOp, sub_scalar, std::minus<>(), rhsKind::scalar)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_BinaryOp, mult_cipher, std::multiplies<>(), rhsKind::cipher)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_BinaryOp, mult_plain, std::multiplies<>(), rhsKind::plain)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_BinaryOp, mult_row, std::multiplies<>(), rhsKind::rowBroadcast)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_BinaryOp, mult_scalar, std::multiplies<>(), rhsKind::scalar)->Apply(shapes);
+
+/**
+ * X.dot(w) for an encrypted (rows, cols) X and (1, cols) w
+ */
+void BM_Dot(benchmark::State &state, bool asRowVector) {
+    setUp(state);
+    auto X = pTensor::randomUniform(rowsOf(state), colsOf(state)).encrypt();
+    auto w = pTensor::randomUniform(1, colsOf(state)).encrypt();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(X.dot(w, asRowVector));
+    }
+    state.SetItemsProcessed(state.iterations() * rowsOf(state));
+}
+BENCHMARK_CAPTURE(BM_Dot, row, true)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_Dot, col, false)->Apply(shapes);
+
+/**
+ * X.encryptedDot(other) for an encrypted (rows, cols) X and either the (rows, cols) weights or a (1, cols) residual
+ */
+void BM_EncryptedDot(benchmark::State &state, bool matrixVector) {
+    setUp(state);
+    auto X = pTensor::randomUniform(rowsOf(state), colsOf(state)).encrypt();
+    auto other = pTensor::randomUniform(matrixVector ? 1 : rowsOf(state), colsOf(state)).encrypt();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(X.encryptedDot(other));
+    }
+    state.SetItemsProcessed(state.iterations() * rowsOf(state) * colsOf(state));
+}
+BENCHMARK_CAPTURE(BM_EncryptedDot, matrix, false)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_EncryptedDot, vector, true)->Apply(shapes);
+
+/**
+ * X.sum(axis), or X.sum() for a negative axis
+ */
+void BM_Sum(benchmark::State &state, int axis) {
+    setUp(state);
+    auto X = pTensor::randomUniform(rowsOf(state), colsOf(state)).encrypt();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(axis < 0 ? X.sum() : X.sum(axis));
+    }
+    state.SetItemsProcessed(state.iterations() * rowsOf(state) * colsOf(state));
+}
+BENCHMARK_CAPTURE(BM_Sum, all, -1)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_Sum, axis0, 0)->Apply(shapes);
+BENCHMARK_CAPTURE(BM_Sum, axis1, 1)->Apply(shapes);
+
+void BM_T(benchmark::State &state) {
+    setUp(state);
+    auto X = pTensor::randomUniform(rowsOf(state), colsOf(state)).encrypt();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(X.T());
+    }
+    state.SetItemsProcessed(state.iterations() * rowsOf(state) * colsOf(state));
+}
+BENCHMARK(BM_T)->Apply(shapes);
+
+/**
+ * Stack two encrypted (rows, cols) tensors into a (2 * rows, cols) one
+ */
+void BM_Hstack(benchmark::State &state) {
+    setUp(state);
+    auto X = pTensor::randomUniform(rowsOf(state), colsOf(state)).encrypt();
+    auto Y = pTensor::randomUniform(rowsOf(state), colsOf(state)).encrypt();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(pTensor::hstack(X, Y));
+    }
+    state.SetItemsProcessed(state.iterations() * 2 * rowsOf(state) * colsOf(state));
+}
+BENCHMARK(BM_Hstack)->Apply(shapes)->Unit(benchmark::kMicrosecond);
+
+/**
+ * Apply a (1, rows) gradient to repeated (rows, cols) weights, i.e. rows features and cols observations
+ */
+void BM_ApplyGradient(benchmark::State &state) {
+    setUp(state);
+    auto weights = pTensor::generateWeights(rowsOf(state), colsOf(state)).encrypt();
+    auto gradient = pTensor::randomUniform(1, rowsOf(state)).encrypt();
+    for (auto _: state) {
+        benchmark::DoNotOptimize(pTensor::applyGradient(weights, gradient));
+    }
+    state.SetItemsProcessed(state.iterations() * rowsOf(state) * colsOf(state));
+}
+BENCHMARK(BM_ApplyGradient)->Apply(shapes);
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    // Recorded in the "context" of the JSON output so that runs can be told apart
+    benchmark::AddCustomContext("multDepth", std::to_string(kMultDepth));
+    benchmark::AddCustomContext("scalingFactorBits", std::to_string(kScalingFactorBits));
+    benchmark::AddCustomContext("numWorkers", std::to_string(resolveNumWorkers(pTensor::m_numWorkers)));
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
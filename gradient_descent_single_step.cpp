@@ -3,6 +3,7 @@
 //
 
 #include "src/p_tensor.h"
+#include "src/crypto_bundle.h"
 #include <iostream>
 int main() {
     // create a file rotating logger with 5mb size max and 3 rotated files
@@ -40,26 +41,11 @@ int main() {
     uint8_t scalingFactorBits = 40;
     int batchSize = 4096;
 
-    auto cc =
-        lbcrypto::CryptoContextFactory<lbcrypto::DCRTPoly>::genCryptoContextCKKS(
-            multDepth, scalingFactorBits, batchSize
-        );
+    // Loaded from the bundle if an earlier run generated one with the same parameters
+    auto &cc = cryptoBundle::loadOrGenerate("poc_crypto_bundle.bin", multDepth, scalingFactorBits, batchSize);
 
-    cc->Enable(ENCRYPTION);
-    cc->Enable(SHE);
-    cc->Enable(LEVELEDSHE);
-    auto keys = cc->KeyGen();
-    cc->EvalMultKeyGen(keys.secretKey);
-    cc->EvalSumKeyGen(keys.secretKey);
-
-    int ringDim = cc->GetRingDimension();
-    int rot = int(-ringDim / 4) + 1;
-    cc->EvalAtIndexKeyGen(keys.secretKey, {-1, 1, rot});
-
-    shared_ptr<lbcrypto::LPPublicKeyImpl<lbcrypto::DCRTPoly>> public_key;
-    shared_ptr<lbcrypto::LPPrivateKeyImpl<lbcrypto::DCRTPoly>> private_key;
-    public_key = keys.publicKey;
-    private_key = keys.secretKey;
+    auto public_key = pTensor::m_public_key;
+    auto private_key = pTensor::m_private_key;
     /////////////////////////////////////////////////////////////////
     //Encrypt everything
     /////////////////////////////////////////////////////////////////
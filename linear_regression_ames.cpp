@@ -16,6 +16,7 @@
 #include "src/p_tensor.h"
 #include "src/datasetProvider.h"
 #include "src/csv_reader.h"
+#include "src/crypto_bundle.h"
 #include "chrono"
 
 /**
@@ -23,39 +24,37 @@
  *  Refer to the blog post for motivation behind this decision
  *  https://ianq.ai/pTensor-and-palisade/
  * @param numFolds
- * @param ptxtX
- * @param ptxtY
+ * @param ptxtX_T
+ *  feature-major (#features, #observations) features
+ * @param ptxtY_T
+ *  (1, #observations) labels
+ * @param layout
+ *  How to lay the encrypted data out across ciphertexts
  * @return
  */
-providedDataset constructDataset(int numFolds, messageTensor ptxtX, messageTensor ptxtY) {
+providedDataset constructDataset(int numFolds, realTensor ptxtX_T, realTensor ptxtY_T, pTensorLayout layout) {
 
-    auto numObservations = ptxtX.size();
-    auto numFeatures = ptxtX[0].size();
+    auto numFeatures = ptxtX_T.size();
+    auto numObservations = ptxtX_T[0].size();
 
     if (numFolds > 0) {
-        // No need to transpose here as we do it internally
-        pTensor pX(numObservations, numFeatures, ptxtX);
-        pTensor pY(numObservations, 1, ptxtY);
-
-        datasetProvider dp(pX, pY, numFolds);
-        return dp.provide(42, true);
+        auto dp = datasetProvider::fromFeatureMajor(std::move(ptxtX_T), std::move(ptxtY_T), numFolds);
+        return dp.provide(42, true, layout);
     }
 
-    auto ptxtX_T = pTensor::plainT(ptxtX);
-    auto ptxtY_T = pTensor::plainT(ptxtY);
-    pTensor pX(numFeatures, numObservations, ptxtX_T);
-    pTensor pY(1, numObservations, ptxtY_T);
+    pTensor pX(numFeatures, numObservations, std::move(ptxtX_T));
+    pTensor pY(1, numObservations, std::move(ptxtY_T));
 
     auto t1 = std::chrono::high_resolution_clock::now();
-    auto X = pX.encrypt();
+    auto X = pX.encrypt(layout);
     auto t2 = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() * 1e-6;
-    std::cout << "Encrypting X took " << duration << " seconds" << std::endl;
+    std::cout << "Encrypting X took " << duration << " seconds (" << pTensor::getLastThroughput() << " rows/sec)" << std::endl;
 
-    auto y = pY.encrypt();
+    auto y = pY.encrypt(layout);
     auto t3 = std::chrono::high_resolution_clock::now();
     duration = std::chrono::duration_cast<std::chrono::microseconds>(t3 - t2).count() * 1e-6;
-    std::cout << "Encrypting y took " << duration << " seconds" << std::endl;
+    std::cout << "Encrypting y took " << duration << " seconds (" << pTensor::getLastThroughput() << " rows/sec)" << std::endl;
     providedDataset dataset = {std::make_tuple(X, y)};
     return dataset;
 }
@@ -72,12 +71,29 @@ int main() {
     // If numFolds ==1, we shuffle the single dataset
     // If numFolds == 0, we keep the order
     int numFolds = 0;
+
+    // Stochastic gradient descent: every epoch is a single step on a freshly shuffled mini-batch of miniBatchSize
+    //  observations instead of the whole dataset. 0 sizes the batches to fill a ciphertext
+    bool miniBatch = false;
+    unsigned int miniBatchSize = 0;
     float _alpha = 0.5;
     float _l2_regularization_factor = -1;
 
+    // Number of threads used to encrypt/decrypt rows. 0 uses every hardware thread
+    unsigned int numWorkers = 0;
+
+    // packedRows puts several features into a single ciphertext which cuts the number of ciphertexts (and ops)
+    pTensorLayout layout = pTensorLayout::rowPerCipher;
+
+    // Set to true to build the elementwise ops into a graph and optimize it before running. gradient * alpha *
+    //  scaleByNumSamples then multiplies the two scalars first, which saves a level on the gradient
+    bool lazy = false;
+
     uint8_t multDepth = 8;
     uint8_t scalingFactorBits = 45;
     int batchSize = 16384;
+    // Where the crypto context and keys are kept between runs
+    std::string cryptoBundlePath = "ames_crypto_bundle.bin";
 
     /**
      * If you are getting a "evalIndexKey not valid", up the batch size to fit the multDepth based on this:
@@ -92,32 +108,28 @@ int main() {
     /////////////////////////////////////////////////////////////////
     //Loading in the data and setting up the variables
     /////////////////////////////////////////////////////////////////
-    messageTensor ptxtX = readFeatures("../ames_housing_dataset/processed_X.csv");
-    messageTensor ptxtY = readLabels("../ames_housing_dataset/processed_y.csv");
+    // Read straight into the feature-major layout we encrypt in
+    auto t0 = std::chrono::high_resolution_clock::now();
+    realTensor ptxtX_T = readFeaturesT("../ames_housing_dataset/processed_X.csv");
+    realTensor ptxtY_T = readLabelsT("../ames_housing_dataset/processed_y.csv");
+    auto loadDuration = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::high_resolution_clock::now() - t0).count();
+    std::cout << "Loading the dataset took " << loadDuration * 1e-6 << " seconds" << std::endl;
 
-    std::cout << "ptxtX shape: " << ptxtX.size() << ", " << ptxtX[0].size() << "." << std::endl;
-    std::cout << "ptxtY shape: " << ptxtY.size() << ", " << ptxtY[0].size() << "." << std::endl;
+    auto numObservations = ptxtX_T[0].size();
+    auto numFeatures = ptxtX_T.size();
 
-    auto numObservations = ptxtX.size();
-    auto numFeatures = ptxtX[0].size();
+    std::cout << "ptxtX shape: " << numObservations << ", " << numFeatures << "." << std::endl;
+    std::cout << "ptxtY shape: " << ptxtY_T[0].size() << ", " << ptxtY_T.size() << "." << std::endl;
 
     /////////////////////////////////////////////////////////////////
     // Create the crypto parameters
     /////////////////////////////////////////////////////////////////
 
     auto t1 = std::chrono::high_resolution_clock::now();
-    std::cout << "Creating crypto parameters and generating keys" << std::endl;
-    auto cc = lbcrypto::CryptoContextFactory<lbcrypto::DCRTPoly>::genCryptoContextCKKS(
-        multDepth, scalingFactorBits, batchSize
-    );
-
-    // @Note, we discuss the following in the next blog post
-    cc->Enable(ENCRYPTION);
-    cc->Enable(SHE);
-    cc->Enable(LEVELEDSHE);
-    auto keys = cc->KeyGen();
-    cc->EvalMultKeyGen(keys.secretKey);
-    cc->EvalSumKeyGen(keys.secretKey);
+    // Generating the keys is the slow part so we keep them in a bundle. Delete it to get fresh keys
+    std::cout << "Loading (or creating) crypto parameters and keys from " << cryptoBundlePath << std::endl;
+    auto &cc = cryptoBundle::loadOrGenerate(cryptoBundlePath, multDepth, scalingFactorBits, batchSize);
 
     int ringDim = cc->GetRingDimension();
 
@@ -125,19 +137,13 @@ int main() {
         std::string eMsg = "error, adjust batchsize to be ring_dimension/2. Batch Size is " + std::to_string(batchSize) + " and ring_dimension / 2 is " + std::to_string(ringDim/2);
         throw std::runtime_error(eMsg);
     }
-    int rot = int(-ringDim / 4) + 1;
-    cc->EvalAtIndexKeyGen(keys.secretKey, {-1, 1, rot});
-
-
 
-    shared_ptr<lbcrypto::LPPublicKeyImpl<lbcrypto::DCRTPoly>> public_key;
-    shared_ptr<lbcrypto::LPPrivateKeyImpl<lbcrypto::DCRTPoly>> private_key;
-    public_key = keys.publicKey;
-    private_key = keys.secretKey;
+    auto public_key = pTensor::m_public_key;
+    auto private_key = pTensor::m_private_key;
 
     auto t2 = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
-    std::cout << "Generating crypto parameters took " << duration * 1e-6 << " seconds" << std::endl;
+    std::cout << "Setting up crypto parameters took " << duration * 1e-6 << " seconds" << std::endl;
 
 
 
@@ -149,18 +155,34 @@ int main() {
     pTensor::m_cc = &cc;
     pTensor::m_private_key = private_key;
     pTensor::m_public_key = public_key;
+    pTensor::m_numWorkers = numWorkers;
+    pTensor::m_lazy = lazy;
+
+
+    // Each step sees this many observations
+    unsigned int stepSize = numObservations;
+    std::unique_ptr<datasetProvider> batchProvider;
+    std::unique_ptr<foldStream> batches;
+    if (miniBatch) {
+        // Every fold holds at least one batch so epochs folds are plenty. They are only built as they are consumed
+        batchProvider.reset(new datasetProvider(datasetProvider::fromFeatureMajor(ptxtX_T, ptxtY_T, epochs)));
+        batches = batchProvider->miniBatches(42, miniBatchSize, true, layout);
+        stepSize = batches->batchSize();
+        std::cout << "Training on mini-batches of " << stepSize << " observations" << std::endl;
+    }
 
-
-    pTensor weights = pTensor::generateWeights(numFeatures, numObservations);
+    pTensor weights = pTensor::generateWeights(numFeatures, stepSize);
 
     auto t3 = std::chrono::high_resolution_clock::now();
     auto t4 = std::chrono::high_resolution_clock::now();
     duration = std::chrono::duration_cast<std::chrono::microseconds>(t4 - t3).count();
     std::cout << "Encrypting the weights took " << duration * 1e-6 << " seconds" << std::endl;
 
-    std::cout << "Generating " << numFolds << " folds of the data" << std::endl;
-
-    providedDataset dataset = constructDataset(numFolds, ptxtX, ptxtY);
+    providedDataset dataset;
+    if (!miniBatch) {
+        std::cout << "Generating " << numFolds << " folds of the data" << std::endl;
+        dataset = constructDataset(numFolds, std::move(ptxtX_T), std::move(ptxtY_T), layout);
+    }
 
     const int range_from = 0;
     const int range_to = std::max(0, numFolds - 1);
@@ -175,16 +197,21 @@ int main() {
     /////////////////////////////////////////////////////////////////
     auto alpha = pTensor::encryptScalar(_alpha, true);
     auto l2Scale = pTensor::encryptScalar(_l2_regularization_factor, true);
-    auto scaleByNumSamples = pTensor::encryptScalar(static_cast<double>(1.0 / numObservations), true);
+    auto scaleByNumSamples = pTensor::encryptScalar(static_cast<double>(1.0 / stepSize), true);
 
-    auto w = weights.encrypt();
+    auto w = weights.encrypt(layout);
 
     std::cout << "Beginning training" << std::endl;
     for (unsigned int epoch = 0; epoch < epochs; ++epoch) {
-        auto index = distr(generator);
-        auto curr_dataset = dataset[index];
+        trainingPair curr_dataset;
+        if (miniBatch) {
+            batches->next(curr_dataset);
+        } else {
+            curr_dataset = dataset[distr(generator)];
+        }
         auto X = std::get<0>(curr_dataset);
         auto y = std::get<1>(curr_dataset);
+        auto startLevel = w.level();
 
         auto prediction = X.encryptedDot(w);  // Verified
         auto residual = prediction - y;// Remember, our X is already a transpose
@@ -204,8 +231,10 @@ int main() {
 
         auto scaledGradient = gradient * alpha * scaleByNumSamples;
 
-        w = pTensor::applyGradient(w, scaledGradient);
-        w = w.decrypt().encrypt();
+        pTensor::applyGradientInPlace(w, scaledGradient);
+        // Only refresh the weights once they cannot make it through another epoch
+        auto epochDepth = w.level() - startLevel;
+        w = w.refreshIfNeeded(epochDepth);
 
         /**
          * Note: we have taken 2 liberties here
@@ -223,7 +252,8 @@ int main() {
                 squaredResiduals += (scalar.real() * scalar.real());
             }
         }
-        std::cout << "Sq-Residuals at epoch " << epoch << ": " << squaredResiduals / numObservations << std::endl;
+        std::cout << "Sq-Residuals at epoch " << epoch << ": " << squaredResiduals / stepSize << std::endl;
     }
+    std::cout << "Refreshed the weights " << pTensor::getRefreshCount() << " times" << std::endl;
     std::cout << "Done" << std::endl;
 }
\ No newline at end of file
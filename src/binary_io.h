@@ -0,0 +1,100 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Little-endian integer and IEEE-754 double / float helpers shared by the pTensor file formats. Writing byte by byte
+ *  keeps the files portable across hosts regardless of their endianness.
+ */
+#ifndef BINARY_IO_H
+#define BINARY_IO_H
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+namespace binaryIO {
+
+inline void writeUint(std::ostream &out, uint64_t value, unsigned int numBytes) {
+    char bytes[8];
+    for (unsigned int i = 0; i < numBytes; ++i) {
+        bytes[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+    out.write(bytes, numBytes);
+}
+
+inline uint64_t readUint(std::istream &in, unsigned int numBytes) {
+    unsigned char bytes[8];
+    in.read(reinterpret_cast<char *>(bytes), numBytes);
+    if (!in) {
+        throw std::runtime_error("Unexpected end of file");
+    }
+    uint64_t value = 0;
+    for (unsigned int i = 0; i < numBytes; ++i) {
+        value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+    }
+    return value;
+}
+
+inline void writeDouble(std::ostream &out, double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    writeUint(out, bits, 8);
+}
+
+inline double readDouble(std::istream &in) {
+    uint64_t bits = readUint(in, 8);
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline void writeFloat(std::ostream &out, float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    writeUint(out, bits, 4);
+}
+
+inline float readFloat(std::istream &in) {
+    auto bits = static_cast<uint32_t>(readUint(in, 4));
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * Little-endian double to / from 8 bytes of memory, for bulk (de)serialization of contiguous columns. Compilers turn
+ *  these into plain loads and stores on little-endian hosts
+ */
+inline void storeDouble(char *out, double value) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for (unsigned int i = 0; i < 8; ++i) {
+        out[i] = static_cast<char>((bits >> (8 * i)) & 0xFF);
+    }
+}
+
+inline double loadDouble(const char *in) {
+    uint64_t bits = 0;
+    for (unsigned int i = 0; i < 8; ++i) {
+        bits |= static_cast<uint64_t>(static_cast<unsigned char>(in[i])) << (8 * i);
+    }
+    double value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/**
+ * Whether the files' byte order is the host's, i.e. whether a run of values can be read in place
+ */
+inline bool hostIsLittleEndian() {
+    uint16_t one = 1;
+    unsigned char first;
+    std::memcpy(&first, &one, 1);
+    return first == 1;
+}
+
+}  // namespace binaryIO
+
+#endif //BINARY_IO_H
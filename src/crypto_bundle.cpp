@@ -0,0 +1,295 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Bundle layout (every integer little-endian):
+ *
+ *      magic               8 bytes, "pTcrypto"
+ *      version             u32
+ *      multDepth           u32
+ *      scalingFactorBits   u32
+ *      batchSize           u32
+ *      ringDim             u32, 0 if PALISADE picked it
+ *      numRotations        u32, followed by that many i32 rotation indices we generated keys for
+ *      6 sections          u64 byte length followed by PALISADE's binary serialization of, in order: the context, the
+ *                          public key, the private key, the relinearization keys, the sum keys and the rotation keys
+ */
+#include "crypto_bundle.h"
+#include "binary_io.h"
+#include "mapped_file.h"
+#include "p_tensor.h"
+#include "ciphertext-ser.h"
+#include "cryptocontext-ser.h"
+#include "pubkeylp-ser.h"
+#include "scheme/ckks/ckks-ser.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+lbcrypto::CryptoContext<lbcrypto::DCRTPoly> cryptoBundle::m_context = nullptr;
+lbcrypto::LPKeyPair<lbcrypto::DCRTPoly> cryptoBundle::m_keys;
+uint32_t cryptoBundle::m_scalingFactorBits = 0;
+uint32_t cryptoBundle::m_batchSize = 0;
+uint32_t cryptoBundle::m_ringDim = 0;
+std::vector<int32_t> cryptoBundle::m_rotationIndices;
+
+namespace {
+
+using binaryIO::readUint;
+using binaryIO::writeUint;
+using Context = lbcrypto::CryptoContextImpl<lbcrypto::DCRTPoly>;
+
+const char kMagic[8] = {'p', 'T', 'c', 'r', 'y', 'p', 't', 'o'};
+const uint32_t kVersion = 2;
+const unsigned int kNumSections = 6;
+
+struct bundleHeader {
+  uint32_t multDepth;
+  uint32_t scalingFactorBits;
+  uint32_t batchSize;
+  uint32_t ringDim;
+  std::vector<int32_t> rotationIndices;
+};
+
+bundleHeader readHeader(std::istream &in, const std::string &path) {
+    char magic[sizeof(kMagic)];
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+        throw std::runtime_error(path + " is not a crypto bundle");
+    }
+    auto version = static_cast<uint32_t>(readUint(in, 4));
+    if (version != kVersion) {
+        throw std::runtime_error(path + " has crypto bundle version " + std::to_string(version)
+                                     + " but we only read version " + std::to_string(kVersion));
+    }
+    bundleHeader header;
+    header.multDepth = static_cast<uint32_t>(readUint(in, 4));
+    header.scalingFactorBits = static_cast<uint32_t>(readUint(in, 4));
+    header.batchSize = static_cast<uint32_t>(readUint(in, 4));
+    header.ringDim = static_cast<uint32_t>(readUint(in, 4));
+    header.rotationIndices.resize(readUint(in, 4));
+    for (auto &index: header.rotationIndices) {
+        index = static_cast<int32_t>(static_cast<uint32_t>(readUint(in, 4)));
+    }
+    return header;
+}
+
+// write() all of bytes to fd, which may take more than one call
+void writeAll(int fd, const std::string &bytes, const std::string &path) {
+    size_t written = 0;
+    while (written < bytes.size()) {
+        auto n = ::write(fd, bytes.data() + written, bytes.size() - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            throw std::runtime_error("Failed to write " + path);
+        }
+        written += static_cast<size_t>(n);
+    }
+}
+
+}  // namespace
+
+lbcrypto::CryptoContext<lbcrypto::DCRTPoly> &cryptoBundle::generate(uint32_t multDepth,
+                                                                    uint32_t scalingFactorBits,
+                                                                    uint32_t batchSize,
+                                                                    uint32_t ringDim) {
+    if (ringDim == 0) {
+        m_context = lbcrypto::CryptoContextFactory<lbcrypto::DCRTPoly>::genCryptoContextCKKS(
+            multDepth, scalingFactorBits, batchSize
+        );
+    } else {
+        m_context = lbcrypto::CryptoContextFactory<lbcrypto::DCRTPoly>::genCryptoContextCKKS(
+            multDepth, scalingFactorBits, batchSize, lbcrypto::HEStd_NotSet, ringDim
+        );
+    }
+    m_context->Enable(ENCRYPTION);
+    m_context->Enable(SHE);
+    m_context->Enable(LEVELEDSHE);
+    m_keys = m_context->KeyGen();
+    m_context->EvalMultKeyGen(m_keys.secretKey);
+    m_context->EvalSumKeyGen(m_keys.secretKey);
+
+    // rotationIndices() reads the batch size off of pTensor::m_cc
+    install(multDepth);
+    m_rotationIndices = pTensor::rotationIndices();
+    m_context->EvalAtIndexKeyGen(m_keys.secretKey, m_rotationIndices);
+
+    m_scalingFactorBits = scalingFactorBits;
+    m_batchSize = batchSize;
+    m_ringDim = ringDim;
+    return m_context;
+}
+
+void cryptoBundle::save(const std::string &path) {
+    if (!m_context) {
+        throw std::runtime_error("Nothing to save. Call cryptoBundle::generate() or load() first");
+    }
+    std::ostringstream header;
+    header.write(kMagic, sizeof(kMagic));
+    writeUint(header, kVersion, 4);
+    writeUint(header, pTensor::m_multDepth, 4);
+    writeUint(header, m_scalingFactorBits, 4);
+    writeUint(header, m_batchSize, 4);
+    writeUint(header, m_ringDim, 4);
+    writeUint(header, m_rotationIndices.size(), 4);
+    for (auto index: m_rotationIndices) {
+        writeUint(header, static_cast<uint32_t>(index), 4);
+    }
+
+    // Only the evaluation keys of this context (by key tag), in case the process has created others
+    auto keyTag = m_keys.secretKey->GetKeyTag();
+    std::ostringstream sections[kNumSections];
+    lbcrypto::Serial::Serialize(m_context, sections[0], SerType::BINARY);
+    lbcrypto::Serial::Serialize(m_keys.publicKey, sections[1], SerType::BINARY);
+    lbcrypto::Serial::Serialize(m_keys.secretKey, sections[2], SerType::BINARY);
+    bool ok = Context::SerializeEvalMultKey(sections[3], SerType::BINARY, keyTag)
+        && Context::SerializeEvalSumKey(sections[4], SerType::BINARY, keyTag)
+        && Context::SerializeEvalAutomorphismKey(sections[5], SerType::BINARY, keyTag);
+    if (!ok) {
+        throw std::runtime_error("Failed to serialize the evaluation keys");
+    }
+
+    // The key material goes into a new owner-only file next to path which then replaces it. Opening path itself
+    //  would keep the permissions of whatever file is already there, and a crash would leave a partial bundle
+    std::string temporary = path + ".XXXXXX";
+    int fd = ::mkstemp(&temporary[0]);
+    if (fd < 0) {
+        throw std::runtime_error("Could not create a temporary file next to " + path);
+    }
+    try {
+        if (::fchmod(fd, S_IRUSR | S_IWUSR) != 0) {
+            throw std::runtime_error("Could not make " + temporary + " owner-only");
+        }
+        writeAll(fd, header.str(), temporary);
+        for (auto &section: sections) {
+            auto payload = section.str();
+            std::ostringstream length;
+            writeUint(length, payload.size(), 8);
+            writeAll(fd, length.str(), temporary);
+            writeAll(fd, payload, temporary);
+        }
+        if (::fsync(fd) != 0) {
+            throw std::runtime_error("Failed to flush " + temporary);
+        }
+        if (::close(fd) != 0) {
+            fd = -1;
+            throw std::runtime_error("Failed to write " + temporary);
+        }
+        fd = -1;
+        if (::rename(temporary.c_str(), path.c_str()) != 0) {
+            throw std::runtime_error("Could not move " + temporary + " to " + path);
+        }
+    } catch (...) {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        ::unlink(temporary.c_str());
+        throw;
+    }
+}
+
+lbcrypto::CryptoContext<lbcrypto::DCRTPoly> &cryptoBundle::load(const std::string &path) {
+    mappedFile file(path);
+    memoryStreambuf headerBuffer(file.data(), file.size());
+    std::istream headerStream(&headerBuffer);
+    auto header = readHeader(headerStream, path);
+
+    // Deserialize every section straight out of the mapping
+    size_t offset = static_cast<size_t>(headerStream.tellg());
+    std::vector<std::pair<const char *, size_t>> sections;
+    for (unsigned int i = 0; i < kNumSections; ++i) {
+        if (offset + sizeof(uint64_t) > file.size()) {
+            throw std::runtime_error("Unexpected end of " + path);
+        }
+        memoryStreambuf lengthBuffer(file.data() + offset, sizeof(uint64_t));
+        std::istream lengthStream(&lengthBuffer);
+        auto length = static_cast<size_t>(readUint(lengthStream, 8));
+        offset += sizeof(uint64_t);
+        if (offset + length > file.size()) {
+            throw std::runtime_error("Unexpected end of " + path);
+        }
+        sections.emplace_back(file.data() + offset, length);
+        offset += length;
+    }
+
+    lbcrypto::CryptoContext<lbcrypto::DCRTPoly> context;
+    lbcrypto::LPKeyPair<lbcrypto::DCRTPoly> keys;
+    {
+        memoryStreambuf buffer(sections[0].first, sections[0].second);
+        std::istream in(&buffer);
+        lbcrypto::Serial::Deserialize(context, in, SerType::BINARY);
+    }
+    {
+        memoryStreambuf buffer(sections[1].first, sections[1].second);
+        std::istream in(&buffer);
+        lbcrypto::Serial::Deserialize(keys.publicKey, in, SerType::BINARY);
+    }
+    {
+        memoryStreambuf buffer(sections[2].first, sections[2].second);
+        std::istream in(&buffer);
+        lbcrypto::Serial::Deserialize(keys.secretKey, in, SerType::BINARY);
+    }
+    memoryStreambuf multBuffer(sections[3].first, sections[3].second);
+    memoryStreambuf sumBuffer(sections[4].first, sections[4].second);
+    memoryStreambuf rotationBuffer(sections[5].first, sections[5].second);
+    std::istream multStream(&multBuffer), sumStream(&sumBuffer), rotationStream(&rotationBuffer);
+    bool ok = Context::DeserializeEvalMultKey(multStream, SerType::BINARY)
+        && Context::DeserializeEvalSumKey(sumStream, SerType::BINARY)
+        && Context::DeserializeEvalAutomorphismKey(rotationStream, SerType::BINARY);
+    if (!context || !keys.good() || !ok) {
+        throw std::runtime_error("Failed to deserialize the crypto bundle in " + path);
+    }
+
+    m_context = context;
+    m_keys = keys;
+    m_scalingFactorBits = header.scalingFactorBits;
+    m_batchSize = header.batchSize;
+    m_ringDim = header.ringDim;
+    m_rotationIndices = std::move(header.rotationIndices);
+    install(header.multDepth);
+    return m_context;
+}
+
+lbcrypto::CryptoContext<lbcrypto::DCRTPoly> &cryptoBundle::loadOrGenerate(const std::string &path,
+                                                                          uint32_t multDepth,
+                                                                          uint32_t scalingFactorBits,
+                                                                          uint32_t batchSize,
+                                                                          uint32_t ringDim) {
+    bool usable = false;
+    std::ifstream existing(path, std::ios::binary);
+    if (existing.is_open()) {
+        try {
+            auto header = readHeader(existing, path);
+            usable = header.multDepth == multDepth && header.scalingFactorBits == scalingFactorBits
+                && header.batchSize == batchSize && header.ringDim == ringDim;
+        } catch (const std::runtime_error &) {
+            usable = false;  // Not a bundle (or an old version of one) so we overwrite it
+        }
+    }
+    if (usable) {
+        load(path);
+        // The bundle may predate rotations pTensor now needs
+        auto stored = m_rotationIndices;
+        std::sort(stored.begin(), stored.end());
+        auto needed = pTensor::rotationIndices();
+        std::sort(needed.begin(), needed.end());
+        if (std::includes(stored.begin(), stored.end(), needed.begin(), needed.end())) {
+            return m_context;
+        }
+    }
+    generate(multDepth, scalingFactorBits, batchSize, ringDim);
+    save(path);
+    return m_context;
+}
+
+void cryptoBundle::install(uint32_t multDepth) {
+    pTensor::m_cc = &m_context;
+    pTensor::m_public_key = m_keys.publicKey;
+    pTensor::m_private_key = m_keys.secretKey;
+    pTensor::m_multDepth = multDepth;
+}
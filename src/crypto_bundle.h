@@ -0,0 +1,76 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * The CKKS context and every key pTensor needs (public, private, relinearization, sum and rotation keys) in one
+ *  file. Generating the keys takes tens of seconds for realistic ring dimensions while loading a saved bundle only has
+ *  to deserialize them, so executables and test fixtures call loadOrGenerate() instead of running KeyGen themselves.
+ *
+ *  NOTE: the bundle holds the private key. It is written with owner-only permissions; treat it like any other secret.
+ */
+#ifndef CRYPTO_BUNDLE_H
+#define CRYPTO_BUNDLE_H
+
+#include "palisade.h"
+#include <string>
+#include <vector>
+
+class cryptoBundle {
+ public:
+  /**
+   * Generate a CKKS context and all of the keys, then point pTensor::m_cc, m_public_key and m_private_key at them and
+   *    set pTensor::m_multDepth
+   * @param multDepth
+   * @param scalingFactorBits
+   * @param batchSize
+   * @param ringDim
+   *    0 lets PALISADE pick the smallest ring dimension that is 128-bit secure for the other parameters. Anything else
+   *    is used as is, WITHOUT a security check, so that benchmarks can sweep it. Do not use it for real data
+   * @return
+   *    the context. It is owned by cryptoBundle and stays valid until the next generate() or load()
+   */
+  static lbcrypto::CryptoContext<lbcrypto::DCRTPoly> &generate(uint32_t multDepth,
+                                                               uint32_t scalingFactorBits,
+                                                               uint32_t batchSize,
+                                                               uint32_t ringDim = 0);
+
+  /**
+   * Write the context and keys from the last generate() or load() to a single binary file. The file is written
+   *    owner-only under a temporary name and then renamed over path, so path is never left partially written
+   * @param path
+   */
+  static void save(const std::string &path);
+
+  /**
+   * Memory-map a bundle written by save() and deserialize the context and keys straight out of the mapping. Sets up
+   *    pTensor exactly like generate() does.
+   * @param path
+   * @return
+   */
+  static lbcrypto::CryptoContext<lbcrypto::DCRTPoly> &load(const std::string &path);
+
+  /**
+   * load() the bundle at path if it was generated with the same parameters (and has every rotation key pTensor needs
+   *    now), otherwise generate() and save() it for the next run
+   * @return
+   */
+  static lbcrypto::CryptoContext<lbcrypto::DCRTPoly> &loadOrGenerate(const std::string &path,
+                                                                     uint32_t multDepth,
+                                                                     uint32_t scalingFactorBits,
+                                                                     uint32_t batchSize,
+                                                                     uint32_t ringDim = 0);
+
+ private:
+  // Setup pTensor with m_context, m_keys and the multDepth of m_context. pTensor::m_multDepth is the only copy of it,
+  //    save() writes it from there
+  static void install(uint32_t multDepth);
+
+  static lbcrypto::CryptoContext<lbcrypto::DCRTPoly> m_context;
+  static lbcrypto::LPKeyPair<lbcrypto::DCRTPoly> m_keys;
+  static uint32_t m_scalingFactorBits;
+  static uint32_t m_batchSize;
+  static uint32_t m_ringDim;  // What generate() was asked for, i.e. 0 for PALISADE's choice
+  static std::vector<int32_t> m_rotationIndices;
+};
+
+#endif //CRYPTO_BUNDLE_H
@@ -3,55 +3,372 @@
  * Date: 1/29/21 
  */
 #include "csv_reader.h"
+#include "binary_io.h"
+#include "mapped_file.h"
+#include "parallel_utils.h"
+#include <charconv>
+#include <cstdio>
+#include <fstream>
 
-messageTensor readFeatures(const std::string &dataFile, bool addBias) {
-    messageTensor tensorContainer;
-    std::ifstream file(dataFile);
-
-    bool passedLabels = false;
-    std::string row;
-    if (file.is_open()) {
-        while (std::getline(file, row)) {
-            if (!passedLabels) {
-                passedLabels = true;
-                continue;
+namespace {
+
+/**
+ * A chunk of the file that starts at the beginning of a line and ends just past a newline (or at the end of the file)
+ */
+struct chunk {
+  const char *begin;
+  const char *end;
+  unsigned int firstRow;
+};
+
+inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/**
+ * Call fn(lineBegin, lineEnd) for every non-empty line in [begin, end). lineEnd excludes the newline
+ */
+template<typename Fn>
+void forEachLine(const char *begin, const char *end, Fn fn) {
+    while (begin < end) {
+        auto newline = static_cast<const char *>(std::memchr(begin, '\n', end - begin));
+        const char *lineEnd = newline ? newline : end;
+        const char *trimmed = lineEnd;
+        while (trimmed > begin && isBlank(trimmed[-1])) {
+            --trimmed;
+        }
+        if (trimmed > begin) {
+            fn(begin, trimmed);
+        }
+        begin = newline ? newline + 1 : end;
+    }
+}
+
+/**
+ * Parse the body of the CSV (everything after the header) into feature-major columns, after numLeadingOnes rows of
+ *    ones. The header's column names go into names
+ */
+realTensor parseColumns(const std::string &dataFile, unsigned int numLeadingOnes, std::vector<std::string> &names) {
+    mappedFile file(dataFile);
+    const char *data = file.data();
+    const char *end = data + file.size();
+
+    auto headerEnd = static_cast<const char *>(std::memchr(data, '\n', file.size()));
+    if (!headerEnd) {
+        return realTensor(numLeadingOnes);
+    }
+    forEachLine(data, headerEnd, [&](const char *lineBegin, const char *lineEnd) {
+        const char *name = lineBegin;
+        while (true) {
+            auto comma = static_cast<const char *>(std::memchr(name, ',', lineEnd - name));
+            const char *nameEnd = comma ? comma : lineEnd;
+            names.emplace_back(name, nameEnd);
+            if (!comma) {
+                break;
             }
+            name = comma + 1;
+        }
+    });
+    const char *body = headerEnd + 1;
+
+    // The first data row tells us how many columns there are
+    unsigned int numCols = 0;
+    for (const char *line = body; line < end && numCols == 0;) {
+        auto newline = static_cast<const char *>(std::memchr(line, '\n', end - line));
+        const char *lineEnd = newline ? newline : end;
+        forEachLine(line, lineEnd, [&](const char *lineBegin, const char *trimmedEnd) {
+            numCols = 1 + static_cast<unsigned int>(std::count(lineBegin, trimmedEnd, ','));
+        });
+        line = newline ? newline + 1 : end;
+    }
+    if (numCols == 0) {
+        return realTensor(numLeadingOnes);
+    }
+
+    // Split at line boundaries so that every worker parses whole lines, then count the rows in each chunk to know
+    //  where its rows go
+    unsigned int numWorkers = resolveNumWorkers(pTensor::m_numWorkers);
+    size_t bodySize = end - body;
+    unsigned int numChunks = static_cast<unsigned int>(std::max<size_t>(1, std::min<size_t>(numWorkers * 4,
+                                                                                            bodySize / 4096)));
+    std::vector<chunk> chunks;
+    const char *chunkBegin = body;
+    for (unsigned int c = 1; c <= numChunks && chunkBegin < end; ++c) {
+        const char *chunkEnd = (c == numChunks) ? end : body + bodySize * c / numChunks;
+        if (chunkEnd < chunkBegin) {
+            chunkEnd = chunkBegin;
+        }
+        auto newline = static_cast<const char *>(std::memchr(chunkEnd, '\n', end - chunkEnd));
+        chunkEnd = newline ? newline + 1 : end;
+        chunks.push_back(chunk{chunkBegin, chunkEnd, 0});
+        chunkBegin = chunkEnd;
+    }
+
+    std::vector<unsigned int> rowsPerChunk(chunks.size(), 0);
+    parallelFor(static_cast<unsigned int>(chunks.size()), numWorkers, [&](unsigned int c) {
+        forEachLine(chunks[c].begin, chunks[c].end, [&](const char *, const char *) { rowsPerChunk[c] += 1; });
+    });
+    unsigned int numRows = 0;
+    for (unsigned int c = 0; c < chunks.size(); ++c) {
+        chunks[c].firstRow = numRows;
+        numRows += rowsPerChunk[c];
+    }
 
-            std::istringstream ss(row);
-            messageVector vectorContainer;
-            std::string scalar;
-            if (addBias){
-                vectorContainer.emplace_back(1.0, 0.0);
+    realTensor columns(numLeadingOnes + numCols, realVector(numRows));
+    for (unsigned int b = 0; b < numLeadingOnes; ++b) {
+        std::fill(columns[b].begin(), columns[b].end(), 1.0);
+    }
+
+    parallelFor(static_cast<unsigned int>(chunks.size()), numWorkers, [&](unsigned int c) {
+        unsigned int row = chunks[c].firstRow;
+        forEachLine(chunks[c].begin, chunks[c].end, [&](const char *lineBegin, const char *lineEnd) {
+            const char *field = lineBegin;
+            unsigned int col = 0;
+            while (true) {
+                auto comma = static_cast<const char *>(std::memchr(field, ',', lineEnd - field));
+                const char *fieldEnd = comma ? comma : lineEnd;
+                const char *first = field;
+                const char *last = fieldEnd;
+                while (first < last && isBlank(*first)) {
+                    ++first;
+                }
+                while (last > first && isBlank(last[-1])) {
+                    --last;
+                }
+                if (first < last && *first == '+') {
+                    ++first;  // from_chars does not take a leading +
+                }
+
+                double value = 0;
+                auto result = std::from_chars(first, last, value);
+                if (col >= numCols || result.ec != std::errc() || result.ptr != last) {
+                    std::string reason = (col >= numCols)
+                                         ? "has more than " + std::to_string(numCols) + " columns"
+                                         : "has an unparsable value '" + std::string(field, fieldEnd) + "'";
+                    throw std::runtime_error("Row " + std::to_string(row) + " of " + dataFile + " " + reason);
+                }
+                columns[numLeadingOnes + col][row] = value;
+                col += 1;
+                if (!comma) {
+                    break;
+                }
+                field = comma + 1;
             }
-            while (std::getline(ss, scalar, ',')) {
-                vectorContainer.emplace_back(
-                    std::stod(scalar), // the real portion
-                    0.0  // the complex portion
-                );
+            if (col != numCols) {
+                throw std::runtime_error("Row " + std::to_string(row) + " of " + dataFile + " has "
+                                             + std::to_string(col) + " columns instead of " + std::to_string(numCols));
             }
-            tensorContainer.emplace_back(vectorContainer);
-        }
+            row += 1;
+        });
+    });
+    return columns;
+}
+
+const char kCacheMagic[8] = {'p', 'T', 'c', 'o', 'l', 's', '\0', '\0'};
+const uint32_t kCacheVersion = 1;
+
+/**
+ * Size and modification time of the CSV, stored in the cache to notice when the CSV has changed
+ */
+struct sourceStamp {
+  uint64_t size = 0;
+  uint64_t mtimeNs = 0;
+
+  bool operator==(const sourceStamp &other) const { return size == other.size && mtimeNs == other.mtimeNs; }
+};
+
+bool stampOf(const std::string &path, sourceStamp &stamp) {
+    struct stat info{};
+    if (::stat(path.c_str(), &info) != 0) {
+        return false;
     }
-    return tensorContainer;
+    stamp.size = static_cast<uint64_t>(info.st_size);
+    stamp.mtimeNs = static_cast<uint64_t>(info.st_mtim.tv_sec) * 1000000000ull + info.st_mtim.tv_nsec;
+    return true;
 }
 
-messageTensor readLabels(const std::string &dataFile) {
-    messageTensor container;
-    std::ifstream file(dataFile);
-
-    std::string label;
-    bool passedLabel = false;
-    if (file.is_open()) {
-        while (std::getline(file, label)) {
-            if (!passedLabel) {
-                passedLabel = true;
-                continue;
+/**
+ * Write the columns after the first numLeadingOnes (the bias is not part of the data) to cachePath. Best effort: a
+ *    cache we cannot write is not an error
+ */
+void writeCache(const std::string &cachePath,
+                const sourceStamp &stamp,
+                const std::vector<std::string> &names,
+                const realTensor &columns,
+                unsigned int numLeadingOnes) {
+    using binaryIO::writeUint;
+    // Write to a temporary and rename so that concurrent runs never see half a cache
+    std::string tmpPath = cachePath + ".tmp" + std::to_string(::getpid());
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            return;
+        }
+        uint32_t numCols = static_cast<uint32_t>(columns.size() - numLeadingOnes);
+        uint64_t numRows = columns.empty() ? 0 : columns[0].size();
+        out.write(kCacheMagic, sizeof(kCacheMagic));
+        writeUint(out, kCacheVersion, 4);
+        writeUint(out, numCols, 4);
+        writeUint(out, numRows, 8);
+        writeUint(out, stamp.size, 8);
+        writeUint(out, stamp.mtimeNs, 8);
+        writeUint(out, names.size(), 4);
+        for (auto &name: names) {
+            writeUint(out, name.size(), 4);
+            out.write(name.data(), static_cast<std::streamsize>(name.size()));
+        }
+        // Align the columns to 8 bytes so that they can be read in place
+        auto position = static_cast<uint64_t>(out.tellp());
+        for (; position % 8 != 0; ++position) {
+            out.put('\0');
+        }
+
+        std::vector<char> column(numRows * sizeof(double));
+        for (unsigned int c = numLeadingOnes; c < columns.size(); ++c) {
+            for (uint64_t r = 0; r < numRows; ++r) {
+                binaryIO::storeDouble(column.data() + r * sizeof(double), columns[c][r]);
             }
+            out.write(column.data(), static_cast<std::streamsize>(column.size()));
+        }
+        if (!out) {
+            out.close();
+            std::remove(tmpPath.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+    }
+}
 
-            messageVector vectorContainer;
-            vectorContainer.emplace_back(std::stod(label), 0.0);
-            container.emplace_back(vectorContainer);
+/**
+ * Read the cache at cachePath, if it exists and was made from a CSV with the given stamp. The values are a view of the
+ *    memory-mapped cache, which stays mapped for as long as they (or a copy of them) are alive
+ * @return
+ *    whether the cache was usable
+ */
+bool readCache(const std::string &cachePath, const sourceStamp &stamp, csvColumns &columns) {
+    using binaryIO::readUint;
+    sourceStamp cached;
+    if (!stampOf(cachePath, cached)) {
+        return false;
+    }
+    try {
+        auto file = std::make_shared<mappedFile>(cachePath);
+        memoryStreambuf buffer(file->data(), file->size());
+        std::istream in(&buffer);
+
+        char magic[sizeof(kCacheMagic)];
+        in.read(magic, sizeof(magic));
+        if (!in || std::memcmp(magic, kCacheMagic, sizeof(kCacheMagic)) != 0 || readUint(in, 4) != kCacheVersion) {
+            return false;
+        }
+        auto numCols = static_cast<uint32_t>(readUint(in, 4));
+        auto numRows = readUint(in, 8);
+        cached.size = readUint(in, 8);
+        cached.mtimeNs = readUint(in, 8);
+        if (!(cached == stamp)) {
+            return false;
+        }
+        std::vector<std::string> names(readUint(in, 4));
+        for (auto &name: names) {
+            name.resize(readUint(in, 4));
+            in.read(&name[0], static_cast<std::streamsize>(name.size()));
+        }
+        auto offset = static_cast<uint64_t>(in.tellg());
+        offset = (offset + 7) / 8 * 8;
+        if (!in || offset + numCols * numRows * sizeof(double) != file->size()) {
+            return false;
+        }
+
+        const char *values = file->data() + offset;
+        if (binaryIO::hostIsLittleEndian()) {
+            // The columns are 8-byte aligned (and the mapping page aligned) so they can be used as they are
+            columns.values = messageStore::external(reinterpret_cast<const double *>(values), numCols, numRows,
+                                                    std::move(file));
+        } else {
+            columns.values = messageStore::zeros<realScalar>(numCols, numRows);
+            double *out = columns.values.mutableData<realScalar>();
+            parallelFor(numCols, pTensor::m_numWorkers, [&](unsigned int c) {
+                for (uint64_t r = c * numRows; r < (c + 1) * numRows; ++r) {
+                    out[r] = binaryIO::loadDouble(values + r * sizeof(double));
+                }
+            });
         }
+        columns.names = std::move(names);
+        return true;
+    } catch (const std::runtime_error &) {
+        return false;  // Unreadable or truncated. We reparse the CSV (and rewrite the cache)
+    }
+}
+
+/**
+ * Columns of the CSV after numLeadingOnes rows of ones, copied out of the cache next to it when it is up to date.
+ *    Otherwise the CSV is parsed (straight into the result) and the cache (re)written
+ */
+realTensor loadColumns(const std::string &dataFile, unsigned int numLeadingOnes, bool useCache) {
+    sourceStamp stamp;
+    std::string cachePath = dataFile + ".ptcols";
+    bool haveStamp = useCache && stampOf(dataFile, stamp);
+
+    csvColumns cached;
+    if (haveStamp && readCache(cachePath, stamp, cached)) {
+        const double *values = cached.values.data<realScalar>();
+        auto numRows = cached.values.cols();
+        realTensor columns(numLeadingOnes + cached.values.rows(), realVector(numRows, 1.0));
+        parallelFor(cached.values.rows(), pTensor::m_numWorkers, [&](unsigned int c) {
+            std::copy(values + c * numRows, values + (c + 1) * numRows, columns[numLeadingOnes + c].begin());
+        });
+        return columns;
+    }
+    std::vector<std::string> names;
+    auto columns = parseColumns(dataFile, numLeadingOnes, names);
+    if (haveStamp) {
+        writeCache(cachePath, stamp, names, columns, numLeadingOnes);
+    }
+    return columns;
+}
+
+}  // namespace
+
+messageTensor readFeatures(const std::string &dataFile, bool addBias) {
+    auto columns = readFeaturesT(dataFile, addBias);
+    return (columns.empty() || columns[0].empty()) ? messageTensor()
+                                                   : messageStore(pTensor::plainT(columns)).to<messageScalar>();
+}
+
+messageTensor readLabels(const std::string &dataFile) {
+    auto columns = readLabelsT(dataFile);
+    return (columns.empty() || columns[0].empty()) ? messageTensor()
+                                                   : messageStore(pTensor::plainT(columns)).to<messageScalar>();
+}
+
+realTensor readFeaturesT(const std::string &dataFile, bool addBias, bool useCache) {
+    return loadColumns(dataFile, addBias ? 1 : 0, useCache);
+}
+
+csvColumns readColumnsT(const std::string &dataFile, bool useCache) {
+    sourceStamp stamp;
+    std::string cachePath = dataFile + ".ptcols";
+    bool haveStamp = useCache && stampOf(dataFile, stamp);
+
+    csvColumns columns;
+    if (haveStamp && readCache(cachePath, stamp, columns)) {
+        return columns;
+    }
+    auto parsed = parseColumns(dataFile, 0, columns.names);
+    if (haveStamp) {
+        writeCache(cachePath, stamp, columns.names, parsed, 0);
+    }
+    columns.values = (parsed.empty() || parsed[0].empty()) ? messageStore::zeros<realScalar>(parsed.size(), 0)
+                                                           : messageStore(parsed);
+    return columns;
+}
+
+realTensor readLabelsT(const std::string &dataFile, bool useCache) {
+    auto columns = loadColumns(dataFile, 0, useCache);
+    if (columns.size() > 1) {
+        throw std::runtime_error(dataFile + " has " + std::to_string(columns.size()) + " columns but labels need 1");
     }
-    return container;
+    return columns;
 }
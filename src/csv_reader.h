@@ -11,7 +11,63 @@
 
 using FeatureNameMap = std::map<std::string, int>;
 
+/**
+ * Read a numeric CSV (with a header line) into (#samples, #features) messages
+ * @param dataFile
+ * @param addBias
+ *    Prepend a column of ones
+ * @return
+ */
 messageTensor readFeatures(const std::string &dataFile, bool addBias=true);
 messageTensor readLabels(const std::string &dataFIle);
 
+/**
+ * Same as readFeatures but laid out feature-major, (#features, #samples), which is what we encrypt. This is the fast
+ *    path: the file is memory-mapped, split into chunks at line boundaries and parsed with std::from_chars across
+ *    pTensor::m_numWorkers threads, writing every value straight into its place in the output. The bias row (if any)
+ *    is filled in up front, so no copies or transposes happen afterwards. The values are kept as real doubles, half
+ *    the size of the complex messages readFeatures returns.
+ *
+ *    The parsed columns are cached in a binary columnar file next to the CSV (dataFile + ".ptcols": shape, column
+ *    names and one contiguous run of doubles per column). Later loads memory-map the cache instead of parsing the
+ *    text, as long as the CSV's size and modification time still match the ones the cache was made from.
+ *
+ *    Throws std::runtime_error on unreadable files, unparsable values or ragged rows
+ * @param dataFile
+ * @param addBias
+ *    Prepend a row of ones
+ * @param useCache
+ *    Read (and write) the columnar cache. An unwritable directory just means there is no cache
+ * @return
+ */
+realTensor readFeaturesT(const std::string &dataFile, bool addBias=true, bool useCache=true);
+
+/**
+ * The columns of a numeric CSV and the names from its header
+ */
+struct csvColumns {
+  std::vector<std::string> names;
+  // (#columns, #samples) real doubles
+  messageStore values;
+};
+
+/**
+ * Same as readFeaturesT(dataFile, false, useCache) but without the copy into nested vectors: when the columnar cache
+ *    is up to date the values are a view of the memory-mapped cache (paged in as they are touched, and kept mapped for
+ *    as long as the view or a copy of it is alive). Otherwise the CSV is parsed and the cache (re)written. The result
+ *    can go straight to datasetProvider::fromFeatureMajor or a pTensor
+ * @param dataFile
+ * @param useCache
+ * @return
+ */
+csvColumns readColumnsT(const std::string &dataFile, bool useCache=true);
+
+/**
+ * Read a single-column CSV of labels as a (1, #samples) row. Cached like readFeaturesT
+ * @param dataFile
+ * @param useCache
+ * @return
+ */
+realTensor readLabelsT(const std::string &dataFile, bool useCache=true);
+
 #endif //CSV_READER_H
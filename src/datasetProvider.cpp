@@ -4,10 +4,7 @@
  */
 #include "datasetProvider.h"
 
-int f() {
-    static int i = 0;
-    return i++;
-}
+#include <numeric>
 
 template<typename order_iterator, typename value_iterator>
 void reorder(order_iterator order_begin, order_iterator order_end, value_iterator v) {
@@ -30,67 +27,215 @@ void reorder(order_iterator order_begin, order_iterator order_end, value_iterato
     }
 }
 
-providedDataset datasetProvider::provide(int randomState, bool encrypt) {
+datasetProvider datasetProvider::fromFeatureMajor(const messageStore &XT,
+                                                  const messageStore &yT,
+                                                  unsigned int numFolds) {
+    if (XT.empty() || yT.rows() != 1 || XT.cols() != yT.cols()) {
+        throw std::runtime_error("fromFeatureMajor() needs (#features, #samples) features and (1, #samples) labels");
+    }
+    datasetProvider provider;
+    provider.m_numCols = static_cast<unsigned int>(XT.rows());
+    provider.m_numRows = static_cast<unsigned int>(XT.cols());
+    provider.m_featuresT = XT.as(messagePrecision::realDouble).contiguous();
+    provider.m_labels = yT.as(messagePrecision::realDouble).contiguous();
+    provider.m_numFolds = numFolds;
+    return provider;
+}
+
+providedDataset datasetProvider::provide(int randomState, bool encrypt, pTensorLayout layout) {
 
     // Generate a vector of range values 0-#Rows
-    auto numberOfRows = std::get<0>(m_X.shape());
-    auto numberOfCols = std::get<1>(m_X.shape());
-    std::vector<int> indices(numberOfRows);
-    std::generate(indices.begin(), indices.end(), f);
+    std::vector<int> indices(m_numRows);
+    std::iota(indices.begin(), indices.end(), 0);
 
     std::random_device rd;
     auto rng = std::default_random_engine{rd()};
     rng.seed(randomState);
 
     providedDataset container;
-    std::string mode = (encrypt) ? "encrypted fold": "plaintext fold";
     for (unsigned int i = 0; i < m_numFolds; i++) {
         std::shuffle(std::begin(indices), std::end(indices), rng);
-        messageTensor shuffledXMessages;
-        messageTensor shuffledYMessages;
+        auto fold = makeFold(indices);
+        if (encrypt) {
+            // Encrypt as we go so that only one plaintext fold is ever alive
+            fold = encryptFold(fold, layout, i + 1, m_numFolds);
+        }
+        container.emplace_back(std::move(fold));
+    }
+    return container;
+}
 
-        messageTensor originalXMessages = m_X.getMessage();
-        messageTensor originalYMessages = m_y.getMessage();
+trainingPair datasetProvider::makeFold(const std::vector<int> &indices) const {
+    auto numberOfRows = static_cast<unsigned int>(indices.size());
 
-        for (auto &ind: indices) {
-            shuffledXMessages.emplace_back(originalXMessages[ind]);
-            shuffledYMessages.emplace_back(originalYMessages[ind]);
+    auto shuffledXT = messageStore::zeros<realScalar>(m_numCols, numberOfRows);
+    auto shuffledYT = messageStore::zeros<realScalar>(1, numberOfRows);
+    const realScalar *features = m_featuresT.data<realScalar>();
+    const realScalar *labels = m_labels.data<realScalar>();
+    realScalar *outX = shuffledXT.mutableData<realScalar>();
+    realScalar *outY = shuffledYT.mutableData<realScalar>();
+    for (unsigned int f = 0; f < m_numCols; ++f) {
+        const realScalar *feature = features + f * m_featuresT.rowStride();
+        realScalar *out = outX + f * shuffledXT.rowStride();
+        for (unsigned int j = 0; j < numberOfRows; ++j) {
+            out[j] = feature[indices[j]];
         }
+    }
+    for (unsigned int j = 0; j < numberOfRows; ++j) {
+        outY[j] = labels[indices[j]];
+    }
 
-        auto shuffledXT = pTensor::plainT(shuffledXMessages);
-        auto shuffledYT = pTensor::plainT(shuffledYMessages);
-        pTensor pTensorShuffledX(numberOfCols, numberOfRows, shuffledXT);
-        pTensor pTensorShuffledY(1, numberOfRows, shuffledYT);
+    pTensor pTensorShuffledX(m_numCols, numberOfRows, std::move(shuffledXT));
+    pTensor pTensorShuffledY(1, numberOfRows, std::move(shuffledYT));
+    return std::make_tuple(std::move(pTensorShuffledX), std::move(pTensorShuffledY));
+}
 
-        container.emplace_back(
-            std::make_tuple(pTensorShuffledX, pTensorShuffledY)
-        );
-    }
-    if (encrypt){
-        return encryptDataset(container);
+providedDataset datasetProvider::encryptDataset(const providedDataset& toBeEncrypted, pTensorLayout layout) {
+    providedDataset encryptedContainer;
+    encryptedContainer.reserve(toBeEncrypted.size());
+    unsigned int counter = 1;
+    for (auto &dataPair: toBeEncrypted){
+        encryptedContainer.emplace_back(encryptFold(dataPair, layout, counter, toBeEncrypted.size()));
+        counter += 1;
     }
-    return container;
+    return encryptedContainer;
 }
-providedDataset datasetProvider::encryptDataset(const providedDataset& toBeEncrypted) {
 
+trainingPair datasetProvider::encryptFold(const trainingPair &fold,
+                                          pTensorLayout layout,
+                                          unsigned int foldNumber,
+                                          size_t numFolds) {
     auto t1 = std::chrono::high_resolution_clock::now();
+    const auto &X = std::get<0>(fold);
+    const auto &y = std::get<1>(fold);
+    auto encrypted = std::make_tuple(X.encrypt(layout), y.encrypt(layout));
+
     auto t2 = std::chrono::high_resolution_clock::now();
-    providedDataset encryptedContainer;
-    int counter = 1;
-    for (auto &dataPair: toBeEncrypted){
-        t1 = std::chrono::high_resolution_clock::now();
-        auto X = std::get<0>(dataPair);
-        auto encX = X.encrypt();
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
+    auto numRows = std::get<0>(X.shape()) + std::get<0>(y.shape());
+    std::cout << "Took " << duration * 1e-6 << " seconds to encrypt fold " << foldNumber << "/" << numFolds
+              << " (" << numRows / (duration * 1e-6) << " rows/sec on "
+              << resolveNumWorkers(pTensor::m_numWorkers) << " workers)" << std::endl;
+    return encrypted;
+}
+
+std::unique_ptr<foldStream> datasetProvider::stream(int randomState,
+                                                   bool encrypt,
+                                                   pTensorLayout layout,
+                                                   unsigned int queueDepth,
+                                                   unsigned int numProducers) const {
+    return std::unique_ptr<foldStream>(
+        new foldStream(*this, randomState, encrypt, layout, queueDepth, numProducers, m_numRows)
+    );
+}
 
-        auto y = std::get<1>(dataPair);
-        auto ency = y.encrypt();
+std::unique_ptr<foldStream> datasetProvider::miniBatches(int randomState,
+                                                        unsigned int batchSize,
+                                                        bool encrypt,
+                                                        pTensorLayout layout,
+                                                        unsigned int queueDepth,
+                                                        unsigned int numProducers) const {
+    if (batchSize == 0) {
+        if (!pTensor::m_cc) {
+            throw std::runtime_error("miniBatches() needs pTensor::m_cc set to size the batches to the ciphertexts");
+        }
+        batchSize = static_cast<unsigned int>(pTensor::getBatchSize());
+    }
+    batchSize = std::min(batchSize, m_numRows);
+    return std::unique_ptr<foldStream>(
+        new foldStream(*this, randomState, encrypt, layout, queueDepth, numProducers, batchSize)
+    );
+}
 
-        encryptedContainer.emplace_back(std::make_tuple(encX, ency));
+foldStream::foldStream(const datasetProvider &provider,
+                       int randomState,
+                       bool encrypt,
+                       pTensorLayout layout,
+                       unsigned int queueDepth,
+                       unsigned int numProducers,
+                       unsigned int batchSize) :
+    m_provider(provider),
+    m_encrypt(encrypt),
+    m_layout(layout),
+    m_queueDepth(std::max(queueDepth, 1u)),
+    m_batchSize(batchSize),
+    m_batchesPerFold(batchSize == 0 ? 0 : provider.m_numRows / batchSize),
+    m_numItems(provider.m_numFolds * m_batchesPerFold),
+    m_rng(randomState),
+    m_indices(provider.m_numRows) {
+    std::iota(m_indices.begin(), m_indices.end(), 0);
 
-        t2 = std::chrono::high_resolution_clock::now();
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count();
-        std::cout << "Took " << duration * 1e-6 << " seconds to encrypt fold " << counter << "/" << toBeEncrypted.size() << std::endl;
-        counter += 1;
+    unsigned int producers = std::min(std::max(numProducers, 1u), m_queueDepth);
+    for (unsigned int p = 0; p < producers; ++p) {
+        m_producers.emplace_back(&foldStream::produce, this);
     }
-    return encryptedContainer;
+}
+
+foldStream::~foldStream() {
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stopping = true;
+    }
+    m_canProduce.notify_all();
+    for (auto &producer: m_producers) {
+        producer.join();
+    }
+}
+
+void foldStream::produce() {
+    while (true) {
+        unsigned int fold;
+        std::vector<int> indices;
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            m_canProduce.wait(lock, [this]() {
+                return m_stopping || m_claimed == m_numItems || m_claimed - m_delivered < m_queueDepth;
+            });
+            if (m_stopping || m_claimed == m_numItems) {
+                return;
+            }
+            fold = m_claimed++;
+            // Items are claimed in order so every fold is shuffled exactly once, before its first batch
+            unsigned int batch = fold % m_batchesPerFold;
+            if (batch == 0) {
+                std::shuffle(m_indices.begin(), m_indices.end(), m_rng);
+            }
+            auto begin = m_indices.begin() + batch * m_batchSize;
+            indices.assign(begin, begin + m_batchSize);
+        }
+
+        try {
+            auto pair = m_provider.makeFold(indices);
+            if (m_encrypt) {
+                pair = std::make_tuple(std::get<0>(pair).encrypt(m_layout), std::get<1>(pair).encrypt(m_layout));
+            }
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_ready.emplace(fold, std::move(pair));
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            if (!m_error) {
+                m_error = std::current_exception();
+            }
+            m_stopping = true;
+        }
+        m_canConsume.notify_all();
+    }
+}
+
+bool foldStream::next(trainingPair &fold) {
+    std::unique_lock<std::mutex> lock(m_lock);
+    if (m_delivered == m_numItems) {
+        return false;
+    }
+    m_canConsume.wait(lock, [this]() { return m_error || m_ready.count(m_delivered) != 0; });
+    if (m_error) {
+        std::rethrow_exception(m_error);
+    }
+    auto ready = m_ready.find(m_delivered);
+    fold = std::move(ready->second);
+    m_ready.erase(ready);
+    m_delivered += 1;
+    lock.unlock();
+    m_canProduce.notify_all();
+    return true;
 }
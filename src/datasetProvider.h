@@ -15,11 +15,18 @@
 #include <algorithm>
 #include <random>
 #include <chrono>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 
 using trainingPair = std::tuple<pTensor, pTensor>;
 using providedDataset = std::vector<trainingPair>;
 
+class foldStream;
+
 class datasetProvider {
  public:
   /**
@@ -48,33 +55,190 @@ class datasetProvider {
           std::cout << "X and Y need to have same number of observations" << std::endl;
       }
 
-      m_X = X;
-      m_y = y;
+      // Every fold gathers from these. We keep them feature-major since that is how the folds are laid out
+      m_numRows = std::get<0>(xShape);
+      m_numCols = std::get<1>(xShape);
+      m_featuresT = pTensor::plainT(X.messages().as(messagePrecision::realDouble));
+      m_labels = pTensor::plainT(y.messages().as(messagePrecision::realDouble));
       m_numFolds = numFolds;
   }
 
+  /**
+   * Create a dataset provider from data that is already feature-major, e.g. from readFeaturesT/readLabelsT. This
+   *    skips the transpose the constructor has to do
+   * @param XT
+   *    (#features, #samples) features, in any precision (a realTensor, messageTensor, ...). Kept as real doubles
+   * @param yT
+   *    (1, #samples) labels
+   * @param numFolds
+   * @return
+   */
+  static datasetProvider fromFeatureMajor(const messageStore &XT, const messageStore &yT, unsigned int numFolds);
+
   /**
    * Provide the shuffled dataset to be iterated over
    * @param randomState
    *    The random seed to use when shuffling
    * @param encrypt
    *    Whether to encrypt the results.
+   * @param layout
+   *    Layout of the encrypted folds. Ignored if we do not encrypt
    * @return
    */
-  providedDataset provide(int randomState = 42, bool encrypt = false);
+  providedDataset provide(int randomState = 42,
+                          bool encrypt = false,
+                          pTensorLayout layout = pTensorLayout::rowPerCipher);
 
   /**
    * If we are to encrypt, we call this at the end to go about encrypting
    * @param toBeEncrypted
+   * @param layout
+   *    Layout of the encrypted folds
    * @return
    */
-  providedDataset encryptDataset(const providedDataset& toBeEncrypted);
+  providedDataset encryptDataset(const providedDataset& toBeEncrypted,
+                                 pTensorLayout layout = pTensorLayout::rowPerCipher);
+
+  /**
+   * Like provide() but the folds are shuffled (and encrypted) on background threads and handed out one at a time
+   *    through a bounded queue. Training can start as soon as the first fold is ready and at most queueDepth folds
+   *    are held on top of the one being trained on. The folds are the same, and in the same order, as provide()'s.
+   *    NOTE: this datasetProvider has to outlive the stream
+   * @param randomState
+   * @param encrypt
+   * @param layout
+   * @param queueDepth
+   *    Maximum number of folds being built or waiting to be consumed
+   * @param numProducers
+   *    Number of folds built concurrently. Each fold encrypts its rows across pTensor::m_numWorkers threads already
+   * @return
+   */
+  std::unique_ptr<foldStream> stream(int randomState = 42,
+                                     bool encrypt = false,
+                                     pTensorLayout layout = pTensorLayout::rowPerCipher,
+                                     unsigned int queueDepth = 2,
+                                     unsigned int numProducers = 1) const;
+
+  /**
+   * Stream mini-batches for stochastic gradient descent. Every fold is shuffled like in provide() and then cut into
+   *    consecutive batches of batchSize observations which are built and encrypted independently (in the background,
+   *    like stream()). A step then only costs one batch instead of the whole dataset.
+   *    The last numRows % batchSize observations of each fold are dropped so every batch has the same size (and the
+   *    same 1 / batchSize scale); they are in other batches of the other folds since each fold is a new shuffle.
+   *    NOTE: this datasetProvider has to outlive the stream
+   * @param randomState
+   * @param batchSize
+   *    Observations per batch. 0 uses pTensor::getBatchSize(), i.e. exactly fills a ciphertext, which needs m_cc set.
+   *    Capped at the number of observations
+   * @param encrypt
+   * @param layout
+   * @param queueDepth
+   * @param numProducers
+   * @return
+   *    a stream of numFolds * (numRows / batchSize) (#features, batchSize) and (1, batchSize) pairs
+   */
+  std::unique_ptr<foldStream> miniBatches(int randomState = 42,
+                                          unsigned int batchSize = 0,
+                                          bool encrypt = true,
+                                          pTensorLayout layout = pTensorLayout::rowPerCipher,
+                                          unsigned int queueDepth = 2,
+                                          unsigned int numProducers = 1) const;
 
  private:
-  pTensor m_X;
-  pTensor m_y;
+  friend class foldStream;
+
+  datasetProvider() = default;
+
+  /**
+   * Build the (transposed) plaintext fold whose observations are the rows of X and y at the given indices. This is a
+   *    single gather out of the feature-major buffers straight into the fold's feature-major layout
+   */
+  trainingPair makeFold(const std::vector<int> &indices) const;
+
+  /**
+   * Encrypt a single fold, logging the throughput
+   */
+  static trainingPair encryptFold(const trainingPair &fold,
+                                  pTensorLayout layout,
+                                  unsigned int foldNumber,
+                                  size_t numFolds);
+
+  // A fold is only a permutation of the row indices into these, which are shared by every fold. Both are contiguous
+  //  row-major reals so a feature is one run of memory and we gather half the bytes complex messages would take
+  messageStore m_featuresT;  // (#features, #samples)
+  messageStore m_labels;  // (1, #samples)
+  unsigned int m_numRows = 0;
+  unsigned int m_numCols = 0;
   unsigned int m_numFolds;
 
 };
 
+/**
+ * Folds (or mini-batches of folds) produced in the background by datasetProvider::stream() and miniBatches(). next()
+ *    hands them out in order; destroying the stream stops the producers (after the fold they are working on) and joins
+ *    them.
+ */
+class foldStream {
+ public:
+  /**
+   * @param batchSize
+   *    Observations per item. Pass the number of observations to stream whole folds
+   */
+  foldStream(const datasetProvider &provider,
+             int randomState,
+             bool encrypt,
+             pTensorLayout layout,
+             unsigned int queueDepth,
+             unsigned int numProducers,
+             unsigned int batchSize);
+  ~foldStream();
+
+  foldStream(const foldStream &) = delete;
+  foldStream &operator=(const foldStream &) = delete;
+
+  /**
+   * Block until the next fold is ready and move it into fold. Rethrows anything a producer threw
+   * @param fold
+   * @return
+   *    false (leaving fold alone) once everything has been handed out
+   */
+  bool next(trainingPair &fold);
+
+  /**
+   * Total number of folds (or mini-batches) the stream hands out
+   */
+  unsigned int size() const { return m_numItems; }
+
+  /**
+   * Observations per fold (or mini-batch)
+   */
+  unsigned int batchSize() const { return m_batchSize; }
+
+ private:
+  void produce();
+
+  const datasetProvider &m_provider;
+  bool m_encrypt;
+  pTensorLayout m_layout;
+  unsigned int m_queueDepth;
+  unsigned int m_batchSize;
+  unsigned int m_batchesPerFold;
+  unsigned int m_numItems;
+
+  // Shuffled under the lock in fold order so that the folds match provide() whatever the number of producers
+  std::default_random_engine m_rng;
+  std::vector<int> m_indices;
+
+  unsigned int m_claimed = 0;
+  unsigned int m_delivered = 0;
+  std::map<unsigned int, trainingPair> m_ready;  // Finished folds keyed on their position in the stream
+  std::exception_ptr m_error = nullptr;
+  bool m_stopping = false;
+
+  std::mutex m_lock;
+  std::condition_variable m_canProduce;
+  std::condition_variable m_canConsume;
+  std::vector<std::thread> m_producers;
+};
+
 #endif //DATASETPROVIDER_H
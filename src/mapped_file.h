@@ -0,0 +1,91 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Read-only memory mapping of a file. The pages are only read in as they are touched and we avoid copying the whole
+ *  file into a buffer first, which matters for the multi-hundred-megabyte key bundles. POSIX only.
+ */
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <streambuf>
+#include <stdexcept>
+#include <string>
+
+class mappedFile {
+ public:
+  explicit mappedFile(const std::string &path) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd < 0) {
+          throw std::runtime_error("Could not open " + path + " for reading");
+      }
+      struct stat info{};
+      if (::fstat(fd, &info) != 0) {
+          ::close(fd);
+          throw std::runtime_error("Could not stat " + path);
+      }
+      m_size = static_cast<size_t>(info.st_size);
+      if (m_size > 0) {
+          void *data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+          if (data == MAP_FAILED) {
+              ::close(fd);
+              throw std::runtime_error("Could not mmap " + path);
+          }
+          m_data = static_cast<const char *>(data);
+      }
+      ::close(fd);  // The mapping keeps the file alive
+  }
+
+  ~mappedFile() {
+      if (m_data) {
+          ::munmap(const_cast<char *>(m_data), m_size);
+      }
+  }
+
+  mappedFile(const mappedFile &) = delete;
+  mappedFile &operator=(const mappedFile &) = delete;
+
+  const char *data() const { return m_data; }
+  size_t size() const { return m_size; }
+
+ private:
+  const char *m_data = nullptr;
+  size_t m_size = 0;
+};
+
+/**
+ * std::streambuf over a span of memory we do not own, e.g. part of a mappedFile, so that it can be handed to a
+ *  std::istream (and PALISADE's deserializers) without a copy
+ */
+class memoryStreambuf : public std::streambuf {
+ public:
+  memoryStreambuf(const char *data, size_t size) {
+      auto begin = const_cast<char *>(data);
+      setg(begin, begin, begin + size);
+  }
+
+ protected:
+  // Lets tellg() and seekg() work on the stream
+  pos_type seekoff(off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+      if (!(which & std::ios_base::in)) {
+          return pos_type(off_type(-1));
+      }
+      char *base = dir == std::ios_base::beg ? eback() : dir == std::ios_base::cur ? gptr() : egptr();
+      char *target = base + offset;
+      if (target < eback() || target > egptr()) {
+          return pos_type(off_type(-1));
+      }
+      setg(eback(), target, egptr());
+      return pos_type(target - eback());
+  }
+
+  pos_type seekpos(pos_type position, std::ios_base::openmode which) override {
+      return seekoff(off_type(position), std::ios_base::beg, which);
+  }
+};
+
+#endif //MAPPED_FILE_H
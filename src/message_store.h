@@ -0,0 +1,442 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * In-the-clear values of a pTensor. CKKS encodes complex numbers but everything we train on is real (the imaginary
+ *  parts are always 0), so the values can be held as complex<double>, double or float and are only widened to
+ *  complex<double> at the encode boundary (see row()). Real doubles take half the memory and bandwidth of complex
+ *  doubles and floats a quarter. A float keeps ~7 significant digits, which is still finer than the CKKS noise at
+ *  the usual scaling factors.
+ *
+ *  The values sit in one contiguous buffer that is addressed through a shape and a pair of strides, numpy style. That
+ *  makes transposes and row ranges O(1) views, and copies of a messageStore (and so of a plaintext pTensor) share the
+ *  buffer: it is never written to once it is shared. The buffer can also be memory we do not own, e.g. a memory-mapped
+ *  file (see external()), which is then read in place and only copied if it is written to. The nested messageTensor /
+ *  realTensor / floatTensor are only used at the API boundary, converting to and from them copies.
+ */
+#ifndef MESSAGE_STORE_H
+#define MESSAGE_STORE_H
+
+#include "transpose_kernels.h"
+#include <algorithm>
+#include <complex>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+using messageScalar = std::complex<double>;
+using messageVector = std::vector<messageScalar>;
+using messageTensor = std::vector<messageVector>;
+
+using realScalar = double;
+using realVector = std::vector<realScalar>;
+using realTensor = std::vector<realVector>;
+
+using floatScalar = float;
+using floatVector = std::vector<floatScalar>;
+using floatTensor = std::vector<floatVector>;
+
+/**
+ * Element type of a messageStore
+ */
+enum class messagePrecision {
+  complexDouble,
+  realDouble,
+  realFloat
+};
+
+class messageStore {
+  using buffer = std::variant<messageVector, realVector, floatVector>;
+
+  // Defined up here since the accessors below deduce their return types from these
+  std::ptrdiff_t index(size_t r, size_t c) const {
+      return static_cast<std::ptrdiff_t>(r) * m_rowStride + static_cast<std::ptrdiff_t>(c) * m_colStride;
+  }
+
+  /**
+   * Start of the buffer (ignoring m_offset) if it holds scalar, otherwise nullptr
+   */
+  template<class scalar>
+  const scalar *base() const {
+      if (m_external) {
+          return m_externalPrecision == precisionOf<scalar>() ? static_cast<const scalar *>(m_external) : nullptr;
+      }
+      auto *values = m_buffer ? std::get_if<std::vector<scalar>>(m_buffer.get()) : nullptr;
+      return values ? values->data() : nullptr;
+  }
+
+  /**
+   * Call fn with a pointer to our first value, typed as whatever the buffer holds
+   */
+  template<class visitor>
+  decltype(auto) withData(visitor &&fn) const {
+      switch (precision()) {
+          case messagePrecision::realDouble: return fn(base<realScalar>() + m_offset);
+          case messagePrecision::realFloat: return fn(base<floatScalar>() + m_offset);
+          default: return fn(base<messageScalar>() + m_offset);
+      }
+  }
+
+  bool hasBuffer() const { return m_buffer || m_external; }
+
+ public:
+  messageStore() = default;
+
+  // Implicit so that any of the nested tensors can be passed wherever a messageStore is expected. The rows are copied
+  //  into a row-major buffer and have to be the same length
+  messageStore(const messageTensor &rows) { assign(rows); }
+  messageStore(const realTensor &rows) { assign(rows); }
+  messageStore(const floatTensor &rows) { assign(rows); }
+
+  /**
+   * A (rows, cols) row-major store of zeros
+   * @tparam scalar
+   *    messageScalar, realScalar or floatScalar
+   */
+  template<class scalar>
+  static messageStore zeros(size_t rows, size_t cols) {
+      messageStore store;
+      store.m_buffer = std::make_shared<buffer>(std::vector<scalar>(rows * cols));
+      store.m_rows = rows;
+      store.m_cols = cols;
+      store.m_rowStride = static_cast<std::ptrdiff_t>(cols);
+      return store;
+  }
+
+  /**
+   * A (rows, cols) row-major store over values we do not own, e.g. part of a memory-mapped file. Nothing is copied:
+   *    owner is held on to for as long as any copy or view of the store is alive, and writing to the store (see
+   *    mutableData()) copies the values into a buffer of its own first
+   * @tparam scalar
+   *    messageScalar, realScalar or floatScalar
+   * @param values
+   *    rows * cols values, aligned for scalar
+   * @param owner
+   *    Whatever keeps values alive
+   */
+  template<class scalar>
+  static messageStore external(const scalar *values, size_t rows, size_t cols, std::shared_ptr<const void> owner) {
+      messageStore store;
+      store.m_external = values;
+      store.m_externalSize = rows * cols;
+      store.m_externalPrecision = precisionOf<scalar>();
+      store.m_owner = std::move(owner);
+      store.m_rows = rows;
+      store.m_cols = cols;
+      store.m_rowStride = static_cast<std::ptrdiff_t>(cols);
+      return store;
+  }
+
+  /**
+   * The element type of a scalar
+   */
+  template<class scalar>
+  static constexpr messagePrecision precisionOf() {
+      static_assert(std::is_same<scalar, messageScalar>::value || std::is_same<scalar, realScalar>::value
+                        || std::is_same<scalar, floatScalar>::value, "Not a message scalar");
+      return std::is_same<scalar, realScalar>::value ? messagePrecision::realDouble
+                                                     : std::is_same<scalar, floatScalar>::value
+                                                       ? messagePrecision::realFloat
+                                                       : messagePrecision::complexDouble;
+  }
+
+  /**
+   * The element type the values are stored as
+   */
+  messagePrecision precision() const {
+      if (m_external) {
+          return m_externalPrecision;
+      }
+      return m_buffer ? static_cast<messagePrecision>(m_buffer->index()) : messagePrecision::complexDouble;
+  }
+
+  /**
+   * Whether the values are memory we do not own (see external())
+   */
+  bool isExternal() const { return m_external != nullptr; }
+
+  size_t rows() const { return m_rows; }
+  size_t cols() const { return m_cols; }
+  bool empty() const { return m_rows == 0; }
+
+  /**
+   * Distance, in elements, between consecutive rows / columns
+   */
+  std::ptrdiff_t rowStride() const { return m_rowStride; }
+  std::ptrdiff_t colStride() const { return m_colStride; }
+
+  /**
+   * Whether the values are laid out row-major without gaps, i.e. data() can be read as one (rows * cols) array
+   */
+  bool isContiguous() const {
+      return (m_colStride == 1 || m_cols <= 1) && (m_rowStride == static_cast<std::ptrdiff_t>(m_cols) || m_rows <= 1);
+  }
+
+  /**
+   * A single value, widened to complex
+   */
+  messageScalar at(size_t r, size_t c) const {
+      return withData([&](const auto *values) { return messageScalar(values[index(r, c)]); });
+  }
+
+  /**
+   * A row widened to complex, i.e. ready to be encoded
+   */
+  messageVector row(size_t r) const {
+      messageVector widened(m_cols);
+      withData([&](const auto *values) {
+          const auto *first = values + index(r, 0);
+          for (size_t c = 0; c < m_cols; ++c) {
+              widened[c] = messageScalar(first[static_cast<std::ptrdiff_t>(c) * m_colStride]);
+          }
+      });
+      return widened;
+  }
+
+  /**
+   * The values, if they are stored as scalar, otherwise nullptr. Index them with rowStride() and colStride()
+   */
+  template<class scalar>
+  const scalar *data() const {
+      auto *values = base<scalar>();
+      return values ? values + m_offset : nullptr;
+  }
+
+  /**
+   * Writable data(). The buffer is copied first if anything else shares it, or if it is not ours
+   */
+  template<class scalar>
+  scalar *mutableData() {
+      if (m_external) {
+          auto *values = base<scalar>();
+          if (!values) {
+              return nullptr;
+          }
+          m_buffer = std::make_shared<buffer>(std::vector<scalar>(values, values + m_externalSize));
+          m_external = nullptr;
+          m_owner = nullptr;
+      } else if (m_buffer && m_buffer.use_count() != 1) {
+          m_buffer = std::make_shared<buffer>(*m_buffer);
+      }
+      auto *values = m_buffer ? std::get_if<std::vector<scalar>>(m_buffer.get()) : nullptr;
+      return values ? values->data() + m_offset : nullptr;
+  }
+
+  /**
+   * Copy of the values as nested rows of the given scalar type. Narrowing drops the imaginary parts (and rounds for
+   *    float)
+   * @tparam scalar
+   *    messageScalar, realScalar or floatScalar
+   * @return
+   */
+  template<class scalar>
+  std::vector<std::vector<scalar>> to() const {
+      std::vector<std::vector<scalar>> rows(m_rows, std::vector<scalar>(m_cols));
+      if (m_rows == 0 || m_cols == 0) {
+          return rows;
+      }
+      withData([&](const auto *values) {
+          for (size_t r = 0; r < m_rows; ++r) {
+              const auto *first = values + index(r, 0);
+              for (size_t c = 0; c < m_cols; ++c) {
+                  rows[r][c] = castTo<scalar>(first[static_cast<std::ptrdiff_t>(c) * m_colStride]);
+              }
+          }
+      });
+      return rows;
+  }
+
+  /**
+   * Convert to the given precision. Narrowing drops the imaginary parts (and rounds for realFloat). Shares the
+   *    buffer if we are already stored that way
+   */
+  messageStore as(messagePrecision precision) const {
+      if (precision == this->precision() || !hasBuffer()) {
+          return *this;
+      }
+      switch (precision) {
+          case messagePrecision::realDouble: return convertTo<realScalar>();
+          case messagePrecision::realFloat: return convertTo<floatScalar>();
+          default: return convertTo<messageScalar>();
+      }
+  }
+
+  /**
+   * The transpose as a view of the same buffer
+   */
+  messageStore transposed() const {
+      messageStore view = *this;
+      std::swap(view.m_rows, view.m_cols);
+      std::swap(view.m_rowStride, view.m_colStride);
+      return view;
+  }
+
+  /**
+   * Rows [begin, end) as a view of the same buffer
+   */
+  messageStore rowRange(size_t begin, size_t end) const {
+      if (begin > end || end > m_rows) {
+          throw std::runtime_error("Row range [" + std::to_string(begin) + ", " + std::to_string(end)
+                                       + ") is out of bounds for " + std::to_string(m_rows) + " rows");
+      }
+      messageStore view = *this;
+      view.m_offset += static_cast<std::ptrdiff_t>(begin) * m_rowStride;
+      view.m_rows = end - begin;
+      return view;
+  }
+
+  /**
+   * Row-major copy of a view. Shares the buffer if there is nothing to rearrange. Materializing a transposed view is
+   *    a cache-blocked (and vectorized, see transpose_kernels.h) transpose
+   * @param numWorkers
+   *    Threads to transpose large views with (see resolveNumWorkers)
+   */
+  messageStore contiguous(unsigned int numWorkers = 1) const {
+      if (isContiguous() || !hasBuffer()) {
+          return *this;
+      }
+      return withData([this, numWorkers](const auto *values) {
+          using scalar = std::remove_const_t<std::remove_pointer_t<decltype(values)>>;
+          auto store = zeros<scalar>(m_rows, m_cols);
+          copyInto(store.template mutableData<scalar>(), numWorkers);
+          return store;
+      });
+  }
+
+  /**
+   * The rows of top followed by the rows of bottom. The precision is kept if both match, otherwise the result is
+   *    complex so that nothing is lost
+   */
+  static messageStore concatRows(const messageStore &top, const messageStore &bottom) {
+      if (!top.hasBuffer() || top.empty()) {
+          return bottom;
+      }
+      if (!bottom.hasBuffer() || bottom.empty()) {
+          return top;
+      }
+      if (top.m_cols != bottom.m_cols) {
+          throw std::runtime_error("Cannot stack rows of " + std::to_string(top.m_cols) + " and "
+                                       + std::to_string(bottom.m_cols) + " values");
+      }
+      if (top.precision() != bottom.precision()) {
+          return concatRows(top.as(messagePrecision::complexDouble), bottom.as(messagePrecision::complexDouble));
+      }
+      return top.withData([&](const auto *values) {
+          using scalar = std::remove_const_t<std::remove_pointer_t<decltype(values)>>;
+          auto store = zeros<scalar>(top.m_rows + bottom.m_rows, top.m_cols);
+          scalar *out = store.template mutableData<scalar>();
+          top.copyInto(out);
+          bottom.copyInto(out + top.m_rows * top.m_cols);
+          return store;
+      });
+  }
+
+  /**
+   * Whether every imaginary part is 0, i.e. whether the values can be stored as reals without losing anything
+   */
+  static bool isReal(const messageTensor &rows) {
+      for (auto &row: rows) {
+          for (auto &value: row) {
+              if (value.imag() != 0) {
+                  return false;
+              }
+          }
+      }
+      return true;
+  }
+
+  /**
+   * Number of bytes taken up by the values we address
+   */
+  size_t bytes() const {
+      if (!hasBuffer()) {
+          return 0;
+      }
+      return m_rows * m_cols * withData([](const auto *values) { return sizeof(*values); });
+  }
+
+ private:
+  template<class target, class source>
+  static target castTo(const source &value) {
+      if constexpr (std::is_same<source, messageScalar>::value && !std::is_same<target, messageScalar>::value) {
+          return static_cast<target>(value.real());
+      } else {
+          return static_cast<target>(value);
+      }
+  }
+
+  template<class scalar>
+  void assign(const std::vector<std::vector<scalar>> &rows) {
+      size_t cols = rows.empty() ? 0 : rows[0].size();
+      *this = zeros<scalar>(rows.size(), cols);
+      scalar *out = mutableData<scalar>();
+      for (auto &row: rows) {
+          if (row.size() != cols) {
+              throw std::runtime_error("Every row of a message needs the same length. Got rows of "
+                                           + std::to_string(cols) + " and " + std::to_string(row.size()));
+          }
+          out = std::copy(row.begin(), row.end(), out);
+      }
+  }
+
+  template<class target>
+  messageStore convertTo() const {
+      auto store = zeros<target>(m_rows, m_cols);
+      target *out = store.template mutableData<target>();
+      withData([&](const auto *values) {
+          for (size_t r = 0; r < m_rows; ++r) {
+              for (size_t c = 0; c < m_cols; ++c) {
+                  *out++ = castTo<target>(values[index(r, c)]);
+              }
+          }
+      });
+      return store;
+  }
+
+  /**
+   * Write our values row-major into out, which has to hold the same scalar type as our buffer
+   */
+  template<class scalar>
+  void copyInto(scalar *out, unsigned int numWorkers = 1) const {
+      const scalar *values = data<scalar>();
+      if (isContiguous()) {
+          std::copy(values, values + m_rows * m_cols, out);
+          return;
+      }
+      if (m_colStride == 1) {
+          for (size_t r = 0; r < m_rows; ++r) {
+              std::copy(values + index(r, 0), values + index(r, 0) + m_cols, out + r * m_cols);
+          }
+          return;
+      }
+      if (m_rowStride == 1) {
+          // A transposed row-major buffer: its (m_cols, m_rows) rows are m_colStride apart
+          blockedTranspose(values, m_cols, m_rows, m_colStride, out, static_cast<std::ptrdiff_t>(m_cols), numWorkers);
+          return;
+      }
+      for (size_t r = 0; r < m_rows; ++r) {
+          for (size_t c = 0; c < m_cols; ++c) {
+              *out++ = values[index(r, c)];
+          }
+      }
+  }
+
+  std::shared_ptr<buffer> m_buffer;
+  // Set instead of m_buffer when the values are not ours, see external()
+  const void *m_external = nullptr;
+  size_t m_externalSize = 0;
+  messagePrecision m_externalPrecision = messagePrecision::complexDouble;
+  std::shared_ptr<const void> m_owner;
+  std::ptrdiff_t m_offset = 0;
+  size_t m_rows = 0;
+  size_t m_cols = 0;
+  std::ptrdiff_t m_rowStride = 0;
+  std::ptrdiff_t m_colStride = 1;
+};
+
+#endif //MESSAGE_STORE_H
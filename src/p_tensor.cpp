@@ -3,45 +3,349 @@
  * Date: 12/22/20
  */
 #include "p_tensor.h"
+#include <map>
+#include <numeric>
 
 lbcrypto::CryptoContext<lbcrypto::DCRTPoly> *pTensor::m_cc = nullptr;
 shared_ptr<lbcrypto::LPPublicKeyImpl<lbcrypto::DCRTPoly>> pTensor::m_public_key = nullptr;
 shared_ptr<lbcrypto::LPPrivateKeyImpl<lbcrypto::DCRTPoly>> pTensor::m_private_key = nullptr;
 
-pTensor pTensor::encrypt() {
+unsigned int pTensor::m_numWorkers = 0;
+bool pTensor::m_lazy = false;
+uint32_t pTensor::m_multDepth = 0;
+std::atomic<double> pTensor::m_lastThroughput(0.0);
+std::atomic<unsigned int> pTensor::m_refreshCount(0);
+plaintextCache pTensor::m_plaintextCache;
+std::shared_ptr<const pTensor::slotMaskSet> pTensor::m_rowSlotMasks = nullptr;
+
+void pTensor::recordThroughput(unsigned int numRows, std::chrono::high_resolution_clock::time_point start) {
+    auto end = std::chrono::high_resolution_clock::now();
+    double seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() * 1e-6;
+    m_lastThroughput = (seconds > 0) ? numRows / seconds : 0.0;
+}
+
+lbcrypto::Plaintext pTensor::encode(const messageVector &values, uint32_t level) {
+    assert(m_cc != nullptr);
+    return m_plaintextCache.encode(*m_cc, values, level);
+}
+
+std::shared_ptr<const std::vector<lbcrypto::Plaintext>> pTensor::rowSlotMasks(unsigned int rows, uint32_t level) {
+    assert(m_cc != nullptr);
+    auto last = std::atomic_load(&m_rowSlotMasks);
+    if (last && last->rows == rows && last->level == level && last->context.lock() == *m_cc) {
+        return last->masks;
+    }
+    unsigned int offset = 2 * getBatchSize() - rows;
+    auto masks = std::make_shared<std::vector<lbcrypto::Plaintext>>(rows);
+    parallelFor(rows, m_numWorkers, [&](unsigned int i) {
+        messageVector slotMask(offset + i + 1, 0.0);
+        slotMask[offset + i] = 1;
+        (*masks)[i] = (*m_cc)->MakeCKKSPackedPlaintext(slotMask, 1, level);
+    });
+    std::atomic_store(&m_rowSlotMasks, std::shared_ptr<const slotMaskSet>(
+        new slotMaskSet{*m_cc, rows, level, masks}));
+    return masks;
+}
+
+std::vector<int32_t> pTensor::rotationIndices() {
+    std::vector<int32_t> indices;
+    for (int32_t step = 1; step <= getBatchSize(); step <<= 1) {
+        indices.emplace_back(step);
+        indices.emplace_back(-step);
+    }
+    indices.emplace_back(getRepeatBatchSize());
+    return indices;
+}
+
+std::vector<int> pTensor::rotationSteps(int offset) {
+    // Non-adjacent form of the offset: every digit is 0 or +-1 and no two neighbouring digits are non-zero, so this
+    // is at most log2(offset) + 1 steps and usually fewer than the plain binary form (e.g. 7 = 8 - 1)
+    std::vector<int> steps;
+    int remaining = offset;
+    for (int step = 1; remaining != 0; step <<= 1) {
+        if (remaining % 2 != 0) {
+            int digit = (((remaining % 4) + 4) % 4 == 1) ? 1 : -1;
+            steps.emplace_back(digit * step);
+            remaining -= digit;
+        }
+        remaining /= 2;
+    }
+    // Largest step first, so that offsets close to each other share their leading steps in rotateMany
+    std::reverse(steps.begin(), steps.end());
+    return steps;
+}
+
+cipherVector pTensor::rotate(const cipherVector &cipher, int offset) {
+    cipherVector rotated = cipher;
+    for (int step: rotationSteps(offset)) {
+        rotated = evalAtIndex(rotated, step);
+    }
+    return rotated;
+}
+
+void pTensor::addInto(cipherVector &into, const cipherVector &from) {
+    if (into.use_count() == 1) {
+        (*m_cc)->EvalAddInPlace(into, from);
+    } else {
+        into = (*m_cc)->EvalAdd(into, from);
+    }
+}
+
+cipherVector pTensor::treeSum(const cipherTensor &ciphers) {
+    // The copy shares its ciphertexts with ciphers so the first layer adds out of place. Every layer after that
+    //  accumulates into the sums of the first
+    cipherTensor partial = ciphers;
+    treeSumInPlace(partial);
+    return partial[0];
+}
+
+void pTensor::treeSumInPlace(cipherTensor &ciphers) {
+    if (ciphers.empty()) {
+        throw std::runtime_error("treeSum() needs at least one ciphertext");
+    }
+    // Adjacent blocks are added together layer by layer: no encrypted zero to start from, log2(n) adds deep and every
+    // layer is spread over the workers. The pairing is fixed so the result is the same for any number of workers
+    for (size_t stride = 1; stride < ciphers.size(); stride *= 2) {
+        auto pairs = static_cast<unsigned int>((ciphers.size() + 2 * stride - 1) / (2 * stride));
+        parallelFor(pairs, m_numWorkers, [&](unsigned int j) {
+            size_t i = 2 * stride * j;
+            if (i + stride < ciphers.size()) {
+                addInto(ciphers[i], ciphers[i + stride]);
+            }
+        });
+    }
+}
+
+cipherTensor pTensor::rotateMany(const cipherVector &cipher, const std::vector<int> &offsets) {
+    // The first step of every offset starts from the same ciphertext so those are hoisted: the key-switching digit
+    // decomposition is computed once and re-used. After that, partially rotated ciphertexts are shared between the
+    // offsets that pass through them
+    auto digits = evalFastRotationPrecompute(cipher);
+    auto m = (*m_cc)->GetCyclotomicOrder();
+
+    std::map<int, cipherVector> partial;
+    partial[0] = cipher;
+    cipherTensor rotated;
+    for (int offset: offsets) {
+        int cumulative = 0;
+        for (int step: rotationSteps(offset)) {
+            int next = cumulative + step;
+            if (partial.find(next) == partial.end()) {
+                partial[next] = (cumulative == 0) ?
+                                evalFastRotation(cipher, step, m, digits) :
+                                evalAtIndex(partial[cumulative], step);
+            }
+            cumulative = next;
+        }
+        rotated.emplace_back(partial[cumulative]);
+    }
+    return rotated;
+}
+
+pTensor pTensor::rotate(int offset) {
+    eval();
+    auto trace = traceOp("rotate");
+    assert(m_cc != nullptr && cipherNotEmpty());
+    pTensor newTensor = *this;
+    cipherTensor rotated(m_ciphertexts.size());
+    parallelFor(m_ciphertexts.size(), m_numWorkers, [&](unsigned int i) {
+        rotated[i] = rotate(m_ciphertexts[i], offset);
+    });
+    newTensor.m_ciphertexts = rotated;
+    return newTensor;
+}
+
+std::vector<pTensor> pTensor::rotations(const std::vector<int> &offsets) {
+    eval();
+    auto trace = traceOp("rotations");
+    assert(m_cc != nullptr && cipherNotEmpty());
+    std::vector<cipherTensor> rotatedRows(m_ciphertexts.size());
+    parallelFor(m_ciphertexts.size(), m_numWorkers, [&](unsigned int i) {
+        rotatedRows[i] = rotateMany(m_ciphertexts[i], offsets);
+    });
+
+    std::vector<pTensor> rotated(offsets.size(), *this);
+    for (unsigned int o = 0; o < offsets.size(); ++o) {
+        for (unsigned int i = 0; i < m_ciphertexts.size(); ++i) {
+            rotated[o].m_ciphertexts[i] = rotatedRows[i][o];
+        }
+    }
+    return rotated;
+}
+
+cipherVector pTensor::replicateScalar() const {
+    assert(m_isEncrypted && isScalar());
+    if (m_isRepeated) {
+        return m_ciphertexts[0];
+    }
+    // Created on first use. Concurrent first calls race to install theirs and all use whichever one won
+    auto replica = std::atomic_load(&m_replica);
+    if (!replica) {
+        auto fresh = std::make_shared<scalarReplica>();
+        if (std::atomic_compare_exchange_strong(&m_replica, &replica, fresh)) {
+            replica = fresh;
+        }
+    }
+    std::lock_guard<std::mutex> guard(replica->lock);
+    if (replica->source != m_ciphertexts[0]) {
+        // Get how much to sum over and rotate.
+        // We've now summed it up and it should be projected into the back
+        auto summed = evalSum(m_ciphertexts[0], -getRepeatBatchSize());
+        // The last rot entries are now populated with the value. We then rotate them back and we are done.
+        replica->replicated = evalAtIndex(summed, getRepeatBatchSize());
+        replica->source = m_ciphertexts[0];
+    }
+    return replica->replicated;
+}
+
+pTensor pTensor::encrypt() const {
+    auto trace = traceOp("encrypt");
+    assert(messageNotEmpty() && m_public_key != nullptr && m_cc != nullptr);
+    auto start = std::chrono::high_resolution_clock::now();
+
+    // Pre-size the container so every worker writes into its own row and the ordering is preserved
+    cipherTensor ct(m_messages.rows());
+    parallelFor(m_messages.rows(), m_numWorkers, [&](unsigned int i) {
+        lbcrypto::Plaintext packedPT = (*m_cc)->MakeCKKSPackedPlaintext(m_messages.row(i));
+        ct[i] = encryptPlaintext(packedPT);
+    });
+    recordThroughput(m_messages.rows(), start);
+
+    pTensor newTensor(m_rows, m_cols, std::move(ct));
+    newTensor.m_isEncrypted = true;
+    return newTensor;
+}
+
+pTensor pTensor::encrypt(pTensorLayout layout) const {
+    if (layout == pTensorLayout::rowPerCipher) {
+        return encrypt();
+    }
+    auto trace = traceOp("encrypt");
     assert(messageNotEmpty() && m_public_key != nullptr && m_cc != nullptr);
-    cipherTensor ct;
-    // encrypt and place into container
-    for (auto &vec: m_messages) {
-        lbcrypto::Plaintext packedPT = (*m_cc)->MakeCKKSPackedPlaintext(vec);
-        auto resp = (*m_cc)->Encrypt(m_public_key, packedPT);
-        ct.emplace_back(resp);
+    auto start = std::chrono::high_resolution_clock::now();
+
+    pTensor newTensor;
+    newTensor.m_rows = m_rows;
+    newTensor.m_cols = m_cols;
+    newTensor.m_layout = layout;
+    newTensor.m_blockSize = blockSizeFor(newTensor.lineLength());
+    if (newTensor.m_blockSize > static_cast<unsigned int>(getBatchSize())) {
+        throw std::runtime_error("Cannot pack lines of length " + std::to_string(newTensor.lineLength())
+                                     + " into " + std::to_string(getBatchSize()) + " slots");
     }
 
-    pTensor newTensor(m_rows, m_cols, ct);
+    auto slots = newTensor.packMessages(m_messages);
+    cipherTensor ct(slots.size());
+    parallelFor(slots.size(), m_numWorkers, [&](unsigned int i) {
+        ct[i] = encryptPlaintext((*m_cc)->MakeCKKSPackedPlaintext(slots[i]));
+    });
+    recordThroughput(m_rows, start);
+
+    newTensor.m_ciphertexts = ct;
     newTensor.m_isEncrypted = true;
     return newTensor;
 }
 
-pTensor pTensor::decrypt() {
+pTensor pTensor::decrypt() const {
+    if (isPending()) {
+        return evaluated().decrypt();
+    }
+    auto trace = traceOp("decrypt");
     assert(cipherNotEmpty() && m_private_key != nullptr && m_cc != nullptr);
-    messageTensor mt;
-    lbcrypto::Plaintext pt;
-    for (auto &vec: m_ciphertexts) {
-        (*m_cc)->Decrypt(m_private_key, vec, &pt); // pt now contains the decrypted val
-        unsigned int numCols;
-        if (m_isRepeated) {
-            numCols = 1;
-        } else {
-            numCols = m_cols;
+    auto start = std::chrono::high_resolution_clock::now();
+
+    unsigned int numCols;
+    if (m_isRepeated) {
+        numCols = 1;
+    } else {
+        numCols = m_cols;
+    }
+    bool packed = (m_layout != pTensorLayout::rowPerCipher);
+    messageTensor slots(packed ? m_ciphertexts.size() : 0);
+    auto message = messageStore::zeros<messageScalar>(packed ? 0 : m_ciphertexts.size(), numCols);
+    messageScalar *out = message.mutableData<messageScalar>();
+    parallelFor(m_ciphertexts.size(), m_numWorkers, [&](unsigned int i) {
+        lbcrypto::Plaintext pt = decryptCipher(m_ciphertexts[i]);
+        pt->SetLength(packed ? (linesInCipher(i) - 1) * m_blockSize + lineLength() : numCols);
+        if (packed) {
+            slots[i] = pt->GetCKKSPackedValue();
+            return;
         }
-        pt->SetLength(numCols);
-        mt.emplace_back(pt->GetCKKSPackedValue());
+        // Every row goes straight into its place in the result
+        const auto &values = pt->GetCKKSPackedValue();
+        std::copy_n(values.begin(), std::min<size_t>(numCols, values.size()), out + i * numCols);
+    });
+    if (packed) {
+        message = unpackMessages(slots, numCols);
     }
+    recordThroughput(m_rows, start);
 
-    pTensor newTensor(m_rows, m_cols, mt);
+    pTensor newTensor(m_rows, m_cols, std::move(message));
     return newTensor;
 }
+uint32_t pTensor::level() const {
+    if (isPending()) {
+        return evaluated().level();
+    }
+    assert(cipherNotEmpty());
+    uint32_t used = 0;
+    for (auto &cipher: m_ciphertexts) {
+        // A fresh ciphertext has depth 1. Anything above that is a multiplication waiting to be rescaled
+        used = std::max(used, static_cast<uint32_t>(cipher->GetLevel() + cipher->GetDepth() - 1));
+    }
+    return used;
+}
+
+double pTensor::scale() const {
+    if (isPending()) {
+        return evaluated().scale();
+    }
+    assert(cipherNotEmpty());
+    double maxScale = 0;
+    for (auto &cipher: m_ciphertexts) {
+        maxScale = std::max(maxScale, cipher->GetScalingFactor());
+    }
+    return maxScale;
+}
+
+uint32_t pTensor::remainingDepth() const {
+    if (m_multDepth == 0) {
+        throw std::runtime_error("remainingDepth() needs pTensor::m_multDepth to be set");
+    }
+    auto used = level();
+    return (used >= m_multDepth) ? 0 : m_multDepth - used;
+}
+
+pTensor pTensor::refreshIfNeeded(uint32_t plannedDepth) const {
+    if (isPending()) {
+        return evaluated().refreshIfNeeded(plannedDepth);
+    }
+    if (m_multDepth == 0 || !m_isEncrypted || remainingDepth() >= plannedDepth) {
+        return *this;
+    }
+    if (plannedDepth > m_multDepth) {
+        throw std::runtime_error("Planned depth of " + std::to_string(plannedDepth)
+                                     + " is more than a fresh ciphertext has (m_multDepth = "
+                                     + std::to_string(m_multDepth) + ")");
+    }
+    auto trace = traceOp("refresh");
+    m_refreshCount += 1;
+    return decrypt().encrypt(m_layout);
+}
+
+void pTensor::checkDepth(const pTensor &other) const {
+    if (m_multDepth == 0) {
+        return;
+    }
+    bool lhsSpent = (m_isEncrypted && remainingDepth() == 0);
+    bool rhsSpent = (other.m_isEncrypted && other.remainingDepth() == 0);
+    if (lhsSpent || rhsSpent) {
+        throw std::runtime_error(std::string("Multiplicative depth exhausted on the ") + (lhsSpent ? "LHS" : "RHS")
+                                     + " (m_multDepth = " + std::to_string(m_multDepth)
+                                     + "). Call refreshIfNeeded(plannedDepth) on it before the multiplication");
+    }
+}
+
 // Cipher-Cipher
 cipherVector pTensor::applyBinaryOp(const char *opFlag, const cipherVector &a1, const cipherVector &a2) const {
     cipherVector op_res;
@@ -50,7 +354,7 @@ cipherVector pTensor::applyBinaryOp(const char *opFlag, const cipherVector &a1,
     } else if (std::strcmp(opFlag, "sub") == 0) {
         op_res = (*m_cc)->EvalSub(a1, a2);
     } else if (std::strcmp(opFlag, "mult") == 0) {
-        op_res = (*m_cc)->EvalMult(a1, a2);
+        op_res = evalMult(a1, a2);
 
     }
     return op_res;
@@ -63,16 +367,21 @@ cipherVector pTensor::applyBinaryOp(const char *opFlag, const cipherVector &a1,
     } else if (std::strcmp(opFlag, "sub") == 0) {
         op_res = (*m_cc)->EvalSub(a1, a2);
     } else if (std::strcmp(opFlag, "mult") == 0) {
-        op_res = (*m_cc)->EvalMult(a1, a2);
+        op_res = evalMult(a1, a2);
     }
     return op_res;
 }
-cipherTensor pTensor::binaryOpAbstraction(const char *flag,
-                                          pTensor other) {
+cipherTensor pTensor::binaryOpAbstraction(const char *flag, const pTensor &other) const {
+    bool otherPacked = other.m_isEncrypted && other.m_layout != pTensorLayout::rowPerCipher && !other.isScalar();
+    if (m_layout != pTensorLayout::rowPerCipher || otherPacked) {
+        return packedBinaryOp(flag, other);
+    }
     cipherTensor ciphertextContainer;
 
     // Now, we know that it is broadcast-able. Therefore, they either have the same shape or one is shape 1 in rows
     cipherVector op_res;
+    lbcrypto::Plaintext broadcastPT;
+    cipherVector replicated;
     for (unsigned int i = 0; i < std::max(m_rows, other.m_rows); i++) {
         unsigned int lhsInd;
         unsigned int rhsInd;
@@ -88,62 +397,141 @@ cipherTensor pTensor::binaryOpAbstraction(const char *flag,
             rhsInd = i;
         }
         if (other.m_isEncrypted) {
-            cipherVector otherVec;
-
-            // If it is a scalar that has not been repeated, we repeat it.
-            if (other.isScalar() && !(other.m_isRepeated)) {
-
-                // Get how much to sum over and rotate.
-                // We've now summed it up and it should be projected into the back
-                otherVec = (*m_cc)->EvalSum(other.m_ciphertexts[0], -getRepeatBatchSize());
-                // The last rot entries are now populated with the value. We then rotate them back and we are done.
-                otherVec = (*m_cc)->EvalAtIndex(otherVec, getRepeatBatchSize());
-
-            } else {
-                otherVec = other.m_ciphertexts[rhsInd];
+            // If it is a scalar we repeat it. This is done once for all rows (and cached on other)
+            if (!replicated) {
+                replicated = other.isScalar() ? other.replicateScalar() : nullptr;
             }
+            cipherVector otherVec = other.isScalar() ? replicated : other.m_ciphertexts[rhsInd];
             op_res = applyBinaryOp(flag, m_ciphertexts[lhsInd], otherVec);
         } else {
-            messageVector otherVec;
-            if (other.isScalar()) {  // We repeat the value n_cols times across then do the operation.
-                otherVec = messageVector(m_cols, other.m_messages[0][0]);
-            } else {
-                otherVec = other.m_messages[rhsInd];
+            // Scalars and broadcast rows are the same for every LHS row so we only encode them once
+            if (!broadcastPT || other.m_rows != 1) {
+                messageVector otherVec;
+                if (other.isScalar()) {  // We repeat the value n_cols times across then do the operation.
+                    otherVec = messageVector(m_cols, other.m_messages.at(0, 0));
+                } else {
+                    otherVec = other.m_messages.row(rhsInd);
+                }
+                broadcastPT = encode(otherVec, m_ciphertexts[lhsInd]->GetLevel());
             }
-            lbcrypto::Plaintext intermediary = (*m_cc)->MakeCKKSPackedPlaintext(otherVec);
-            op_res = applyBinaryOp(flag, m_ciphertexts[lhsInd], intermediary);
+            op_res = applyBinaryOp(flag, m_ciphertexts[lhsInd], broadcastPT);
         }
         ciphertextContainer.emplace_back(op_res);
     }
     return ciphertextContainer;
 }
 
-pTensor pTensor::operator+(pTensor &other) {
+pTensor pTensor::eagerBinaryOp(const char *flag, const pTensor &other) const {
     assert (m_cc != nullptr && (cipherNotEmpty())
                 && (other.messageNotEmpty() || other.cipherNotEmpty()));
+    if (std::strcmp(flag, "mult") == 0) {
+        checkDepth(other);
+    }
     shapeVerifier(*this, other);
     auto resCols = std::max(m_cols, other.m_cols);
     auto resRows = std::max(m_rows, other.m_rows);
 
     // Now, we know that it is broadcast-able. Therefore, they either have the same shape or one is shape 1 in rows
-    cipherTensor ciphertextContainer = binaryOpAbstraction("add", other);
+    cipherTensor ciphertextContainer = binaryOpAbstraction(flag, other);
     pTensor newTensor(
-        resRows, resCols, ciphertextContainer
+        resRows, resCols, std::move(ciphertextContainer)
     ); // Numpy requires that the output is the max of both
     newTensor.m_isEncrypted = m_isEncrypted;
+    newTensor.m_layout = m_layout;
+    newTensor.m_blockSize = m_blockSize;
     return newTensor;
 }
-pTensor pTensor::operator+(messageTensor &other) {
+
+pTensor &pTensor::inPlaceBinaryOp(const char *flag, const pTensor &other) {
+    eval();
+    if (other.isPending()) {
+        return inPlaceBinaryOp(flag, other.evaluated());
+    }
+    assert (m_cc != nullptr && (cipherNotEmpty())
+                && (other.messageNotEmpty() || other.cipherNotEmpty()));
+    shapeVerifier(*this, other);
+    if (other.m_rows > m_rows || other.m_cols > m_cols) {
+        throw std::runtime_error("In-place ops cannot broadcast the LHS up to the shape of the RHS. Use the out of "
+                                 "place operator instead");
+    }
+
+    if (std::strcmp(flag, "mult") == 0) {
+        checkDepth(other);
+    }
+    bool otherPacked = other.m_isEncrypted && other.m_layout != pTensorLayout::rowPerCipher && !other.isScalar();
+    if (!m_isEncrypted || m_layout != pTensorLayout::rowPerCipher || otherPacked || &other == this) {
+        // The packed ops build new ciphertexts regardless, so there is nothing to save there
+        *this = eagerBinaryOp(flag, other);
+        return *this;
+    }
+
+    bool isAdd = (std::strcmp(flag, "add") == 0);
+    cipherVector replicated = (other.m_isEncrypted && other.isScalar()) ? other.replicateScalar() : nullptr;
+    parallelFor(m_rows, m_numWorkers, [&](unsigned int i) {
+        unsigned int rhsInd = (other.m_rows == 1) ? 0 : i;
+        cipherVector &lhs = m_ciphertexts[i];
+        if (other.m_isEncrypted) {
+            const cipherVector &rhs = replicated ? replicated : other.m_ciphertexts[rhsInd];
+            if (isAdd) {
+                addInto(lhs, rhs);
+            } else {
+                lhs = applyBinaryOp(flag, lhs, rhs);
+            }
+        } else if (other.isScalar()) {
+            auto repeated = messageVector(m_cols, other.m_messages.at(0, 0));
+            lhs = applyBinaryOp(flag, lhs, encode(repeated, lhs->GetLevel()));
+        } else {
+            lhs = applyBinaryOp(flag, lhs, encode(other.m_messages.row(rhsInd), lhs->GetLevel()));
+        }
+    });
+    // Our ciphertexts may have been updated in place, which the cached replica (keyed on them) would not notice
+    m_replica = nullptr;
+    return *this;
+}
+
+pTensor &pTensor::operator+=(const pTensor &other) {
+    auto trace = traceOp("operator+=");
+    if (m_lazy && m_isEncrypted) {
+        *this = lazyBinaryOp("add", other);
+        return *this;
+    }
+    return inPlaceBinaryOp("add", other);
+}
+pTensor &pTensor::operator-=(const pTensor &other) {
+    auto trace = traceOp("operator-=");
+    if (m_lazy && m_isEncrypted) {
+        *this = lazyBinaryOp("sub", other);
+        return *this;
+    }
+    return inPlaceBinaryOp("sub", other);
+}
+pTensor &pTensor::operator*=(const pTensor &other) {
+    auto trace = traceOp("operator*=");
+    if (m_lazy && m_isEncrypted) {
+        *this = lazyBinaryOp("mult", other);
+        return *this;
+    }
+    return inPlaceBinaryOp("mult", other);
+}
+
+pTensor pTensor::operator+(const pTensor &other) const {
+    auto trace = traceOp("operator+");
+    if (m_lazy && m_isEncrypted) {
+        return lazyBinaryOp("add", other);
+    }
+    return evaluated().eagerBinaryOp("add", other.evaluated());
+}
+pTensor pTensor::operator+(const messageTensor &other) const {
     auto otherTensor = pTensor(other.size(), other[0].size(), other);
     return (*this) + otherTensor;
 }
-pTensor pTensor::operator+(messageVector &other) {
+pTensor pTensor::operator+(const messageVector &other) const {
     messageTensor messageTensorContainer;
     messageTensorContainer.emplace_back(other);
     auto otherTensor = pTensor(1, other.size(), messageTensorContainer);
     return (*this) + otherTensor;
 }
-pTensor pTensor::operator+(messageScalar &other) {
+pTensor pTensor::operator+(const messageScalar &other) const {
     messageVector messageVectorContainer;
     for (unsigned int i = 0; i < m_cols; i++) {
         messageVectorContainer.emplace_back(other);
@@ -154,32 +542,24 @@ pTensor pTensor::operator+(messageScalar &other) {
     return (*this) + otherTensor;
 }
 
-pTensor pTensor::operator-(pTensor &other) {
-    assert (m_cc != nullptr && (cipherNotEmpty())
-                && (other.messageNotEmpty() || other.cipherNotEmpty()));
-    shapeVerifier(*this, other);
-    auto resCols = std::max(m_cols, other.m_cols);
-    auto resRows = std::max(m_rows, other.m_rows);
-
-    // Now, we know that it is broadcast-able. Therefore, they either have the same shape or one is shape 1 in rows
-    cipherTensor ciphertextContainer = binaryOpAbstraction("sub", other);
-    pTensor newTensor(
-        resRows, resCols, ciphertextContainer
-    ); // Numpy requires that the output is the max of both
-    newTensor.m_isEncrypted = m_isEncrypted;
-    return newTensor;
+pTensor pTensor::operator-(const pTensor &other) const {
+    auto trace = traceOp("operator-");
+    if (m_lazy && m_isEncrypted) {
+        return lazyBinaryOp("sub", other);
+    }
+    return evaluated().eagerBinaryOp("sub", other.evaluated());
 }
-pTensor pTensor::operator-(messageTensor &other) {
+pTensor pTensor::operator-(const messageTensor &other) const {
     auto otherTensor = pTensor(other.size(), other[0].size(), other);
     return (*this) - otherTensor;
 }
-pTensor pTensor::operator-(messageVector &other) {
+pTensor pTensor::operator-(const messageVector &other) const {
     messageTensor messageTensorContainer;
     messageTensorContainer.emplace_back(other);
     auto otherTensor = pTensor(1, other.size(), messageTensorContainer);
     return (*this) - otherTensor;
 }
-pTensor pTensor::operator-(messageScalar &other) {
+pTensor pTensor::operator-(const messageScalar &other) const {
 
     messageVector messageVectorContainer;
     for (unsigned int i = 0; i < m_cols; i++) {
@@ -191,33 +571,25 @@ pTensor pTensor::operator-(messageScalar &other) {
     return (*this) - otherTensor;
 }
 
-pTensor pTensor::operator*(pTensor &other) {
-    assert (m_cc != nullptr && (cipherNotEmpty())
-                && (other.messageNotEmpty() || other.cipherNotEmpty()));
-    shapeVerifier(*this, other);
-    auto resCols = std::max(m_cols, other.m_cols);
-    auto resRows = std::max(m_rows, other.m_rows);
-
-    // Now, we know that it is broadcast-able. Therefore, they either have the same shape or one is shape 1 in rows
-    cipherTensor ciphertextContainer = binaryOpAbstraction("mult", other);
-    pTensor newTensor(
-        resRows, resCols, ciphertextContainer
-    ); // Numpy requires that the output is the max of both
-    newTensor.m_isEncrypted = m_isEncrypted;
-    return newTensor;
+pTensor pTensor::operator*(const pTensor &other) const {
+    auto trace = traceOp("operator*");
+    if (m_lazy && m_isEncrypted) {
+        return lazyBinaryOp("mult", other);
+    }
+    return evaluated().eagerBinaryOp("mult", other.evaluated());
 }
-pTensor pTensor::operator*(messageTensor &other) {
+pTensor pTensor::operator*(const messageTensor &other) const {
     auto otherTensor = pTensor(other.size(), other[0].size(), other);
     return (*this) * otherTensor;
 }
-pTensor pTensor::operator*(messageVector &other) {
+pTensor pTensor::operator*(const messageVector &other) const {
 
     messageTensor messageTensorContainer;
     messageTensorContainer.emplace_back(other);
     auto otherTensor = pTensor(1, other.size(), messageTensorContainer);
     return (*this) * otherTensor;
 }
-pTensor pTensor::operator*(messageScalar &other) {
+pTensor pTensor::operator*(const messageScalar &other) const {
 
     messageVector messageVectorContainer;
     for (unsigned int i = 0; i < m_cols; i++) {
@@ -236,10 +608,19 @@ pTensor pTensor::operator*(messageScalar &other) {
  *  The thing to dot prod with. In the ML setting this is a vector of the weights
  * @return
  */
-pTensor pTensor::dot(pTensor &other, bool asRowVector) {
+pTensor pTensor::dot(const pTensor &other, bool asRowVector) {
+    eval();
+    if (other.isPending()) {
+        return dot(other.evaluated(), asRowVector);
+    }
+    auto trace = traceOp("dot");
     assert (m_cc != nullptr && (cipherNotEmpty())
                 && (other.messageNotEmpty() || other.cipherNotEmpty()));
 
+    if (m_layout != pTensorLayout::rowPerCipher) {
+        return packedDot(other, asRowVector);
+    }
+
     pTensor rhs;
     if (m_cols == other.m_rows) { // we need to transpose to get it into a form amenable for our dot prod.
         rhs = other.T();
@@ -247,37 +628,55 @@ pTensor pTensor::dot(pTensor &other, bool asRowVector) {
         rhs = other;
     }
 
-    messageVector _rowAccumulator(m_rows, 0.0);
-    cipherVector rowAccumulator = (*m_cc)->Encrypt(
-        m_public_key,
-        (*m_cc)->MakeCKKSPackedPlaintext(_rowAccumulator));
-
-    // We need to mask out all values but the first for the inner prod.
-    messageVector _mask(m_rows, 0.0);
-    _mask[0] = 1;
-    cipherVector mask = (*m_cc)->Encrypt(
-        m_public_key,
-        (*m_cc)->MakeCKKSPackedPlaintext(_mask));
-
     int HARDCODED_INDEX_FOR_OTHER_VECTOR = 0;
-    cipherTensor colAccumulator;
-    lbcrypto::Plaintext pt;
-    for (unsigned int i = 0; i < m_rows; i++) {
-        auto innerProd = (*m_cc)->EvalInnerProduct(
+    cipherTensor innerProds(m_rows);
+    parallelFor(m_rows, m_numWorkers, [&](unsigned int i) {
+        innerProds[i] = evalInnerProduct(
             m_ciphertexts[i],
             rhs.m_ciphertexts[HARDCODED_INDEX_FOR_OTHER_VECTOR],
             getBatchSize());
-
-        innerProd = (*m_cc)->EvalMult(innerProd, mask);
-
-        // For the col vector
-        colAccumulator.emplace_back(innerProd);
-
-        // For the row vector
-        for (unsigned int numRot = 0; numRot < i; numRot++) {
-            innerProd = (*m_cc)->EvalAtIndex(innerProd, -1);
+    });
+
+    // For the col vector: we need to mask out all values but the first for the inner prod.
+    auto level = innerProds[0]->GetLevel();
+    messageVector _mask(1, 1.0);
+    auto mask = encode(_mask, level);
+    cipherTensor colAccumulator(m_rows);
+    parallelFor(m_rows, m_numWorkers, [&](unsigned int i) {
+        colAccumulator[i] = evalMult(innerProds[i], mask);
+    });
+
+    // For the row vector. EvalSum leaves the full sum in slot 0 but also in every slot of the tail window
+    //  [getBatchSize() + m_cols, 2 * getBatchSize()) since those wrap around onto the (zero padded) start of the row.
+    //  If all the rows fit in that window we mask row i into slot 2 * getBatchSize() - m_rows + i (see rowSlotMasks())
+    //  and a single rotation moves the whole row vector to the front.
+    cipherVector rowAccumulator;
+    if (m_rows + m_cols <= static_cast<unsigned int>(getBatchSize())) {
+        auto slotMasks = rowSlotMasks(m_rows, level);
+        for (unsigned int i = 0; i < m_rows; i++) {
+            auto masked = evalMult(innerProds[i], (*slotMasks)[i]);
+            if (i == 0) {
+                rowAccumulator = masked;
+            } else {
+                addInto(rowAccumulator, masked);
+            }
+        }
+        rowAccumulator = rotate(rowAccumulator, -static_cast<int>(m_rows));
+    } else {
+        // Otherwise merge the masked values pairwise: m_rows - 1 single step rotations, log2(m_rows) deep
+        cipherTensor merged = colAccumulator;
+        for (unsigned int stride = 1; merged.size() > 1; stride *= 2) {
+            cipherTensor next((merged.size() + 1) / 2);
+            parallelFor(next.size(), m_numWorkers, [&](unsigned int j) {
+                if (2 * j + 1 < merged.size()) {
+                    next[j] = (*m_cc)->EvalAdd(merged[2 * j], rotate(merged[2 * j + 1], -static_cast<int>(stride)));
+                } else {
+                    next[j] = merged[2 * j];
+                }
+            });
+            merged = next;
         }
-        rowAccumulator = (*m_cc)->EvalAdd(rowAccumulator, innerProd);
+        rowAccumulator = merged[0];
     }
 
     cipherTensor rowAccumulatorAsTensor;
@@ -294,50 +693,44 @@ pTensor pTensor::dot(pTensor &other, bool asRowVector) {
 }
 
 pTensor pTensor::sum() {
-
+    eval();
+    auto trace = traceOp("sum");
     assert (m_cc != nullptr && (cipherNotEmpty()));
-    auto colSummedpTensor = sum(1);  // Now a col Vector but m_cols times larger
-
-    if (m_isRepeated){
-        float _scale = 1.0 / m_cols;
-        auto scale = pTensor::encryptScalar(_scale, true);
-        colSummedpTensor = colSummedpTensor * scale;
+    if (m_layout != pTensorLayout::rowPerCipher) {
+        return packedSum();
     }
+    auto colSummedpTensor = sum(1);  // Now a col Vector but m_cols times larger
 
-    messageVector message_accumulator(1, 0.0); // we initialize to 0
-
-    // Accumulator is a vector
-    auto accumulator = (*m_cc)->Encrypt(
-        m_public_key,
-        (*m_cc)->MakeCKKSPackedPlaintext(message_accumulator)
-    );
-    for (const auto &v : colSummedpTensor.m_ciphertexts) {
-        accumulator = (*m_cc)->EvalAdd(accumulator, v);
-    }
     cipherTensor asTensor;
-    asTensor.emplace_back(accumulator);
+    asTensor.emplace_back(treeSum(colSummedpTensor.m_ciphertexts));
 
     pTensor newTensor(1, 1, asTensor);
     newTensor.m_isEncrypted = m_isEncrypted;
+    if (m_isRepeated){
+        // Every value was repeated m_cols times. Scaling the total once is cheaper than scaling every row
+        float _scale = 1.0 / m_cols;
+        auto scale = pTensor::encryptScalar(_scale, true);
+        return newTensor.eagerBinaryOp("mult", scale);
+    }
     return newTensor;
 }
 
 pTensor pTensor::sum(int axis) {
+    eval();
+    auto trace = traceOp(axis == 0 ? "sum(0)" : "sum(1)");
     assert (m_cc != nullptr && (cipherNotEmpty()));
     if (!m_isEncrypted) {
         std::cout << "Trying to get sum on unencrypted data" << std::endl;
         throw std::runtime_error("sum() on unencrypted pTensors is unsupported");
     }
+    if (m_layout != pTensorLayout::rowPerCipher && (axis == 0 || axis == 1)) {
+        // Summing along the lines of packedRows is axis 1, for packedCols it is axis 0
+        bool alongLines = ((axis == 1) == (m_layout == pTensorLayout::packedRows));
+        return alongLines ? sumWithinLines() : sumAcrossLines();
+    }
     if (axis == 0) {
         // Sum downwards over the rows
-        messageVector message_accumulator(m_cols, 0.0); // we initialize to 0
-        auto accumulator = (*m_cc)->Encrypt(
-            m_public_key,
-            (*m_cc)->MakeCKKSPackedPlaintext(message_accumulator)
-        );
-        for (auto &v: m_ciphertexts) {
-            accumulator = (*m_cc)->EvalAdd(v, accumulator);
-        }
+        auto accumulator = treeSum(m_ciphertexts);
 
         cipherTensor asTensor;
         asTensor.emplace_back(accumulator);
@@ -346,13 +739,12 @@ pTensor pTensor::sum(int axis) {
         return newTensor;
     } else if (axis == 1) {
         // Sum across the rows
-        cipherTensor accumulator;
-        for (const auto &item : m_ciphertexts) {
-            auto resp = (*m_cc)->EvalSum(item, getBatchSize());
-            accumulator.emplace_back(resp);
-        }
+        cipherTensor accumulator(m_rows);
+        parallelFor(m_rows, m_numWorkers, [&](unsigned int i) {
+            accumulator[i] = evalSum(m_ciphertexts[i], getBatchSize());
+        });
 
-        pTensor newTensor(m_rows, 1, accumulator);
+        pTensor newTensor(m_rows, 1, std::move(accumulator));
         newTensor.m_isEncrypted = m_isEncrypted;
         return newTensor;
     } else {
@@ -362,106 +754,170 @@ pTensor pTensor::sum(int axis) {
     }
 }
 
-pTensor pTensor::T() {
-    // For the first row we iteratively mask out
+pTensor &pTensor::sumInPlace() {
+    eval();
+    auto trace = traceOp("sumInPlace");
+    assert (m_cc != nullptr && (cipherNotEmpty()));
+    if (m_layout != pTensorLayout::rowPerCipher) {
+        *this = packedSum();
+        return *this;
+    }
+    bool repeated = m_isRepeated;
+    unsigned int cols = m_cols;
+    sumInPlace(1);
+    sumInPlace(0);
+    if (repeated) {
+        float _scale = 1.0 / cols;
+        auto scale = pTensor::encryptScalar(_scale, true);
+        inPlaceBinaryOp("mult", scale);
+    }
+    return *this;
+}
 
-    if (!(m_isEncrypted)) { // encrypt yourself. If we store the transpose we have it now in encrypted form.
-        pTensor::encrypt();
+pTensor &pTensor::sumInPlace(int axis) {
+    eval();
+    auto trace = traceOp(axis == 0 ? "sumInPlace(0)" : "sumInPlace(1)");
+    assert (m_cc != nullptr && (cipherNotEmpty()));
+    if (!m_isEncrypted) {
+        throw std::runtime_error("sum() on unencrypted pTensors is unsupported");
+    }
+    if (m_layout != pTensorLayout::rowPerCipher || (axis != 0 && axis != 1)) {
+        *this = sum(axis);
+        return *this;
     }
+    if (axis == 0) {
+        treeSumInPlace(m_ciphertexts);
+        m_ciphertexts.resize(1);
+        m_rows = 1;
+    } else {
+        parallelFor(m_rows, m_numWorkers, [&](unsigned int i) {
+            m_ciphertexts[i] = evalSum(m_ciphertexts[i], getBatchSize());
+        });
+        m_cols = 1;
+    }
+    m_isRepeated = false;
+    m_replica = nullptr;
+    return *this;
+}
 
-    // Whelp, we need to transpose here I suppose.
-    // We fix a column then iterate downwards through the samples. At the end, we have a vector
-    // at which point we emplace back then move to the next col
-    auto toTranspose = (m_ciphertexts);
+pTensor pTensor::T() const {
+    if (isPending()) {
+        return evaluated().T();
+    }
+    auto trace = traceOp("T");
+    if (m_layout != pTensorLayout::rowPerCipher) {
+        // packedCols is the packedRows layout of the transpose, so there is nothing to move around
+        pTensor newTensor = *this;
+        newTensor.m_rows = m_cols;
+        newTensor.m_cols = m_rows;
+        newTensor.m_isRepeated = false;
+        newTensor.m_layout = (m_layout == pTensorLayout::packedRows) ?
+                             pTensorLayout::packedCols : pTensorLayout::packedRows;
+        return newTensor;
+    }
 
-    cipherTensor tContainer;
-    for (unsigned int col_i = 0; col_i < m_cols; ++col_i) {
-        messageVector mAccum(m_rows, 0.0);
-        auto accum = (*m_cc)->Encrypt(m_public_key, (*m_cc)->MakeCKKSPackedPlaintext(mAccum));
-        for (unsigned int row_i = 0; row_i < m_rows; ++row_i) {
-            messageVector mask(m_rows, 0.0);
-            mask[row_i] = 1;
-            auto ptMask = (*m_cc)->MakeCKKSPackedPlaintext(mask);
+    if (!(m_isEncrypted)) { // encrypt yourself first
+        return encrypt().T();
+    }
+    if (m_rows + m_cols - 1 > static_cast<unsigned int>(getBatchSize())) {
+        throw std::runtime_error("T() needs rows + cols - 1 <= getBatchSize() slots. Use a packed layout instead");
+    }
 
-            // First mask everything else out
-            auto maskedVal = (*m_cc)->EvalMult(ptMask, toTranspose[col_i]);
+    // Diagonal transpose. out[c][r] = in[r][c] so, with e_i the plaintext mask of slot i,
+    //      out_c = sum_r e_r * rot(in_r, c - r) = rot(sum_r e_{c + r} * rot(in_r, -r), c)
+    // Every row is rotated onto its own diagonal once, the masks pick column c out of the diagonals and one rotation
+    // per column brings it back to the front: m_rows + m_cols rotations instead of one (or more) per element.
+    cipherTensor diagonals(m_rows);
+    parallelFor(m_rows, m_numWorkers, [&](unsigned int r) {
+        diagonals[r] = rotate(m_ciphertexts[r], -static_cast<int>(r));
+    });
+
+    // e_{c + r} only depends on c + r so the masks are shared by every column. They are encoded once up front (and
+    // stay in m_plaintextCache for the next transpose of the same shape)
+    std::vector<lbcrypto::Plaintext> masks(m_rows + m_cols - 1);
+    for (unsigned int i = 0; i < masks.size(); ++i) {
+        messageVector mask(i + 1, 0.0);
+        mask[i] = 1;
+        masks[i] = encode(mask, diagonals[0]->GetLevel());
+    }
 
-            // Now, we rotate right: -1
-            for (unsigned int rot = 0; rot < row_i; ++rot) {
-                maskedVal = (*m_cc)->EvalAtIndex(maskedVal, 1);
-            }
-            accum = (*m_cc)->EvalAdd(accum, maskedVal);
+    cipherTensor tContainer(m_cols);
+    parallelFor(m_cols, m_numWorkers, [&](unsigned int c) {
+        cipherVector column = evalMult(diagonals[0], masks[c]);
+        for (unsigned int r = 1; r < m_rows; ++r) {
+            addInto(column, evalMult(diagonals[r], masks[c + r]));
         }
-        tContainer.emplace_back(accum);
-    }
-    pTensor newTensor(m_cols, m_rows, tContainer, toTranspose);
+        tContainer[c] = rotate(column, c);
+    });
+    pTensor newTensor(m_cols, m_rows, std::move(tContainer), m_ciphertexts);
     return newTensor;
 }
 
-messageTensor pTensor::plainT() {
+messageTensor pTensor::plainT() const {
     assert (messageNotEmpty());
-    messageTensor
-        transposeTensor((m_messages)[0].size(), messageVector());  // we take the transpose and "store" it.
+    return plainT(m_messages).to<messageScalar>();
+}
 
-    for (auto &m_message : m_messages) {
-        for (unsigned int j = 0; j < (m_messages)[0].size(); j++) {
-            transposeTensor[j].emplace_back(m_message[j]);
-        }
-    }
-    return transposeTensor;
+messageStore pTensor::plainT(const messageStore &message) {
+    return message.transposed().contiguous(m_numWorkers);
 }
 
-messageTensor pTensor::plainT(messageTensor tensor) {
-    messageTensor transposeTensor(tensor[0].size(), messageVector());
+messageTensor pTensor::plainT(const messageTensor &tensor) {
+    return plainT(messageStore(tensor)).to<messageScalar>();
+}
 
-    for (unsigned int i = 0; i < tensor.size(); i++) {
-        for (unsigned int j = 0; j < tensor[0].size(); j++) {
-            transposeTensor[j].emplace_back(tensor[i][j]);
-        }
-    }
-    return transposeTensor;
+realTensor pTensor::plainT(const realTensor &tensor) {
+    return plainT(messageStore(tensor)).to<realScalar>();
+}
+
+floatTensor pTensor::plainT(const floatTensor &tensor) {
+    return plainT(messageStore(tensor)).to<floatScalar>();
 }
 
 pTensor pTensor::identity(unsigned int n) {
-    messageTensor message(n, messageVector(n, 0));
+    realTensor message(n, realVector(n, 0));
     for (unsigned int i = 0; i < n; ++i) {
         message[i][i] = 1;
     }
 
-    pTensor newTensor(n, n, message);
+    pTensor newTensor(n, n, std::move(message));
     return newTensor;
 }
 pTensor pTensor::randomUniform(unsigned int rows, unsigned int cols, double low, double high) {
     std::default_random_engine generator;
     std::uniform_real_distribution<double> distribution(low, high);
 
-    messageTensor tensorContainer;
+    realTensor tensorContainer;
     for (unsigned int r = 0; r < rows; ++r) {
-        messageVector vectorContainer;
+        realVector vectorContainer;
         for (unsigned int c = 0; c < cols; ++c) {
             vectorContainer.emplace_back(distribution(generator));
         }
-        tensorContainer.emplace_back(vectorContainer);
+        tensorContainer.emplace_back(std::move(vectorContainer));
     }
-    pTensor newTensor(rows, cols, tensorContainer);
+    pTensor newTensor(rows, cols, std::move(tensorContainer));
     return newTensor;
 }
 pTensor pTensor::randomNormal(unsigned int rows, unsigned int cols, int low, int high) {
     std::default_random_engine generator;
     std::normal_distribution<double> distribution(low, high);
 
-    messageTensor tensorContainer;
+    realTensor tensorContainer;
     for (unsigned int r = 0; r < rows; ++r) {
-        messageVector vectorContainer;
+        realVector vectorContainer;
         for (unsigned int c = 0; c < cols; ++c) {
             vectorContainer.emplace_back(distribution(generator));
         }
-        tensorContainer.emplace_back(vectorContainer);
+        tensorContainer.emplace_back(std::move(vectorContainer));
     }
-    pTensor newTensor(rows, cols, tensorContainer);
+    pTensor newTensor(rows, cols, std::move(tensorContainer));
     return newTensor;
 }
-pTensor pTensor::hstack(pTensor arg1, pTensor arg2) {
+pTensor pTensor::hstack(const pTensor &arg1, const pTensor &arg2) {
+    if (arg1.isPending() || arg2.isPending()) {
+        return hstack(arg1.evaluated(), arg2.evaluated());
+    }
+    auto trace = arg1.traceOp("hstack");
     // need to verify that we have something to concatenate
     assert(
         (arg1.messageNotEmpty() && arg2.messageNotEmpty()) ||
@@ -470,36 +926,54 @@ pTensor pTensor::hstack(pTensor arg1, pTensor arg2) {
     assert(arg1.m_cols == arg2.m_cols);
     assert(arg1.m_isEncrypted == arg2.m_isEncrypted);
 
-    if (arg1.messageNotEmpty()) {
-        messageTensor container = arg1.m_messages;
-        for (auto &vec: arg2.m_messages) {
-            container.emplace_back(vec);
-        }
+    if (arg1.m_layout != pTensorLayout::rowPerCipher || arg2.m_layout != pTensorLayout::rowPerCipher) {
+        return packedHstack(arg1, arg2);
+    }
 
-        pTensor newTensor(arg1.m_rows + arg2.m_rows, arg1.m_cols, container);
+    if (arg1.messageNotEmpty()) {
+        pTensor newTensor(arg1.m_rows + arg2.m_rows, arg1.m_cols,
+                          messageStore::concatRows(arg1.m_messages, arg2.m_messages));
         return newTensor;
     }
-    cipherTensor container = arg1.m_ciphertexts;
-    for (auto &v: arg2.m_ciphertexts) {
-        container.emplace_back(v);
-    }
+    cipherTensor container;
+    container.reserve(arg1.m_ciphertexts.size() + arg2.m_ciphertexts.size());
+    container.insert(container.end(), arg1.m_ciphertexts.begin(), arg1.m_ciphertexts.end());
+    container.insert(container.end(), arg2.m_ciphertexts.begin(), arg2.m_ciphertexts.end());
 
-    pTensor newTensor(arg1.m_rows + arg2.m_rows, arg1.m_cols, container);
+    pTensor newTensor(arg1.m_rows + arg2.m_rows, arg1.m_cols, std::move(container));
     newTensor.m_isEncrypted = (arg1.m_isEncrypted == arg2.m_isEncrypted);
     return newTensor;
 }
+pTensor pTensor::withPrecision(messagePrecision precision) const {
+    assert(messageNotEmpty());
+    pTensor newTensor = *this;
+    newTensor.m_messages = m_messages.as(precision);
+    return newTensor;
+}
 pTensor pTensor::generateWeights(unsigned int numFeatures,
                                  unsigned int numRepeats,
                                  const messageTensor &seed,
                                  const std::string &randomInitializer) {
     if (!seed.empty()) {
         assert(seed.size() == numFeatures);
-        messageTensor repeatedWeights;
-        for (auto &vector: seed) {
-            assert(vector.size() == 1);
-            repeatedWeights.emplace_back(messageVector(numRepeats, vector[0]));
+        // The weights are repeated numRepeats times so store them as reals unless the seed really is complex
+        messageStore repeatedWeights;
+        if (messageStore::isReal(seed)) {
+            realTensor repeated;
+            for (auto &vector: seed) {
+                assert(vector.size() == 1);
+                repeated.emplace_back(realVector(numRepeats, vector[0].real()));
+            }
+            repeatedWeights = std::move(repeated);
+        } else {
+            messageTensor repeated;
+            for (auto &vector: seed) {
+                assert(vector.size() == 1);
+                repeated.emplace_back(messageVector(numRepeats, vector[0]));
+            }
+            repeatedWeights = std::move(repeated);
         }
-        pTensor newTensor(numFeatures, numRepeats, repeatedWeights);
+        pTensor newTensor(numFeatures, numRepeats, std::move(repeatedWeights));
         newTensor.m_isRepeated = true;
         return newTensor;
     } else {
@@ -515,17 +989,21 @@ pTensor pTensor::generateWeights(unsigned int numFeatures,
             throw std::runtime_error(errMsg);
         }
 
-        auto msg = container.getMessage();
-        messageTensor repeatedWeights;
-        for (auto &vec: msg) {
-            repeatedWeights.emplace_back(messageVector(numRepeats, vec[0]));
+        realTensor repeatedWeights(numFeatures);
+        for (unsigned int f = 0; f < numFeatures; ++f) {
+            repeatedWeights[f] = realVector(numRepeats, container.m_messages.at(f, 0).real());
         }
         container.m_isRepeated = true;
-        container.m_messages = repeatedWeights;
+        container.m_messages = std::move(repeatedWeights);
         return container;
     }
 }
-pTensor pTensor::encryptedDot(pTensor &other) {
+pTensor pTensor::encryptedDot(const pTensor &other) {
+    eval();
+    if (other.isPending()) {
+        return encryptedDot(other.evaluated());
+    }
+    auto trace = traceOp("encryptedDot");
     if (!(isMatrix())) {
         throw std::runtime_error("Expected self to be a matrix in encryptedDot");
     }
@@ -538,7 +1016,7 @@ pTensor pTensor::encryptedDot(pTensor &other) {
             throw std::runtime_error(errMsg);
         }
         // First do a hadamard prod
-        auto elementWiseProd = (*this) * other;
+        auto elementWiseProd = eagerBinaryOp("mult", other);
 
         auto summed = elementWiseProd.sum(0);
         return summed;
@@ -546,36 +1024,46 @@ pTensor pTensor::encryptedDot(pTensor &other) {
     return dot(other);
 }
 
-pTensor pTensor::applyGradient(pTensor matrixOfWeights, pTensor vectorGradients) {
+pTensor pTensor::applyGradient(const pTensor &matrixOfWeights, const pTensor &vectorGradients) {
+    // The copy shares its ciphertexts with matrixOfWeights, so those are not touched by the in-place update
+    pTensor updated = matrixOfWeights.evaluated();
+    return applyGradientInPlace(updated, vectorGradients);
+}
+
+pTensor &pTensor::applyGradientInPlace(pTensor &matrixOfWeights, const pTensor &vectorGradients) {
+    matrixOfWeights.eval();
+    if (vectorGradients.isPending()) {
+        return applyGradientInPlace(matrixOfWeights, vectorGradients.evaluated());
+    }
+    auto trace = matrixOfWeights.traceOp("applyGradient");
     // matrixOfWeights shape: (# features, #observations), a repeated matrix essentially having shape (#features, 1)
     // vectorGradients shape: (1, #features)
 
-    // We first iteratively mask out the gradients which produces a diagonal(all non-zeros empty) matrix. We then
-    // rotate the vectors so that the last entry is the value of interest. We then sum it (which repeats the vector) and rotate the entire vector back
+    // Row i of the gradient matrix is gradient[i] repeated along the row. We rotate gradient[i] into the first slot,
+    // mask everything else out and repeat it by doubling. Every rotation is of the same ciphertext so they are hoisted
 
-    pTensor identity = pTensor::identity(vectorGradients.m_cols);
-    pTensor encryptedIdentity = identity.encrypt();
-    cipherTensor tensorCipherContainer;
-    auto maskedGradients = encryptedIdentity * vectorGradients;
-
-    lbcrypto::Plaintext pt;
-    int index = 0;
-
-    for (auto &row: maskedGradients.m_ciphertexts) {
-        auto maskedVal = row;
-        for (int i = 0; i < (index + 1); ++i) {
-            maskedVal = (*m_cc)->EvalAtIndex(maskedVal, 1);
-        }
-        maskedVal = (*m_cc)->EvalSum(maskedVal, -getRepeatBatchSize());
-        maskedVal = (*m_cc)->EvalAtIndex(maskedVal, getRepeatBatchSize());
-        tensorCipherContainer.emplace_back(maskedVal);
-        index += 1;
+    if (matrixOfWeights.m_layout != pTensorLayout::rowPerCipher) {
+        // One gradient per feature (line) which the packed broadcasting spreads along the lines for us
+        pTensor perLine = (vectorGradients.m_rows == 1) ? vectorGradients.T() : vectorGradients;
+        return matrixOfWeights.inPlaceBinaryOp("sub", perLine);
+    }
+    if (vectorGradients.m_rows != 1) {
+        throw std::runtime_error("applyGradient expects the gradients as a (1, #features) row vector");
     }
 
-    // MatrixGradients is a repeated matrix
-    pTensor matrixGradients(matrixOfWeights.m_rows, matrixOfWeights.m_cols, tensorCipherContainer);
+    std::vector<int> offsets(vectorGradients.m_cols);
+    std::iota(offsets.begin(), offsets.end(), 0);
+    auto rotated = rotateMany(vectorGradients.m_ciphertexts[0], offsets);
 
-    auto toReturn = matrixOfWeights - matrixGradients;
+    messageVector firstSlot(1, 1.0);
+    unsigned int repeatTo = blockSizeFor(matrixOfWeights.m_cols);
+    cipherTensor tensorCipherContainer(rotated.size());
+    parallelFor(rotated.size(), m_numWorkers, [&](unsigned int i) {
+        auto masked = evalMult(rotated[i], encode(firstSlot, rotated[i]->GetLevel()));
+        tensorCipherContainer[i] = replicateWithinBlocks(masked, repeatTo);
+    });
 
-    return toReturn;
+    // MatrixGradients is a repeated matrix
+    pTensor matrixGradients(matrixOfWeights.m_rows, matrixOfWeights.m_cols, std::move(tensorCipherContainer));
+    return matrixOfWeights.inPlaceBinaryOp("sub", matrixGradients);
 }
@@ -36,10 +36,19 @@ class NotImplementedException : public std::logic_error {
 #include <iostream>
 #include <utility>
 #include <vector>
+#include <string>
 #include <exception>
 #include <complex>
 #include "ptensor_utils.h"
+#include "parallel_utils.h"
+#include "plaintext_cache.h"
+#include "message_store.h"
+#include "trace.h"
+#include <atomic>
 #include <cassert>
+#include <memory>
+#include <mutex>
+#include <chrono>
 #include <random>
 
 /**
@@ -49,12 +58,20 @@ class NotImplementedException : public std::logic_error {
 using cipherVector = lbcrypto::Ciphertext<lbcrypto::DCRTPoly>;
 using cipherTensor = std::vector<cipherVector>;
 
-using messageScalar = std::complex<double>;
-using messageVector = std::vector<messageScalar>;
-using messageTensor = std::vector<messageVector>;
+/**
+ * How the values of an encrypted pTensor are laid out across ciphertexts. We call the unit that gets packed a "line":
+ *    rowPerCipher: every row is its own ciphertext. This is the default and what m_isRepeated assumes
+ *    packedRows: row-major. Every row (line) gets a power-of-two block of slots and as many rows as fit into
+ *        getBatchSize() slots share one ciphertext.
+ *    packedCols: column-major. Same as packedRows but the lines are the columns, i.e. it is the packedRows layout of
+ *        the transpose. Because of this, T() just flips between packedRows and packedCols without touching a ciphertext.
+ *
+ *  The packed layouts cut the number of ciphertexts (and so memory and the number of homomorphic ops) by up to
+ *  getBatchSize() / blockSize. They need the rotation keys from rotationIndices().
+ */
+enum class pTensorLayout { rowPerCipher, packedRows, packedCols };
 
-using realScalar = double;
-using realVector = std::vector<realScalar>;
+struct pTensorExpr;  // Node of the lazy expression graph, see pTensor::m_lazy
 
 class pTensor {
  public:
@@ -63,6 +80,21 @@ class pTensor {
   static shared_ptr<lbcrypto::LPPublicKeyImpl<lbcrypto::DCRTPoly>> m_public_key;
   static shared_ptr<lbcrypto::LPPrivateKeyImpl<lbcrypto::DCRTPoly>> m_private_key;
 
+  // Number of threads used when fanning rows out in encrypt() and decrypt(). 0 means use every hardware thread
+  static unsigned int m_numWorkers;
+
+  // Encoded plaintext operands (broadcast rows, scalars, masks) are re-used across rows and calls through this cache
+  static plaintextCache m_plaintextCache;
+
+  // When set, +, - and * on an encrypted LHS record an expression graph instead of running. The graph is evaluated
+  //    (and optimized, see p_tensor_lazy.cpp) by eval(), decrypt() or by any operation that is not elementwise
+  static bool m_lazy;
+
+  // The multDepth the crypto context was generated with, set by cryptoBundle. This is how many levels a fresh
+  //    ciphertext can consume before it has to be refreshed (see remainingDepth()). 0 means unknown, in which case
+  //    nothing is ever refreshed
+  static uint32_t m_multDepth;
+
   pTensor() = default;
 
   /////////////////////////////////////////////////////////////////
@@ -80,19 +112,19 @@ class pTensor {
    */
   pTensor(unsigned int rows,
           unsigned int cols,
-          cipherTensor &cTensor,
-          cipherTensor &cTensorTranspose,
+          cipherTensor cTensor,
+          const cipherTensor &cTensorTranspose,
           bool isRepeated = false) :
       m_rows(rows),
       m_cols(cols),
       m_isEncrypted(true),
-      m_ciphertexts(cTensor),
+      m_ciphertexts(std::move(cTensor)),
       m_isRepeated(isRepeated) {
       if (isRepeated) { // Can only be repeated if scalar value
           assert(rows == cols && cols == 1);
 
           // If we trust that the user has put in the cipher and transpose correctly, we can check the following too
-          assert(cTensor.size() == 1);  // Rows must be 0.
+          assert(m_ciphertexts.size() == 1);  // Rows must be 0.
           assert(cTensorTranspose.size() == 1);
       }
   };
@@ -109,11 +141,11 @@ class pTensor {
    * @param precomputeTranspose whether to encrypt the transpose of this pTensor in addition to the actual value.
    * @param isRepeated: whether the cipher has been repeated. If yes, we do not project it in the SCALAR case. else, we project it
    */
-  pTensor(unsigned int rows, unsigned int cols, cipherTensor &cipherTensor, bool isRepeated = false) :
+  pTensor(unsigned int rows, unsigned int cols, cipherTensor cipherTensor, bool isRepeated = false) :
       m_rows(rows),
       m_cols(cols),
       m_isEncrypted(true),
-      m_ciphertexts(cipherTensor),
+      m_ciphertexts(std::move(cipherTensor)),
       m_isRepeated(isRepeated) {
       if (isRepeated) {
           assert(rows == cols && cols == 1);
@@ -128,6 +160,12 @@ class pTensor {
 
   ~pTensor() = default;
 
+  // Declaring the destructor would otherwise turn every move of a pTensor into a copy of all of its rows
+  pTensor(const pTensor &other) = default;
+  pTensor(pTensor &&other) noexcept = default;
+  pTensor &operator=(const pTensor &other) = default;
+  pTensor &operator=(pTensor &&other) noexcept = default;
+
   /////////////////////////////////////////////////////////////////
   // Initialization from messages
   /////////////////////////////////////////////////////////////////
@@ -137,11 +175,12 @@ class pTensor {
  * Instantiate the object directly from a raw message matrix
  * @param rows number of rows
  * @param cols number of cols. Only used in the decryption process
- * @param complexTensor the raw message to store
+ * @param messages the raw message to store: a messageTensor, or a realTensor / floatTensor to store the values as
+ *    real doubles / floats. They are only converted to complex when they get encoded
 * @param precomputeTranspose whether to encrypt the transpose of this pTensor in addition to the actual value.
  */
-  pTensor(unsigned int rows, unsigned int cols, messageTensor &complexTensor)
-      : m_rows(rows), m_cols(cols), m_messages(complexTensor) {}
+  pTensor(unsigned int rows, unsigned int cols, messageStore messages)
+      : m_rows(rows), m_cols(cols), m_messages(std::move(messages)) {}
 
   /////////////////////////////////////////////////////////////////
   //Implementations
@@ -156,16 +195,123 @@ class pTensor {
   // Note, we only need to know if something is a scalar or not so we can broadcast it.
 
   /**
-   * Encrypt the matrix.
+   * Encrypt the matrix. Rows are encrypted in parallel across m_numWorkers threads; the output row order is
+   *    always the same as the input row order.
    *    NOTE: this fails if we do not have a cryptocontext, public key and m_message set.
    */
-  pTensor encrypt();
+  pTensor encrypt() const;
 
   /**
-   * Decrypt the matrix.
+   * Encrypt the matrix into the given layout. Only the plaintext is packed so this costs no more than encrypt().
+   *    NOTE: every line (row for packedRows, column for packedCols) must fit into getBatchSize() slots.
+   * @param layout
+   *    How to lay the values out across ciphertexts
+   */
+  pTensor encrypt(pTensorLayout layout) const;
+
+  /**
+   * Decrypt the matrix. Rows are decrypted in parallel across m_numWorkers threads; the output row order is
+   *    always the same as the input row order.
    *    NOTE: this fails if we do not have a cryptocontext, private key and m_ciphertext set.
    */
-  pTensor decrypt();
+  pTensor decrypt() const;
+
+  /**
+   * Save to a single binary file (see p_tensor_io.cpp for the format). Pending expressions are evaluated first.
+   *    Ciphertexts are written with PALISADE's binary serialization, messages as raw doubles; nothing is text.
+   * @param path
+   *    file to (over)write
+   */
+  void save(const std::string &path) const;
+
+  /**
+   * Load a pTensor written by save(). Ciphertexts need the crypto context they were encrypted under to be set up
+   * @param path
+   * @return
+   */
+  static pTensor load(const std::string &path);
+
+  /**
+   * Load rows [begin, end) of a pTensor written by save() without reading the rest of the file
+   *    NOTE: only for the rowPerCipher layout (and plaintexts) since the packed layouts share ciphertexts across rows
+   * @param path
+   * @param begin
+   *    first row to load
+   * @param end
+   *    one past the last row to load
+   * @return
+   *    a (end - begin, cols) pTensor
+   */
+  static pTensor loadRows(const std::string &path, unsigned int begin, unsigned int end);
+
+  /**
+   * Throughput of the most recent encrypt() or decrypt() call
+   * @return
+   *    rows per second
+   */
+  static double getLastThroughput() { return m_lastThroughput; }
+
+  /**
+   * Number of levels used up by the most consumed ciphertext. Multiplications that have not been rescaled yet count
+   *    as used since they will be rescaled before (or by) the next multiplication.
+   * @return
+   */
+  uint32_t level() const;
+
+  /**
+   * Scaling factor of the most consumed ciphertext
+   * @return
+   */
+  double scale() const;
+
+  /**
+   * Number of multiplications that can still be chained onto this pTensor before it runs out of levels
+   *    NOTE: this needs m_multDepth to be set
+   * @return
+   */
+  uint32_t remainingDepth() const;
+
+  /**
+   * Refresh (decrypt and re-encrypt in the same layout) only if the remaining depth cannot cover the next planned
+   *    operations. PALISADE's CKKS has no bootstrapping so this needs the private key, i.e. it is a round trip to the
+   *    key holder. Does nothing if m_multDepth is not set.
+   *
+   *    Multiplications never refresh on their own: one with an operand that has no level left throws, so call this
+   *    ahead of a known chain, e.g. once per epoch.
+   * @param plannedDepth
+   *    multiplicative depth of what is about to happen to this pTensor
+   * @return
+   *    this pTensor, or a fresh encryption of it
+   */
+  pTensor refreshIfNeeded(uint32_t plannedDepth = 1) const;
+
+  /**
+   * Number of refreshes done by refreshIfNeeded() since the start of the program
+   * @return
+   */
+  static unsigned int getRefreshCount() { return m_refreshCount; }
+
+  /**
+   * Evaluate the pending expression graph (see m_lazy) in place. Plaintext constants are folded, identical
+   *    subexpressions are evaluated once and chains of multiplications are reassociated to minimise the
+   *    multiplicative depth. Does nothing if there is nothing pending.
+   * @return
+   *    *this, now holding ciphertexts
+   */
+  pTensor &eval();
+
+  /**
+   * Whether this pTensor is an expression that has not been evaluated yet
+   */
+  bool isPending() const { return m_expr != nullptr; }
+
+  /**
+   * Read-only view of the evaluated value. Unlike eval() this works on a const pTensor: a pending graph is evaluated
+   *    into its (shared) expression node and the result is returned from there
+   * @return
+   *    *this if nothing is pending
+   */
+  const pTensor &evaluated() const;
 
   /////////////////////////////////////////////////////////////////
   //Operator Overloading
@@ -182,27 +328,27 @@ class pTensor {
    * @return
    *    Z = this + other
    */
-  pTensor operator+(pTensor &other);
+  pTensor operator+(const pTensor &other) const;
 
   /**
  * Add where the RHS is a matrix
  * @param other
  * @return
  */
-  pTensor operator+(messageTensor &other);
+  pTensor operator+(const messageTensor &other) const;
 
   /**
  * Add where the RHS is a vector
  * @param other
  * @return
  */
-  pTensor operator+(messageVector &other);
+  pTensor operator+(const messageVector &other) const;
   /**
    * Add where the RHS is a scalar value. We project it into a vector of the number of cols of the thing we want to add.
    * @param other
    * @return
    */
-  pTensor operator+(messageScalar &other);
+  pTensor operator+(const messageScalar &other) const;
 
   /**
  * Subtraction operator. Uses EvalSub. The RHS can either be a message pTensor or an encrypted pTensor
@@ -214,27 +360,27 @@ class pTensor {
  * @return
  *    Z = this - other
  */
-  pTensor operator-(pTensor &other);
+  pTensor operator-(const pTensor &other) const;
 
   /**
    * Subtraction where the RHS is a matrix
    * @param other
    * @return
    */
-  pTensor operator-(messageTensor &other);
+  pTensor operator-(const messageTensor &other) const;
 
   /**
    * Subtraction where the RHS is a vector
    * @param other
    * @return
    */
-  pTensor operator-(messageVector &other);
+  pTensor operator-(const messageVector &other) const;
   /**
    * Subtraction where the RHS is a scalar. We project it into a vector of the number of cols of the thing we want to add.
    * @param other
    * @return
    */
-  pTensor operator-(messageScalar &other);
+  pTensor operator-(const messageScalar &other) const;
 
   /**
  * Multiplication operator. Uses EvalAdd. The RHS can either be a message pTensor or an encrypted pTensor
@@ -246,27 +392,39 @@ class pTensor {
  * @return
  *    Z = this - other
  */
-  pTensor operator*(pTensor &other);
+  pTensor operator*(const pTensor &other) const;
 
   /**
    * Hadamard where the RHS is a matrix
    * @param other
    * @return
    */
-  pTensor operator*(messageTensor &other);
+  pTensor operator*(const messageTensor &other) const;
 
   /**
    * Hadamard where the RHS is a vector that we broadcast
    * @param other
    * @return
    */
-  pTensor operator*(messageVector &other);
+  pTensor operator*(const messageVector &other) const;
   /**
    * Hadamard where RHS is a scalar that we broadcast into the number of cols of the thing we want to add.
    * @param other
    * @return
    */
-  pTensor operator*(messageScalar &other);
+  pTensor operator*(const messageScalar &other) const;
+
+  /**
+   * In-place versions of +, - and *. Same broadcasting rules but the result must have our shape. Our ciphertexts are
+   *    overwritten (added into directly when nobody else holds them) so no new cipherTensor or pTensor is built.
+   *    Copies of this pTensor made beforehand are not affected.
+   * @param other : thing to add/subtract/multiply by
+   * @return
+   *    *this
+   */
+  pTensor &operator+=(const pTensor &other);
+  pTensor &operator-=(const pTensor &other);
+  pTensor &operator*=(const pTensor &other);
 
   /**
    * A dot product corresponding to how one normally thinks about a dot product
@@ -275,7 +433,7 @@ class pTensor {
    * @param other
    * @return
    */
-  pTensor dot(pTensor &other, bool asRowVector = true);  // dot prod
+  pTensor dot(const pTensor &other, bool asRowVector = true);  // dot prod
 
   /**
    * Encrypted dot product:
@@ -288,7 +446,7 @@ class pTensor {
    * @param asRowVector
    * @return
    */
-  pTensor encryptedDot(pTensor &other);  // dot prod
+  pTensor encryptedDot(const pTensor &other);  // dot prod
   /**
    * Reduce along both axes. Basically sum up all the elements
    *    Some #precomputation happens here that can be eventually disabled.
@@ -309,6 +467,15 @@ class pTensor {
    */
   pTensor sum(int axis);
 
+  /**
+   * sum() and sum(axis) in place: the reduction is accumulated into our own ciphertexts and we take on the shape
+   *    of the result
+   * @return
+   *    *this
+   */
+  pTensor &sumInPlace();
+  pTensor &sumInPlace(int axis);
+
   /**
    * Take the transpose of the encrypted matrix
    *
@@ -316,26 +483,34 @@ class pTensor {
    *
    * @return
    */
-  pTensor T();
+  pTensor T() const;
 
   /**
    * Plaintext Transpose.
    */
-  messageTensor plainT();
+  messageTensor plainT() const;
+
+  /**
+   * Static plaintext transpose into a new contiguous store. Cache-blocked, vectorized where the CPU allows it and split
+   *    across m_numWorkers threads for large messages (see transpose_kernels.h)
+   */
+  static messageStore plainT(const messageStore &message);
 
   /**
-   * Static plaintext transpose
+   * Static plaintext transpose of nested messages. Goes through the messageStore overload
    */
-  static messageTensor plainT(messageTensor message);
+  static messageTensor plainT(const messageTensor &message);
+  static realTensor plainT(const realTensor &message);
+  static floatTensor plainT(const floatTensor &message);
 
   /**
    * Debug the messages from an UNENCRYPTED matrix. this is unrealistic and will not be available for general purposes as we
    * would need the secret key
    */
   void debugMessages() {
-      for (auto &v: (m_messages)) {
-          for (auto &s: v) {
-              std::cout << s << ",";
+      for (unsigned int r = 0; r < m_messages.rows(); ++r) {
+          for (unsigned int c = 0; c < m_messages.cols(); ++c) {
+              std::cout << m_messages.at(r, c) << ",";
           }
           std::cout << '\n';
       }
@@ -345,7 +520,7 @@ class pTensor {
    * Check if the message is non-empty
    * @return
    */
-  bool messageNotEmpty() {
+  bool messageNotEmpty() const {
       return (!m_messages.empty());
   }
 
@@ -353,7 +528,7 @@ class pTensor {
    * Check if the cipher is non-empty
    * @return
    */
-  bool cipherNotEmpty() {
+  bool cipherNotEmpty() const {
       return (!m_ciphertexts.empty());
   }
 
@@ -433,20 +608,81 @@ class pTensor {
    * @param arg2
    * @return
    */
-  static pTensor hstack(pTensor arg1, pTensor arg2);
+  static pTensor hstack(const pTensor &arg1, const pTensor &arg2);
 
   /////////////////////////////////////////////////////////////////
   //Getters
   /////////////////////////////////////////////////////////////////
 
   /**
-   * Get the message
+   * How the encrypted values are laid out across ciphertexts
+   */
+  pTensorLayout layout() const { return m_layout; }
+
+  /**
+   * Number of slots reserved for every line in the packed layouts. 0 for rowPerCipher
+   */
+  unsigned int blockSize() const { return m_blockSize; }
+
+  /**
+   * Number of ciphertexts backing this pTensor
+   */
+  unsigned int numCiphertexts() const { return m_ciphertexts.size(); }
+
+  /**
+   * The rotation indices we need keys for: every power of two up to getBatchSize() in both directions, plus
+   *    getRepeatBatchSize() for repeating scalars. Pass these to EvalAtIndexKeyGen during setup (after setting m_cc).
+   *    Every rotation we do is decomposed into these steps (see rotate) so it costs O(log(offset)) key switches.
+   * @return
+   */
+  static std::vector<int32_t> rotationIndices();
+
+  /**
+   * Rotate the slots of every ciphertext left by offset, or right if it is negative. Like EvalAtIndex the values
+   *    wrap around the end of the slots, not the end of the row. Needs the keys from rotationIndices()
+   * @param offset
+   *    How many slots to rotate by
+   * @return
+   */
+  pTensor rotate(int offset);
+
+  /**
+   * Rotate by several offsets at once. Cheaper than calling rotate() once per offset: the key-switching decomposition
+   *    of every ciphertext is computed a single time (EvalFastRotationPrecompute) and shared by all of the offsets,
+   *    and offsets with the same leading power-of-two steps share those too
+   * @param offsets
+   *    How many slots to rotate by, see rotate()
    * @return
+   *    One pTensor per offset, in the same order
    */
-  messageTensor getMessage() {
-      return m_messages;
+  std::vector<pTensor> rotations(const std::vector<int> &offsets);
+
+  /**
+   * Get a copy of the message as nested rows, widened to complex if it is stored as reals
+   * @return
+   */
+  messageTensor getMessage() const {
+      return m_messages.to<messageScalar>();
   }
 
+  /**
+   * The message in whatever precision and layout it is stored as. Copying it only copies a reference to its values
+   */
+  const messageStore &messages() const { return m_messages; }
+
+  /**
+   * Element type of the message. Encrypted pTensors are complexDouble
+   */
+  messagePrecision precision() const { return m_messages.precision(); }
+
+  /**
+   * Copy of this (plaintext) pTensor with the message stored in the given precision. Narrowing drops the imaginary
+   *    parts, which is lossless for everything we read from a CSV
+   * @param precision
+   * @return
+   */
+  pTensor withPrecision(messagePrecision precision) const;
+
   /**
    * Check if the current pTensor is a scalar
    * @return
@@ -484,7 +720,18 @@ class pTensor {
    * @return
    *    new REPEATED weights of shape #features, #observations
    */
-  static pTensor applyGradient(pTensor matrixOfWeights, pTensor vectorGradients);
+  static pTensor applyGradient(const pTensor &matrixOfWeights, const pTensor &vectorGradients);
+
+  /**
+   * applyGradient that updates the weights in place, e.g. once per epoch in a training loop
+   * @param matrixOfWeights
+   *    Current weights of shape: #features, #observations. Overwritten with the new weights
+   * @param vectorGradients
+   *    Gradient to apply: 1, #features
+   * @return
+   *    matrixOfWeights
+   */
+  static pTensor &applyGradientInPlace(pTensor &matrixOfWeights, const pTensor &vectorGradients);
 
   /**
    * Utility function to go from a scalar directly to a pTensor
@@ -499,10 +746,7 @@ class pTensor {
       messageVector asVector = {value};
 
       if (encrypt){
-          cipherVector container = (*m_cc)->Encrypt(
-              m_public_key,
-              (*m_cc)->MakeCKKSPackedPlaintext(asVector)
-          );
+          cipherVector container = encryptPlaintext((*m_cc)->MakeCKKSPackedPlaintext(asVector));
           cipherTensor tensorContainer = {container};
           pTensor newTensor = pTensor(1, 1, tensorContainer);
           return newTensor;
@@ -546,7 +790,36 @@ class pTensor {
    *    The other pTensor
    * @return
    */
-  cipherTensor binaryOpAbstraction(const char *flag, pTensor other);
+  cipherTensor binaryOpAbstraction(const char *flag, const pTensor &other) const;
+
+  /**
+   * Run (lhs flag other) right away. The body of +, - and * when we are not lazy, and what the non-elementwise ops
+   *    use internally since they need the ciphertexts
+   * @param flag
+   *    One of {add, sub, mult}
+   * @param other
+   *    The other pTensor
+   * @return
+   */
+  pTensor eagerBinaryOp(const char *flag, const pTensor &other) const;
+
+  /**
+   * Run (lhs flag other) right away and store the result in *this. The body of +=, -= and *= when we are not lazy
+   * @param flag
+   *    One of {add, sub, mult}
+   * @param other
+   *    The other pTensor
+   * @return
+   *    *this
+   */
+  pTensor &inPlaceBinaryOp(const char *flag, const pTensor &other);
+
+  /**
+   * Throw if either operand of a multiplication has no level left. Does nothing if m_multDepth is not set
+   * @param other
+   *    The RHS
+   */
+  void checkDepth(const pTensor &other) const;
   /**
    * The applicator for cipher-cipher operations
    * @param opFlag
@@ -573,13 +846,314 @@ class pTensor {
 
 
 
+  /**
+   * Record the throughput of an encrypt/decrypt call
+   * @param numRows
+   *    how many rows were processed
+   * @param start
+   *    when the processing started
+   */
+  static void recordThroughput(unsigned int numRows, std::chrono::high_resolution_clock::time_point start);
+
+  static std::atomic<double> m_lastThroughput;
+  static std::atomic<unsigned int> m_refreshCount;
+
+  /**
+   * Encode a plaintext operand through m_plaintextCache
+   * @param values
+   *    The values to pack
+   * @param level
+   *    Level of the ciphertext this plaintext will be combined with, so that the scaling factors line up
+   * @return
+   */
+  static lbcrypto::Plaintext encode(const messageVector &values, uint32_t level = 0);
+
+  /**
+   * The slot masks of dot()'s single rotation row vector path: mask i is 1 in slot 2 * getBatchSize() - rows + i
+   *    and 0 elsewhere. They are encoded (in parallel) only when the context, rows or level differ from the last call
+   *    and are kept in m_rowSlotMasks rather than m_plaintextCache, so that rows of them neither thrash the cache nor
+   *    evict the masks of T() and applyGradient
+   * @param rows
+   * @param level
+   * @return
+   */
+  static std::shared_ptr<const std::vector<lbcrypto::Plaintext>> rowSlotMasks(unsigned int rows, uint32_t level);
+
+  struct slotMaskSet {
+    std::weak_ptr<lbcrypto::CryptoContextImpl<lbcrypto::DCRTPoly>> context;
+    unsigned int rows;
+    uint32_t level;
+    std::shared_ptr<const std::vector<lbcrypto::Plaintext>> masks;
+  };
+  // Only the last set is held on to. A training loop calls dot() with the same shape and level every step
+  static std::shared_ptr<const slotMaskSet> m_rowSlotMasks;
+
+  /////////////////////////////////////////////////////////////////
+  //Tracing (trace.h)
+  /////////////////////////////////////////////////////////////////
+
+  /**
+   * traceScope of an operator, labelled with our shape
+   * @param name
+   *    string literal
+   */
+  traceScope traceOp(const char *name) const {
+      return traceScope(name, kTracePTensor, "rows", m_rows, "cols", m_cols);
+  }
+
+  // The PALISADE calls worth tracing. Each makes the call of the same name on *m_cc inside a traceScope
+
+  template<class rhs>
+  static cipherVector evalMult(const cipherVector &lhs, const rhs &other) {
+      traceScope trace("EvalMult", kTracePalisade, "level", lhs->GetLevel());
+      return (*m_cc)->EvalMult(lhs, other);
+  }
+
+  static cipherVector evalAtIndex(const cipherVector &cipher, int32_t index) {
+      traceScope trace("EvalAtIndex", kTracePalisade, "level", cipher->GetLevel(), "index", index);
+      return (*m_cc)->EvalAtIndex(cipher, index);
+  }
+
+  static auto evalFastRotationPrecompute(const cipherVector &cipher) {
+      traceScope trace("EvalFastRotationPrecompute", kTracePalisade, "level", cipher->GetLevel());
+      return (*m_cc)->EvalFastRotationPrecompute(cipher);
+  }
+
+  template<class decomposition>
+  static cipherVector evalFastRotation(const cipherVector &cipher, int32_t index, uint32_t m,
+                                       const decomposition &digits) {
+      traceScope trace("EvalFastRotation", kTracePalisade, "level", cipher->GetLevel(), "index", index);
+      return (*m_cc)->EvalFastRotation(cipher, index, m, digits);
+  }
+
+  static cipherVector evalSum(const cipherVector &cipher, uint32_t batchSize) {
+      traceScope trace("EvalSum", kTracePalisade, "level", cipher->GetLevel(), "batchSize", batchSize);
+      return (*m_cc)->EvalSum(cipher, batchSize);
+  }
+
+  static cipherVector evalInnerProduct(const cipherVector &lhs, const cipherVector &other, uint32_t batchSize) {
+      traceScope trace("EvalInnerProduct", kTracePalisade, "level", lhs->GetLevel(), "batchSize", batchSize);
+      return (*m_cc)->EvalInnerProduct(lhs, other, batchSize);
+  }
+
+  static cipherVector encryptPlaintext(const lbcrypto::Plaintext &plaintext) {
+      traceScope trace("Encrypt", kTracePalisade);
+      return (*m_cc)->Encrypt(m_public_key, plaintext);
+  }
+
+  static lbcrypto::Plaintext decryptCipher(const cipherVector &cipher) {
+      traceScope trace("Decrypt", kTracePalisade, "level", cipher->GetLevel());
+      lbcrypto::Plaintext plaintext;
+      (*m_cc)->Decrypt(m_private_key, cipher, &plaintext);
+      return plaintext;
+  }
+
+  /////////////////////////////////////////////////////////////////
+  //Lazy evaluation (p_tensor_lazy.cpp)
+  /////////////////////////////////////////////////////////////////
+
+  friend class pTensorEvaluator;
+
+  /**
+   * Record (lhs flag other) in the expression graph instead of computing it
+   * @param flag
+   *    One of {add, sub, mult}
+   * @param other
+   *    RHS, either encrypted, pending or a plaintext
+   * @return
+   *    A pending pTensor with the broadcast shape
+   */
+  pTensor lazyBinaryOp(const char *flag, const pTensor &other) const;
+
+  /**
+   * The expression node for a pTensor: its pending expression or a new leaf holding it
+   */
+  static std::shared_ptr<pTensorExpr> asExpr(const pTensor &tensor);
+
+  /**
+   * Repeat an encrypted scalar across getBatchSize() slots so that it can be combined with a vector. The result is
+   *    cached (see m_replica) so repeated calls, and calls on copies made after the first, are free
+   * @return
+   */
+  cipherVector replicateScalar() const;
+
+  /**
+   * Rotate a single ciphertext by an arbitrary offset using only the power-of-two keys from rotationIndices()
+   */
+  static cipherVector rotate(const cipherVector &cipher, int offset);
+
+  /**
+   * Rotate a single ciphertext by several offsets, hoisting the rotations that start from it (see rotations())
+   * @return
+   *    One ciphertext per offset, in the same order
+   */
+  static cipherTensor rotateMany(const cipherVector &cipher, const std::vector<int> &offsets);
+
+  /**
+   * The power-of-two steps (largest first) that make up a rotation by offset
+   */
+  static std::vector<int> rotationSteps(int offset);
+
+  /**
+   * Add up the ciphertexts as a balanced binary tree, one layer at a time across m_numWorkers threads. The shape of the
+   *    tree only depends on the number of ciphertexts so the result does not change with the number of workers.
+   * @param ciphers
+   *    What to add up. Must not be empty
+   * @return
+   */
+  static cipherVector treeSum(const cipherTensor &ciphers);
+
+  /**
+   * treeSum that accumulates into the given ciphertexts. The total ends up in ciphers[0], the other entries are left
+   *    holding partial sums
+   */
+  static void treeSumInPlace(cipherTensor &ciphers);
+
+  /**
+   * into += from. Uses PALISADE's in-place add when nobody else holds into, otherwise into is replaced by the sum
+   */
+  static void addInto(cipherVector &into, const cipherVector &from);
+
+  /**
+   * Shared body of load() and loadRows(): read records [begin, end) of a saved pTensor, or all of them (and the
+   *    original shape) if wholeTensor is set
+   */
+  static pTensor loadRecords(const std::string &path, bool wholeTensor, unsigned int begin, unsigned int end);
+
+  /////////////////////////////////////////////////////////////////
+  //Packed layout helpers (p_tensor_packed.cpp)
+  /////////////////////////////////////////////////////////////////
+
+  /**
+   * Number of lines (rows for packedRows, cols for packedCols) in the packed layouts
+   */
+  unsigned int numLines() const;
+
+  /**
+   * Number of values in a line (cols for packedRows, rows for packedCols) in the packed layouts
+   */
+  unsigned int lineLength() const;
+
+  /**
+   * Number of lines that share a single ciphertext
+   */
+  unsigned int linesPerCipher() const;
+
+  /**
+   * Construct an encrypted pTensor in a packed layout from the number of lines and their length
+   */
+  static pTensor fromLines(pTensorLayout layout,
+                           unsigned int blockSize,
+                           unsigned int numLines,
+                           unsigned int lineLength,
+                           cipherTensor ciphers);
+
+  /**
+   * Pack a full (m_rows, m_cols) message into the per-ciphertext slot vectors of our layout
+   */
+  messageTensor packMessages(const messageStore &message) const;
+
+  /**
+   * Inverse of packMessages: go from the decrypted slots back to a (m_rows, numCols) message
+   */
+  messageTensor unpackMessages(const messageTensor &slots, unsigned int numCols) const;
+
+  /**
+   * Number of lines that the given ciphertext holds. Only the last ciphertext can be partially filled
+   */
+  unsigned int linesInCipher(unsigned int cipherIndex) const;
+
+  /**
+   * Plaintext with ones in slots [begin, end) of every block in [firstBlock, lastBlock)
+   */
+  static lbcrypto::Plaintext blockMask(unsigned int blockSize,
+                                       unsigned int firstBlock,
+                                       unsigned int lastBlock,
+                                       unsigned int begin,
+                                       unsigned int end,
+                                       uint32_t level = 0);
+
+  /**
+   * binaryOpAbstraction for when either side is packed. See the broadcasting rules in p_tensor_packed.cpp
+   */
+  cipherTensor packedBinaryOp(const char *flag, const pTensor &other) const;
+
+  /**
+   * Sum the values within every line. The result has lines of length 1 (the sum sits at the start of the block)
+   */
+  pTensor sumWithinLines();
+
+  /**
+   * Sum all of the lines together. The result is a single line sitting in the first block
+   */
+  pTensor sumAcrossLines();
+
+  /**
+   * Reduce everything down to an (unpacked) encrypted scalar
+   */
+  pTensor packedSum();
+
+  /**
+   * Dot product where self is packed. Equivalent to (self * other).sum(1) with numpy broadcasting
+   */
+  pTensor packedDot(const pTensor &other, bool asRowVector);
+
+  /**
+   * Vertically stack two packed pTensors of the same layout
+   */
+  static pTensor packedHstack(const pTensor &arg1, const pTensor &arg2);
+
+  /**
+   * Copy whatever sits in the first block of a ciphertext into every block
+   */
+  static cipherVector replicateAcrossBlocks(const cipherVector &cipher, unsigned int blockSize);
+
+  /**
+   * Copy whatever sits in the first slot of every block into the rest of that block
+   */
+  static cipherVector replicateWithinBlocks(const cipherVector &cipher, unsigned int blockSize);
+
+  /**
+   * Power of two that fits the given line length
+   */
+  static unsigned int blockSizeFor(unsigned int lineLength);
+
   unsigned int m_rows = 0;
   unsigned int m_cols = 0;
   bool m_isEncrypted = false;  // Default unencrypted unless arg is passed in
-  messageTensor m_messages;
+  messageStore m_messages;
   cipherTensor m_ciphertexts;
   bool m_isRepeated = false;  // Only used for scalar stuff. We record if they have been repeated (into a vector)
+  pTensorLayout m_layout = pTensorLayout::rowPerCipher;
+  unsigned int m_blockSize = 0;  // Only used in the packed layouts
+
+  /**
+   * Replicated form of an encrypted scalar. Shared by every copy of this pTensor made after the first
+   *    replicateScalar() so that a scalar used as the RHS of many operations (e.g. the learning rate) is only
+   *    replicated once. Null until then: almost no pTensor is ever broadcast as a scalar, so the rest never pay for it
+   */
+  struct scalarReplica {
+    cipherVector source;  // The ciphertext that was replicated. Used to detect when ours has been replaced
+    cipherVector replicated;
+    std::mutex lock;
+  };
+  mutable std::shared_ptr<scalarReplica> m_replica = nullptr;
+
+  // Only set while lazily evaluating. Shared with any copies so that the graph is evaluated once
+  std::shared_ptr<pTensorExpr> m_expr = nullptr;
 
 };
 
+/**
+ * Node of the lazy expression graph. Leaves hold an encrypted pTensor or a plaintext constant, the other nodes
+ *  one of the elementwise ops. Once evaluated a node keeps its result so that every pTensor sharing it reuses it.
+ */
+struct pTensorExpr {
+  std::string op;  // "leaf", "add", "sub" or "mult"
+  std::shared_ptr<pTensorExpr> lhs = nullptr;
+  std::shared_ptr<pTensorExpr> rhs = nullptr;
+  pTensor value;  // The leaf or, once evaluated, the result
+  bool evaluated = false;
+};
+
 #endif // PTENSOR_P_TENSOR_H
@@ -0,0 +1,267 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Binary save/load for pTensor. A saved pTensor is a single file laid out as
+ *
+ *      magic           8 bytes, "pTensor\0"
+ *      version         u32
+ *      flags           u32: bit 0 encrypted, bit 1 repeated
+ *      layout          u32, pTensorLayout
+ *      rows, cols      u32, u32
+ *      blockSize       u32, only used by the packed layouts
+ *      precision       u32, messagePrecision of the message rows
+ *      numRecords      u64
+ *      index           (numRecords + 1) x u64: absolute offset of every record, then the end of the file
+ *      records         u64 byte length followed by the payload
+ *
+ *  A record is a ciphertext (PALISADE's binary serialization) or a message row: a u64 count, then the values as they
+ *  are stored in memory, i.e. real and imaginary parts as IEEE-754 doubles, or just the real parts as doubles or
+ *  floats. Loading rebuilds a messageStore of the same precision. Every integer is little-endian.
+ *
+ *  Loading memory-maps the file and deserializes every record in place, so nothing is copied into an intermediate
+ *  buffer. Since the index sits up front, loadRows() goes straight to the rows it needs and never reads (or parses)
+ *  the rest of the file.
+ */
+#include "p_tensor.h"
+#include "binary_io.h"
+#include "mapped_file.h"
+#include "ciphertext-ser.h"
+#include "cryptocontext-ser.h"
+#include "pubkeylp-ser.h"
+#include "scheme/ckks/ckks-ser.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+using binaryIO::readDouble;
+using binaryIO::readFloat;
+using binaryIO::readUint;
+using binaryIO::writeDouble;
+using binaryIO::writeFloat;
+using binaryIO::writeUint;
+
+const char kMagic[8] = {'p', 'T', 'e', 'n', 's', 'o', 'r', '\0'};
+const uint32_t kVersion = 2;
+const uint32_t kFlagEncrypted = 1;
+const uint32_t kFlagRepeated = 2;
+const size_t kHeaderSize = sizeof(kMagic) + 7 * sizeof(uint32_t) + sizeof(uint64_t);
+
+struct fileHeader {
+  uint32_t flags;
+  uint32_t layout;
+  uint32_t rows;
+  uint32_t cols;
+  uint32_t blockSize;
+  messagePrecision precision;
+  uint64_t numRecords;
+};
+
+fileHeader readHeader(std::istream &in, const std::string &path) {
+    char magic[sizeof(kMagic)];
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+        throw std::runtime_error(path + " is not a pTensor file");
+    }
+    auto version = static_cast<uint32_t>(readUint(in, 4));
+    if (version != kVersion) {
+        throw std::runtime_error(path + " has pTensor file version " + std::to_string(version)
+                                     + " but we only read version " + std::to_string(kVersion));
+    }
+    fileHeader header{};
+    header.flags = static_cast<uint32_t>(readUint(in, 4));
+    header.layout = static_cast<uint32_t>(readUint(in, 4));
+    header.rows = static_cast<uint32_t>(readUint(in, 4));
+    header.cols = static_cast<uint32_t>(readUint(in, 4));
+    header.blockSize = static_cast<uint32_t>(readUint(in, 4));
+    auto precision = static_cast<uint32_t>(readUint(in, 4));
+    if (precision > static_cast<uint32_t>(messagePrecision::realFloat)) {
+        throw std::runtime_error(path + " has an unknown message precision " + std::to_string(precision));
+    }
+    header.precision = static_cast<messagePrecision>(precision);
+    header.numRecords = readUint(in, 8);
+    return header;
+}
+
+void writeValue(std::ostream &out, const messageScalar &value) {
+    writeDouble(out, value.real());
+    writeDouble(out, value.imag());
+}
+void writeValue(std::ostream &out, realScalar value) { writeDouble(out, value); }
+void writeValue(std::ostream &out, floatScalar value) { writeFloat(out, value); }
+
+void readValue(std::istream &in, messageScalar &value) {
+    double real = readDouble(in);
+    double imag = readDouble(in);
+    value = messageScalar(real, imag);
+}
+void readValue(std::istream &in, realScalar &value) { value = readDouble(in); }
+void readValue(std::istream &in, floatScalar &value) { value = readFloat(in); }
+
+template<class scalar>
+void writeRow(std::ostream &out, const messageStore &messages, size_t r) {
+    const scalar *first = messages.data<scalar>() + static_cast<std::ptrdiff_t>(r) * messages.rowStride();
+    writeUint(out, messages.cols(), 8);
+    for (size_t c = 0; c < messages.cols(); ++c) {
+        writeValue(out, first[static_cast<std::ptrdiff_t>(c) * messages.colStride()]);
+    }
+}
+
+/**
+ * Read a row written by writeRow() into row r of messages, which is row-major and holds scalar
+ */
+template<class scalar>
+void readRow(std::istream &in, messageStore &messages, size_t r) {
+    scalar *first = messages.mutableData<scalar>() + r * messages.cols();
+    for (size_t c = 0; c < messages.cols(); ++c) {
+        readValue(in, first[c]);
+    }
+}
+
+/**
+ * A (rows, cols) row-major store of zeros in the given precision
+ */
+messageStore zerosAs(messagePrecision precision, size_t rows, size_t cols) {
+    switch (precision) {
+        case messagePrecision::realDouble: return messageStore::zeros<realScalar>(rows, cols);
+        case messagePrecision::realFloat: return messageStore::zeros<floatScalar>(rows, cols);
+        default: return messageStore::zeros<messageScalar>(rows, cols);
+    }
+}
+
+}  // namespace
+
+void pTensor::save(const std::string &path) const {
+    if (isPending()) {
+        return evaluated().save(path);
+    }
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) {
+        throw std::runtime_error("Could not open " + path + " for writing");
+    }
+    uint64_t numRecords = m_isEncrypted ? m_ciphertexts.size() : m_messages.rows();
+
+    out.write(kMagic, sizeof(kMagic));
+    writeUint(out, kVersion, 4);
+    writeUint(out, (m_isEncrypted ? kFlagEncrypted : 0) | (m_isRepeated ? kFlagRepeated : 0), 4);
+    writeUint(out, static_cast<uint32_t>(m_layout), 4);
+    writeUint(out, m_rows, 4);
+    writeUint(out, m_cols, 4);
+    writeUint(out, m_blockSize, 4);
+    writeUint(out, static_cast<uint32_t>(m_messages.precision()), 4);
+    writeUint(out, numRecords, 8);
+
+    // Reserve the index, write the records and come back to fill it in
+    std::vector<uint64_t> index(numRecords + 1);
+    uint64_t indexStart = kHeaderSize;
+    out.seekp(static_cast<std::streamoff>(indexStart + index.size() * sizeof(uint64_t)));
+    for (uint64_t i = 0; i < numRecords; ++i) {
+        index[i] = static_cast<uint64_t>(out.tellp());
+        std::ostringstream record;
+        if (m_isEncrypted) {
+            lbcrypto::Serial::Serialize(m_ciphertexts[i], record, SerType::BINARY);
+        } else {
+            switch (m_messages.precision()) {
+                case messagePrecision::realDouble: writeRow<realScalar>(record, m_messages, i);
+                    break;
+                case messagePrecision::realFloat: writeRow<floatScalar>(record, m_messages, i);
+                    break;
+                default: writeRow<messageScalar>(record, m_messages, i);
+            }
+        }
+        auto payload = record.str();
+        writeUint(out, payload.size(), 8);
+        out.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+    }
+    index[numRecords] = static_cast<uint64_t>(out.tellp());
+
+    out.seekp(static_cast<std::streamoff>(indexStart));
+    for (auto offset: index) {
+        writeUint(out, offset, 8);
+    }
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+pTensor pTensor::load(const std::string &path) {
+    return loadRecords(path, true, 0, 0);
+}
+
+pTensor pTensor::loadRows(const std::string &path, unsigned int begin, unsigned int end) {
+    return loadRecords(path, false, begin, end);
+}
+
+pTensor pTensor::loadRecords(const std::string &path, bool wholeTensor, unsigned int begin, unsigned int end) {
+    // Deserialize straight out of the mapping. Only the pages of the records we load are ever read in
+    mappedFile file(path);
+    memoryStreambuf buffer(file.data(), file.size());
+    std::istream in(&buffer);
+    auto header = readHeader(in, path);
+    bool encrypted = (header.flags & kFlagEncrypted) != 0;
+    auto layout = static_cast<pTensorLayout>(header.layout);
+
+    if (wholeTensor) {
+        begin = 0;
+        end = static_cast<unsigned int>(header.numRecords);
+    } else {
+        if (encrypted && layout != pTensorLayout::rowPerCipher) {
+            throw std::runtime_error("loadRows() needs a rowPerCipher pTensor. " + path + " is packed");
+        }
+        if (begin > end || end > header.numRecords) {
+            throw std::runtime_error("Rows [" + std::to_string(begin) + ", " + std::to_string(end) + ") are out of "
+                                         + "range for " + path + " which has " + std::to_string(header.rows)
+                                         + " rows");
+        }
+    }
+
+    // Only the part of the index we need
+    in.seekg(static_cast<std::streamoff>(kHeaderSize + begin * sizeof(uint64_t)));
+    std::vector<uint64_t> index(end - begin + 1);
+    for (auto &offset: index) {
+        offset = readUint(in, 8);
+    }
+    if (index.back() > file.size() || !std::is_sorted(index.begin(), index.end())) {
+        throw std::runtime_error("Corrupt index in " + path);
+    }
+
+    cipherTensor ciphers;
+    messageStore messages = encrypted ? messageStore() : zerosAs(header.precision, end - begin, header.cols);
+    for (unsigned int i = 0; i + 1 < index.size(); ++i) {
+        memoryStreambuf recordBuffer(file.data() + index[i], index[i + 1] - index[i]);
+        std::istream record(&recordBuffer);
+        auto length = readUint(record, 8);
+        if (length + sizeof(uint64_t) != index[i + 1] - index[i]) {
+            throw std::runtime_error("Corrupt record " + std::to_string(begin + i) + " in " + path);
+        }
+        if (encrypted) {
+            cipherVector cipher;
+            lbcrypto::Serial::Deserialize(cipher, record, SerType::BINARY);
+            ciphers.emplace_back(std::move(cipher));
+        } else {
+            if (readUint(record, 8) != header.cols) {
+                throw std::runtime_error("Corrupt record " + std::to_string(begin + i) + " in " + path);
+            }
+            switch (header.precision) {
+                case messagePrecision::realDouble: readRow<realScalar>(record, messages, i);
+                    break;
+                case messagePrecision::realFloat: readRow<floatScalar>(record, messages, i);
+                    break;
+                default: readRow<messageScalar>(record, messages, i);
+            }
+        }
+    }
+
+    unsigned int rows = wholeTensor ? header.rows : end - begin;
+    pTensor loaded = encrypted ? pTensor(rows, header.cols, std::move(ciphers))
+                               : pTensor(rows, header.cols, std::move(messages));
+    loaded.m_isRepeated = (header.flags & kFlagRepeated) != 0;
+    if (wholeTensor) {
+        loaded.m_layout = layout;
+        loaded.m_blockSize = header.blockSize;
+    }
+    return loaded;
+}
@@ -0,0 +1,358 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Lazy evaluation for pTensor (see pTensor::m_lazy). While lazy, +, - and * only record a graph of pTensorExpr.
+ *  When the graph gets evaluated we:
+ *      1) flatten chains of the same kind of op (a + b - c, a * b * c) as long as the intermediate values are not
+ *          used anywhere else in the graph
+ *      2) fold the plaintext constants of a chain into a single plaintext, so x * c1 * c2 costs one multiplication
+ *      3) look every chain up by its canonical form (its sorted operands) so identical subexpressions, e.g. a * b
+ *          and b * a, are only computed once
+ *      4) multiply the operands of a chain shallowest pair first. A chain of n operands then costs ceil(log2(n))
+ *          levels on top of its deepest operand instead of n - 1
+ *
+ *  Operands are always combined with the encrypted, larger (in the broadcasting sense) one on the LHS, which is what
+ *  the eager operators expect.
+ */
+#include "p_tensor.h"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+
+pTensor pTensor::lazyBinaryOp(const char *flag, const pTensor &other) const {
+    assert(m_cc != nullptr && (cipherNotEmpty() || isPending())
+               && (other.messageNotEmpty() || other.cipherNotEmpty() || other.isPending()));
+    shapeVerifier(*this, other);
+
+    auto node = std::make_shared<pTensorExpr>();
+    node->op = flag;
+    node->lhs = asExpr(*this);
+    node->rhs = asExpr(other);
+
+    pTensor newTensor;
+    newTensor.m_rows = std::max(m_rows, other.m_rows);
+    newTensor.m_cols = std::max(m_cols, other.m_cols);
+    newTensor.m_isEncrypted = true;
+    newTensor.m_layout = m_layout;
+    newTensor.m_blockSize = m_blockSize;
+    newTensor.m_expr = node;
+    return newTensor;
+}
+
+std::shared_ptr<pTensorExpr> pTensor::asExpr(const pTensor &tensor) {
+    if (tensor.m_expr) {
+        return tensor.m_expr;
+    }
+    auto leaf = std::make_shared<pTensorExpr>();
+    leaf->op = "leaf";
+    leaf->value = tensor;
+    return leaf;
+}
+
+/**
+ * Evaluates a pTensorExpr graph. One evaluator per eval() call: the memo of canonical forms only lives that long
+ */
+class pTensorEvaluator {
+ public:
+  explicit pTensorEvaluator(const std::shared_ptr<pTensorExpr> &root) {
+      std::unordered_set<pTensorExpr *> seen;
+      countUses(root, seen);
+  }
+
+  pTensor evaluate(const std::shared_ptr<pTensorExpr> &root) {
+      return visit(root).value;
+  }
+
+ private:
+  struct operand {
+    pTensor value;
+    std::string key;  // Canonical form, used to find identical subexpressions
+    unsigned int depth = 0;  // Estimated multiplicative depth consumed so far
+  };
+
+  void countUses(const std::shared_ptr<pTensorExpr> &node, std::unordered_set<pTensorExpr *> &seen) {
+      if (!seen.insert(node.get()).second || node->evaluated || node->op == "leaf") {
+          return;
+      }
+      for (auto &child: {node->lhs, node->rhs}) {
+          m_uses[child.get()] += 1;
+          countUses(child, seen);
+      }
+  }
+
+  /**
+   * Whether we may look through this node when flattening a chain of op
+   */
+  bool flattenable(const std::shared_ptr<pTensorExpr> &node, bool isRoot, bool (*sameKind)(const std::string &)) {
+      return !node->evaluated && sameKind(node->op) && (isRoot || m_uses[node.get()] == 1);
+  }
+
+  static bool isMult(const std::string &op) { return op == "mult"; }
+  static bool isAddOrSub(const std::string &op) { return op == "add" || op == "sub"; }
+
+  void flattenMult(const std::shared_ptr<pTensorExpr> &node,
+                   std::vector<std::shared_ptr<pTensorExpr>> &factors,
+                   bool isRoot) {
+      if (!flattenable(node, isRoot, isMult)) {
+          factors.emplace_back(node);
+          return;
+      }
+      flattenMult(node->lhs, factors, false);
+      flattenMult(node->rhs, factors, false);
+  }
+
+  void flattenAdd(const std::shared_ptr<pTensorExpr> &node,
+                  int sign,
+                  std::vector<std::pair<int, std::shared_ptr<pTensorExpr>>> &terms,
+                  bool isRoot) {
+      if (!flattenable(node, isRoot, isAddOrSub)) {
+          terms.emplace_back(sign, node);
+          return;
+      }
+      flattenAdd(node->lhs, sign, terms, false);
+      flattenAdd(node->rhs, (node->op == "sub") ? -sign : sign, terms, false);
+  }
+
+  operand visit(const std::shared_ptr<pTensorExpr> &node) {
+      if (node->evaluated || node->op == "leaf") {
+          return leafOperand(node->value);
+      }
+      operand result = isMult(node->op) ? visitMult(node) : visitAdd(node);
+
+      // Keep the result for every pTensor that shares this node and let go of the inputs
+      node->value = result.value;
+      node->evaluated = true;
+      node->lhs = nullptr;
+      node->rhs = nullptr;
+      return result;
+  }
+
+  operand visitMult(const std::shared_ptr<pTensorExpr> &node) {
+      std::vector<std::shared_ptr<pTensorExpr>> factorNodes;
+      flattenMult(node, factorNodes, true);
+
+      std::vector<operand> factors;
+      messageTensor constant;
+      for (auto &factorNode: factorNodes) {
+          auto factor = visit(factorNode);
+          if (factor.value.m_isEncrypted) {
+              factors.emplace_back(factor);
+          } else {
+              auto message = constantOf(factor.value);
+              constant = constant.empty() ? message : broadcastOp("mult", constant, message);
+          }
+      }
+      if (!constant.empty()) {
+          factors.emplace_back(constantOperand(constant));
+      }
+
+      std::vector<std::string> keys;
+      for (auto &factor: factors) {
+          keys.emplace_back(factor.key);
+      }
+      std::string key = canonicalKey("mult", keys);
+      auto found = m_memo.find(key);
+      if (found != m_memo.end()) {
+          return found->second;
+      }
+
+      // Repeatedly multiply the shallowest pair we are allowed to (encrypted LHS that is at least as large as the RHS)
+      while (factors.size() > 1) {
+          unsigned int bestI = 0, bestJ = 0;
+          unsigned int bestMax = std::numeric_limits<unsigned int>::max();
+          unsigned int bestMin = bestMax;
+          for (unsigned int i = 0; i < factors.size(); ++i) {
+              for (unsigned int j = 0; j < factors.size(); ++j) {
+                  if (i == j || !canCombine(factors[i].value, factors[j].value)) {
+                      continue;
+                  }
+                  unsigned int deeper = std::max(factors[i].depth, factors[j].depth);
+                  unsigned int shallower = std::min(factors[i].depth, factors[j].depth);
+                  if (deeper < bestMax || (deeper == bestMax && shallower < bestMin)) {
+                      bestI = i;
+                      bestJ = j;
+                      bestMax = deeper;
+                      bestMin = shallower;
+                  }
+              }
+          }
+          if (bestI == bestJ) {
+              throw std::runtime_error("Lazy evaluation could not find a valid order for a chain of multiplications");
+          }
+
+          operand product;
+          product.value = factors[bestI].value.eagerBinaryOp("mult", factors[bestJ].value);
+          product.depth = bestMax + 1;
+          factors.erase(factors.begin() + std::max(bestI, bestJ));
+          factors.erase(factors.begin() + std::min(bestI, bestJ));
+          factors.emplace_back(product);
+      }
+
+      factors[0].key = key;
+      m_memo[key] = factors[0];
+      return factors[0];
+  }
+
+  operand visitAdd(const std::shared_ptr<pTensorExpr> &node) {
+      std::vector<std::pair<int, std::shared_ptr<pTensorExpr>>> termNodes;
+      flattenAdd(node, 1, termNodes, true);
+
+      std::vector<std::pair<int, operand>> terms;
+      messageTensor constant;
+      for (auto &termNode: termNodes) {
+          auto term = visit(termNode.second);
+          if (term.value.m_isEncrypted) {
+              terms.emplace_back(termNode.first, term);
+          } else {
+              auto message = constantOf(term.value);
+              if (constant.empty()) {
+                  messageTensor sign = {{messageScalar(static_cast<double>(termNode.first))}};
+                  constant = broadcastOp("mult", message, sign);
+              } else {
+                  constant = broadcastOp((termNode.first > 0) ? "add" : "sub", constant, message);
+              }
+          }
+      }
+
+      std::vector<std::string> keys;
+      for (auto &term: terms) {
+          keys.emplace_back(((term.first > 0) ? "+" : "-") + term.second.key);
+      }
+      if (!constant.empty()) {
+          keys.emplace_back("+" + constantOperand(constant).key);
+      }
+      std::string key = canonicalKey("add", keys);
+      auto found = m_memo.find(key);
+      if (found != m_memo.end()) {
+          return found->second;
+      }
+
+      // The leftmost term of a chain is always the (positive, largest and encrypted) LHS of the original expression
+      operand accumulator = terms[0].second;
+      for (unsigned int i = 1; i < terms.size(); ++i) {
+          const char *flag = (terms[i].first > 0) ? "add" : "sub";
+          accumulator.value = accumulator.value.eagerBinaryOp(flag, terms[i].second.value);
+          accumulator.depth = std::max(accumulator.depth, terms[i].second.depth);
+      }
+      if (!constant.empty()) {
+          auto constantTensor = constantOperand(constant).value;
+          accumulator.value = accumulator.value.eagerBinaryOp("add", constantTensor);
+      }
+
+      accumulator.key = key;
+      m_memo[key] = accumulator;
+      return accumulator;
+  }
+
+  operand leafOperand(const pTensor &tensor) {
+      if (!tensor.m_isEncrypted) {
+          return constantOperand(constantOf(tensor));
+      }
+      operand result;
+      result.value = tensor;
+      result.depth = tensor.m_ciphertexts[0]->GetLevel();
+
+      // Ciphertexts are immutable so their address identifies them. The shape and layout tell apart e.g. T()
+      result.key = "c" + std::to_string(reinterpret_cast<std::uintptr_t>(tensor.m_ciphertexts[0].get()))
+          + "/" + std::to_string(tensor.m_ciphertexts.size()) + "/" + std::to_string(tensor.m_rows)
+          + "x" + std::to_string(tensor.m_cols) + "/" + std::to_string(static_cast<int>(tensor.m_layout));
+      return result;
+  }
+
+  operand constantOperand(const messageTensor &constant) {
+      operand result;
+      auto asTensor = constant;
+      result.value = pTensor(constant.size(), constant[0].size(), asTensor);
+
+      unsigned int index = 0;
+      while (index < m_constants.size() && m_constants[index] != constant) {
+          index += 1;
+      }
+      if (index == m_constants.size()) {
+          m_constants.emplace_back(constant);
+      }
+      result.key = "k" + std::to_string(index);
+      return result;
+  }
+
+  /**
+   * The message of a plaintext pTensor trimmed to its shape (the messageScalar operators store a whole row)
+   */
+  static messageTensor constantOf(const pTensor &tensor) {
+      messageTensor message(tensor.m_rows, messageVector(tensor.m_cols));
+      for (unsigned int r = 0; r < tensor.m_rows; ++r) {
+          for (unsigned int c = 0; c < tensor.m_cols; ++c) {
+              message[r][c] = tensor.m_messages.at(r, c);
+          }
+      }
+      return message;
+  }
+
+  /**
+   * Elementwise op between two plaintext messages with numpy broadcasting
+   */
+  static messageTensor broadcastOp(const std::string &flag, const messageTensor &a, const messageTensor &b) {
+      unsigned int rows = std::max(a.size(), b.size());
+      unsigned int cols = std::max(a[0].size(), b[0].size());
+      messageTensor result(rows, messageVector(cols));
+      for (unsigned int r = 0; r < rows; ++r) {
+          for (unsigned int c = 0; c < cols; ++c) {
+              auto lhs = a[(a.size() == 1) ? 0 : r][(a[0].size() == 1) ? 0 : c];
+              auto rhs = b[(b.size() == 1) ? 0 : r][(b[0].size() == 1) ? 0 : c];
+              if (flag == "add") {
+                  result[r][c] = lhs + rhs;
+              } else if (flag == "sub") {
+                  result[r][c] = lhs - rhs;
+              } else {
+                  result[r][c] = lhs * rhs;
+              }
+          }
+      }
+      return result;
+  }
+
+  /**
+   * Whether lhs * rhs is something the eager operators can do
+   */
+  static bool canCombine(const pTensor &lhs, const pTensor &rhs) {
+      return lhs.m_isEncrypted && lhs.m_rows >= rhs.m_rows && lhs.m_cols >= rhs.m_cols;
+  }
+
+  static std::string canonicalKey(const std::string &op, std::vector<std::string> keys) {
+      std::sort(keys.begin(), keys.end());
+      std::string key = op + "(";
+      for (auto &k: keys) {
+          key += k + ",";
+      }
+      return key + ")";
+  }
+
+  std::unordered_map<pTensorExpr *, unsigned int> m_uses;
+  std::unordered_map<std::string, operand> m_memo;
+  std::vector<messageTensor> m_constants;
+};
+
+const pTensor &pTensor::evaluated() const {
+    if (!m_expr) {
+        return *this;
+    }
+    if (!m_expr->evaluated) {
+        pTensorEvaluator evaluator(m_expr);
+        evaluator.evaluate(m_expr);  // Leaves the result in m_expr->value
+    }
+    return m_expr->value;
+}
+
+pTensor &pTensor::eval() {
+    if (!m_expr) {
+        return *this;
+    }
+    auto trace = traceOp("eval");
+    auto expr = m_expr;
+    pTensorEvaluator evaluator(expr);
+    *this = evaluator.evaluate(expr);
+    return *this;
+}
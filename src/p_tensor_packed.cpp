@@ -0,0 +1,320 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Packed layouts for pTensor (see pTensorLayout in p_tensor.h). Everything here works on "lines": rows for packedRows
+ *  and cols for packedCols. Line l lives in ciphertext l / linesPerCipher() starting at slot
+ *  (l % linesPerCipher()) * m_blockSize.
+ *
+ *  Broadcasting rules when the LHS is packed. The result always has the shape and layout of the LHS:
+ *      1) RHS is a plaintext: we expand it to the LHS shape and pack it the same way
+ *      2) RHS is an encrypted scalar: repeated across the slots exactly like the rowPerCipher case
+ *      3) RHS has the same layout, shape and block size: ciphertext-wise op
+ *      4) RHS is a single line of the same length sitting in the first block (a packed vector from e.g. sum(0), or a
+ *          freshly encrypted rowPerCipher row vector when the LHS is packedRows): replicated into every block
+ *      5) RHS has one value per line (same layout and block size but lines of length 1, e.g. from sum(1)):
+ *          replicated across each block
+ *  Anything else throws.
+ *
+ *  Like getBatchSize() for the rowPerCipher layout, we assume that the slots around the packed values are zero. This
+ *  holds for anything we encrypt and for the results of the reductions (which we mask).
+ */
+#include "p_tensor.h"
+
+unsigned int pTensor::blockSizeFor(unsigned int lineLength) {
+    unsigned int blockSize = 1;
+    while (blockSize < lineLength) {
+        blockSize <<= 1;
+    }
+    return blockSize;
+}
+
+unsigned int pTensor::numLines() const {
+    return (m_layout == pTensorLayout::packedCols) ? m_cols : m_rows;
+}
+
+unsigned int pTensor::lineLength() const {
+    return (m_layout == pTensorLayout::packedCols) ? m_rows : m_cols;
+}
+
+unsigned int pTensor::linesPerCipher() const {
+    if (m_layout == pTensorLayout::rowPerCipher) {
+        return 1;
+    }
+    return getBatchSize() / m_blockSize;
+}
+
+unsigned int pTensor::linesInCipher(unsigned int cipherIndex) const {
+    unsigned int perCipher = linesPerCipher();
+    return std::min(perCipher, numLines() - cipherIndex * perCipher);
+}
+
+pTensor pTensor::fromLines(pTensorLayout layout,
+                           unsigned int blockSize,
+                           unsigned int numLines,
+                           unsigned int lineLength,
+                           cipherTensor ciphers) {
+    bool colMajor = (layout == pTensorLayout::packedCols);
+    pTensor newTensor(colMajor ? lineLength : numLines, colMajor ? numLines : lineLength, std::move(ciphers));
+    newTensor.m_layout = layout;
+    newTensor.m_blockSize = blockSize;
+    return newTensor;
+}
+
+messageTensor pTensor::packMessages(const messageStore &message) const {
+    unsigned int perCipher = linesPerCipher();
+    unsigned int numCiphers = (numLines() + perCipher - 1) / perCipher;
+
+    messageTensor slots(numCiphers);
+    for (unsigned int c = 0; c < numCiphers; ++c) {
+        slots[c] = messageVector((linesInCipher(c) - 1) * m_blockSize + lineLength(), 0.0);
+    }
+
+    bool colMajor = (m_layout == pTensorLayout::packedCols);
+    for (unsigned int r = 0; r < m_rows; ++r) {
+        for (unsigned int c = 0; c < m_cols; ++c) {
+            unsigned int line = colMajor ? c : r;
+            unsigned int pos = colMajor ? r : c;
+            slots[line / perCipher][(line % perCipher) * m_blockSize + pos] = message.at(r, c);
+        }
+    }
+    return slots;
+}
+
+messageTensor pTensor::unpackMessages(const messageTensor &slots, unsigned int numCols) const {
+    unsigned int perCipher = linesPerCipher();
+    bool colMajor = (m_layout == pTensorLayout::packedCols);
+
+    messageTensor message(m_rows, messageVector(numCols));
+    for (unsigned int r = 0; r < m_rows; ++r) {
+        for (unsigned int c = 0; c < numCols; ++c) {
+            unsigned int line = colMajor ? c : r;
+            unsigned int pos = colMajor ? r : c;
+            message[r][c] = slots[line / perCipher][(line % perCipher) * m_blockSize + pos];
+        }
+    }
+    return message;
+}
+
+lbcrypto::Plaintext pTensor::blockMask(unsigned int blockSize,
+                                       unsigned int firstBlock,
+                                       unsigned int lastBlock,
+                                       unsigned int begin,
+                                       unsigned int end,
+                                       uint32_t level) {
+    messageVector mask(lastBlock * blockSize, 0.0);
+    for (unsigned int block = firstBlock; block < lastBlock; ++block) {
+        for (unsigned int pos = begin; pos < end; ++pos) {
+            mask[block * blockSize + pos] = 1;
+        }
+    }
+    return encode(mask, level);
+}
+
+cipherVector pTensor::replicateAcrossBlocks(const cipherVector &cipher, unsigned int blockSize) {
+    // Doubling: after each step twice as many blocks hold a copy of the first one
+    cipherVector replicated = cipher;
+    for (int shift = blockSize; shift < getBatchSize(); shift <<= 1) {
+        replicated = (*m_cc)->EvalAdd(replicated, rotate(replicated, -shift));
+    }
+    return replicated;
+}
+
+cipherVector pTensor::replicateWithinBlocks(const cipherVector &cipher, unsigned int blockSize) {
+    // Same doubling trick but within the blocks. Nothing crosses into the next block because at step k only the first
+    // 2^k slots of every block are populated
+    cipherVector replicated = cipher;
+    for (unsigned int shift = 1; shift < blockSize; shift <<= 1) {
+        replicated = (*m_cc)->EvalAdd(replicated, rotate(replicated, -static_cast<int>(shift)));
+    }
+    return replicated;
+}
+
+cipherTensor pTensor::packedBinaryOp(const char *flag, const pTensor &other) const {
+    if (m_layout == pTensorLayout::rowPerCipher) {
+        throw std::runtime_error("A packed RHS requires a packed LHS. Encrypt both sides with the same layout");
+    }
+    if (std::max(m_rows, other.m_rows) != m_rows || std::max(m_cols, other.m_cols) != m_cols) {
+        throw std::runtime_error("A packed LHS cannot be broadcast. Put the larger pTensor on the LHS");
+    }
+
+    cipherTensor container(m_ciphertexts.size());
+
+    // 1) plaintext: expand to our shape and pack it like us
+    if (!other.m_isEncrypted) {
+        messageTensor expanded(m_rows, messageVector(m_cols));
+        for (unsigned int r = 0; r < m_rows; ++r) {
+            for (unsigned int c = 0; c < m_cols; ++c) {
+                expanded[r][c] = other.isScalar() ?
+                                 other.m_messages.at(0, 0) :
+                                 other.m_messages.at((other.m_rows == 1) ? 0 : r, (other.m_cols == 1) ? 0 : c);
+            }
+        }
+        auto slots = packMessages(expanded);
+        for (unsigned int i = 0; i < m_ciphertexts.size(); ++i) {
+            auto pt = encode(slots[i], m_ciphertexts[i]->GetLevel());
+            container[i] = applyBinaryOp(flag, m_ciphertexts[i], pt);
+        }
+        return container;
+    }
+
+    bool sameGeometry = (other.m_layout == m_layout && other.m_blockSize == m_blockSize);
+
+    // 3) exact same geometry
+    if (sameGeometry && other.m_rows == m_rows && other.m_cols == m_cols) {
+        for (unsigned int i = 0; i < m_ciphertexts.size(); ++i) {
+            container[i] = applyBinaryOp(flag, m_ciphertexts[i], other.m_ciphertexts[i]);
+        }
+        return container;
+    }
+
+    // 5) one value per line
+    if (sameGeometry && other.numLines() == numLines() && other.lineLength() == 1) {
+        for (unsigned int i = 0; i < m_ciphertexts.size(); ++i) {
+            auto spread = replicateWithinBlocks(other.m_ciphertexts[i], m_blockSize);
+            container[i] = applyBinaryOp(flag, m_ciphertexts[i], spread);
+        }
+        return container;
+    }
+
+    // 2) and 4) a single ciphertext that gets reused for every one of ours
+    cipherVector broadcast;
+    bool rowAlongLines = (other.m_layout == pTensorLayout::rowPerCipher && m_layout == pTensorLayout::packedRows
+        && other.m_rows == 1 && other.m_cols == m_cols);
+    bool packedAlongLines = (sameGeometry && other.numLines() == 1 && other.lineLength() == lineLength());
+    if (other.isScalar()) {
+        broadcast = other.replicateScalar();
+    } else if (rowAlongLines || packedAlongLines) {
+        broadcast = replicateAcrossBlocks(other.m_ciphertexts[0], m_blockSize);
+    } else {
+        auto otherShape = other.shape();
+        throw std::runtime_error(
+            "Unsupported broadcast onto a packed pTensor from a (" + std::to_string(std::get<0>(otherShape)) + ", "
+                + std::to_string(std::get<1>(otherShape)) + ") pTensor. The RHS must be a plaintext, a scalar, "
+                + "or packed the same way as the LHS");
+    }
+    for (unsigned int i = 0; i < m_ciphertexts.size(); ++i) {
+        container[i] = applyBinaryOp(flag, m_ciphertexts[i], broadcast);
+    }
+    return container;
+}
+
+pTensor pTensor::sumWithinLines() {
+    cipherTensor container(m_ciphertexts.size());
+    parallelFor(m_ciphertexts.size(), m_numWorkers, [&](unsigned int i) {
+        // The first slot of every block now holds the sum of the block. Mask out the partial sums everywhere else
+        auto summed = evalSum(m_ciphertexts[i], m_blockSize);
+        auto mask = blockMask(m_blockSize, 0, linesInCipher(i), 0, 1, summed->GetLevel());
+        container[i] = evalMult(summed, mask);
+    });
+    return fromLines(m_layout, m_blockSize, numLines(), 1, std::move(container));
+}
+
+pTensor pTensor::sumAcrossLines() {
+    cipherVector accumulator = treeSum(m_ciphertexts);
+
+    // Fold the blocks onto the first one. We only need enough steps to cover the blocks that hold lines
+    unsigned int usedBlocks = std::min(linesPerCipher(), numLines());
+    for (unsigned int shift = 1; shift < usedBlocks; shift <<= 1) {
+        accumulator = (*m_cc)->EvalAdd(accumulator, rotate(accumulator, shift * m_blockSize));
+    }
+    auto mask = blockMask(m_blockSize, 0, 1, 0, lineLength(), accumulator->GetLevel());
+    accumulator = evalMult(accumulator, mask);
+
+    cipherTensor asTensor;
+    asTensor.emplace_back(accumulator);
+    return fromLines(m_layout, m_blockSize, 1, lineLength(), std::move(asTensor));
+}
+
+pTensor pTensor::packedSum() {
+    cipherVector accumulator = treeSum(m_ciphertexts);
+    unsigned int usedBlocks = std::min(linesPerCipher(), numLines());
+    for (unsigned int shift = 1; shift < usedBlocks; shift <<= 1) {
+        accumulator = (*m_cc)->EvalAdd(accumulator, rotate(accumulator, shift * m_blockSize));
+    }
+
+    // The first block now holds the sum of every line. Sum that block and keep only the first slot
+    accumulator = evalSum(accumulator, m_blockSize);
+    if (m_isRepeated) {
+        messageVector scale(1, 1.0 / m_cols);
+        accumulator = evalMult(accumulator, encode(scale, accumulator->GetLevel()));
+    } else {
+        accumulator = evalMult(accumulator, blockMask(1, 0, 1, 0, 1, accumulator->GetLevel()));
+    }
+
+    cipherTensor asTensor;
+    asTensor.emplace_back(accumulator);
+    pTensor newTensor(1, 1, asTensor);
+    return newTensor;
+}
+
+pTensor pTensor::packedDot(const pTensor &other, bool asRowVector) {
+    // numpy: (r, c).dot((c, 1)) == ((r, c) * (1, c)).sum(axis=1)
+    pTensor rhs = other;
+    if (other.m_cols == 1 && other.m_rows == m_cols && m_cols != 1) {
+        rhs = other.T();
+    }
+    auto product = eagerBinaryOp("mult", rhs);
+    auto summed = product.sum(1);
+
+    // The (r, 1) column and the (1, r) row share the same ciphertexts in the packed layouts
+    if (asRowVector) {
+        return summed.T();
+    }
+    return summed;
+}
+
+pTensor pTensor::packedHstack(const pTensor &arg1, const pTensor &arg2) {
+    if (arg1.m_layout != arg2.m_layout || arg1.m_blockSize != arg2.m_blockSize) {
+        throw std::runtime_error("hstack requires both packed pTensors to have the same layout and block size");
+    }
+    unsigned int blockSize = arg1.m_blockSize;
+    unsigned int perCipher = arg1.linesPerCipher();
+
+    if (arg1.m_layout == pTensorLayout::packedCols) {
+        // Stacking rows makes every column (line) longer. Shift the second set of lines to the end of the first one
+        if (arg1.m_rows + arg2.m_rows > blockSize) {
+            throw std::runtime_error("hstack of packedCols pTensors needs the stacked columns to fit in a block. "
+                                     "Re-encrypt with packedRows or rowPerCipher instead");
+        }
+        cipherTensor container(arg1.m_ciphertexts.size());
+        for (unsigned int i = 0; i < container.size(); ++i) {
+            auto shifted = rotate(arg2.m_ciphertexts[i], -static_cast<int>(arg1.m_rows));
+            auto mask = blockMask(blockSize, 0, arg1.linesInCipher(i), arg1.m_rows, arg1.m_rows + arg2.m_rows,
+                                  shifted->GetLevel());
+            container[i] = (*m_cc)->EvalAdd(arg1.m_ciphertexts[i], evalMult(shifted, mask));
+        }
+        return fromLines(pTensorLayout::packedCols, blockSize, arg1.m_cols, arg1.m_rows + arg2.m_rows,
+                         std::move(container));
+    }
+
+    cipherTensor container = arg1.m_ciphertexts;
+    unsigned int used = arg1.numLines() % perCipher;
+    if (used == 0) {
+        // The last ciphertext is full so the lines of arg2 are already where they need to be
+        for (auto &v: arg2.m_ciphertexts) {
+            container.emplace_back(v);
+        }
+    } else {
+        // Every ciphertext of arg2 is split: the first (perCipher - used) lines fill the free blocks of our last
+        // ciphertext and whatever is left over starts a new one.
+        unsigned int free = perCipher - used;
+        for (unsigned int i = 0; i < arg2.m_ciphertexts.size(); ++i) {
+            const auto &cipher = arg2.m_ciphertexts[i];
+            unsigned int lines = arg2.linesInCipher(i);
+
+            auto low = rotate(cipher, -static_cast<int>(used * blockSize));
+            low = evalMult(low, blockMask(blockSize, used, std::min(perCipher, used + lines), 0, blockSize,
+                                          low->GetLevel()));
+            container.back() = (*m_cc)->EvalAdd(container.back(), low);
+
+            if (lines > free) {
+                auto high = rotate(cipher, free * blockSize);
+                high = evalMult(high, blockMask(blockSize, 0, lines - free, 0, blockSize, high->GetLevel()));
+                container.emplace_back(high);
+            }
+        }
+    }
+    return fromLines(pTensorLayout::packedRows, blockSize, arg1.m_rows + arg2.m_rows, arg1.m_cols,
+                     std::move(container));
+}
@@ -0,0 +1,113 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Small threading helpers shared by pTensor and the datasetProvider. Every PALISADE call we make on a row is
+ *  independent of the other rows, so we fan the rows out over a fixed number of std::threads and write each
+ *  result into its own (pre-sized) slot. This keeps the output order identical to the serial version regardless
+ *  of how many workers were used.
+ */
+#ifndef PARALLEL_UTILS_H
+#define PARALLEL_UTILS_H
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Resolve the number of workers to use
+ * @param requested
+ *    0 means "use every hardware thread", anything else is taken as-is
+ * @return
+ *    a worker count >= 1
+ */
+inline unsigned int resolveNumWorkers(unsigned int requested) {
+    if (requested != 0) {
+        return requested;
+    }
+    unsigned int hw = std::thread::hardware_concurrency();
+    return (hw == 0) ? 1 : hw;
+}
+
+/**
+ * Whether the calling thread is already running work for a parallelFor
+ */
+inline bool &insideParallelFor() {
+    thread_local bool inside = false;
+    return inside;
+}
+
+/**
+ * Run fn(i) for every i in [0, n) across numWorkers threads. Indices are handed out dynamically so slow rows
+ *    do not stall a whole chunk, and each index is visited exactly once.
+ *
+ *    Calls made from inside fn run serially on the calling worker: the outer call already keeps every worker busy, so
+ *    fanning out again would only oversubscribe the cores (e.g. a parallel encrypt() of rows that each transpose).
+ *
+ *    The first exception thrown by any worker is rethrown on the calling thread once all workers have joined.
+ * @param n
+ *    Number of work items
+ * @param numWorkers
+ *    Number of threads to use (see resolveNumWorkers)
+ * @param fn
+ *    Work to do for a single index
+ */
+inline void parallelFor(unsigned int n, unsigned int numWorkers, const std::function<void(unsigned int)> &fn) {
+    unsigned int workers = std::min(resolveNumWorkers(numWorkers), n);
+    if (workers <= 1 || insideParallelFor()) {
+        for (unsigned int i = 0; i < n; ++i) {
+            fn(i);
+        }
+        return;
+    }
+
+    std::atomic<unsigned int> next(0);
+    std::exception_ptr firstError = nullptr;
+    std::mutex errorLock;
+
+    auto worker = [&]() {
+        bool wasInside = insideParallelFor();
+        insideParallelFor() = true;
+        while (true) {
+            unsigned int i = next.fetch_add(1);
+            if (i >= n) {
+                insideParallelFor() = wasInside;
+                return;
+            }
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(errorLock);
+                if (!firstError) {
+                    firstError = std::current_exception();
+                }
+                next.store(n);  // Stop handing out work
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(workers - 1);
+    for (unsigned int w = 0; w < workers - 1; ++w) {
+        try {
+            pool.emplace_back(worker);
+        } catch (...) {
+            // Out of threads. The ones already started still have to be joined, so carry on with them: the calling
+            //  thread picks up whatever they do not get to
+            break;
+        }
+    }
+    worker();  // The calling thread does its share too
+    for (auto &t: pool) {
+        t.join();
+    }
+    if (firstError) {
+        std::rethrow_exception(firstError);
+    }
+}
+
+#endif //PARALLEL_UTILS_H
@@ -0,0 +1,96 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ */
+#include "plaintext_cache.h"
+
+size_t plaintextCache::hashOf(const std::vector<std::complex<double>> &values, uint32_t level) {
+    // boost::hash_combine
+    std::hash<double> hasher;
+    size_t seed = std::hash<uint32_t>()(level) ^ values.size();
+    for (auto &v: values) {
+        seed ^= hasher(v.real()) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+        seed ^= hasher(v.imag()) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+    }
+    return seed;
+}
+
+lbcrypto::Plaintext plaintextCache::encode(const lbcrypto::CryptoContext<lbcrypto::DCRTPoly> &cc,
+                                           const std::vector<std::complex<double>> &values,
+                                           uint32_t level) {
+    size_t key = hashOf(values, level);
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (m_context.expired() || m_context.lock() != cc) {
+            m_entries.clear();
+            m_index.clear();
+            m_context = cc;
+        }
+
+        auto range = m_index.equal_range(key);
+        for (auto it = range.first; it != range.second; ++it) {
+            auto &cached = *(it->second);
+            if (cached.level == level && cached.values == values) {
+                m_entries.splice(m_entries.begin(), m_entries, it->second);  // Mark as most recently used
+                m_hits += 1;
+                return cached.plaintext;
+            }
+        }
+    }
+
+    // Encode outside of the lock so that other threads can keep hitting the cache
+    auto plaintext = cc->MakeCKKSPackedPlaintext(values, 1, level);
+
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_misses += 1;
+    if (m_capacity == 0) {
+        return plaintext;
+    }
+    m_entries.push_front(entry{values, level, plaintext});
+    m_index.emplace(key, m_entries.begin());
+    evict();
+    return plaintext;
+}
+
+void plaintextCache::evict() {
+    while (m_entries.size() > m_capacity) {
+        auto last = std::prev(m_entries.end());
+        auto range = m_index.equal_range(hashOf(last->values, last->level));
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == last) {
+                m_index.erase(it);
+                break;
+            }
+        }
+        m_entries.erase(last);
+    }
+}
+
+void plaintextCache::clear() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_entries.clear();
+    m_index.clear();
+    m_hits = 0;
+    m_misses = 0;
+}
+
+void plaintextCache::setCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_capacity = capacity;
+    evict();
+}
+
+size_t plaintextCache::size() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_entries.size();
+}
+
+size_t plaintextCache::hits() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_hits;
+}
+
+size_t plaintextCache::misses() const {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_misses;
+}
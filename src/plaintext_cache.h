@@ -0,0 +1,81 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Cache of encoded CKKS plaintexts keyed on their content and level. Encoding (an FFT followed by an NTT per tower) is
+ *  far more expensive than hashing the values, and the same plaintexts show up over and over: a broadcast row is the
+ *  same for every LHS row, hyperparameters and masks are the same every epoch.
+ *
+ *  The cache is bounded (least recently used entries are evicted first) and thread-safe. Entries are dropped when the
+ *  crypto context changes since plaintexts are only valid for the context they were encoded with.
+ */
+#ifndef PLAINTEXT_CACHE_H
+#define PLAINTEXT_CACHE_H
+
+#include "palisade.h"
+#include <complex>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class plaintextCache {
+ public:
+  /**
+   * @param capacity
+   *    Maximum number of plaintexts to hold on to. Every plaintext holds a ring element per tower so this should be
+   *    kept modest for large ring dimensions.
+   */
+  explicit plaintextCache(size_t capacity = 128) : m_capacity(capacity) {}
+
+  /**
+   * Return the CKKS plaintext for the given values, encoding it only if we have not seen it at this level before
+   * @param cc
+   *    Crypto context to encode with
+   * @param values
+   *    The values to pack
+   * @param level
+   *    Level to encode at. This should be the level of the ciphertext the plaintext will be combined with
+   * @return
+   */
+  lbcrypto::Plaintext encode(const lbcrypto::CryptoContext<lbcrypto::DCRTPoly> &cc,
+                             const std::vector<std::complex<double>> &values,
+                             uint32_t level = 0);
+
+  /**
+   * Drop every cached plaintext
+   */
+  void clear();
+
+  /**
+   * Change the maximum number of plaintexts we hold on to, evicting entries if needed
+   */
+  void setCapacity(size_t capacity);
+
+  size_t size() const;
+  size_t hits() const;
+  size_t misses() const;
+
+ private:
+  struct entry {
+    std::vector<std::complex<double>> values;
+    uint32_t level;
+    lbcrypto::Plaintext plaintext;
+  };
+  using entryList = std::list<entry>;
+
+  static size_t hashOf(const std::vector<std::complex<double>> &values, uint32_t level);
+  void evict();
+
+  size_t m_capacity;
+  size_t m_hits = 0;
+  size_t m_misses = 0;
+  std::weak_ptr<lbcrypto::CryptoContextImpl<lbcrypto::DCRTPoly>> m_context;
+
+  // Most recently used entries are at the front
+  entryList m_entries;
+  std::unordered_multimap<size_t, entryList::iterator> m_index;
+  mutable std::mutex m_lock;
+};
+
+#endif //PLAINTEXT_CACHE_H
@@ -0,0 +1,129 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Output format (https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU):
+ *
+ *      {"displayTimeUnit": "ms", "traceEvents": [
+ *          {"name": ..., "cat": ..., "ph": "X", "ts": <us>, "dur": <us>, "pid": ..., "tid": ..., "args": {...}},
+ *          ...
+ *      ]}
+ *
+ *  i.e. one "complete" event per scope. The viewer nests the events of a thread by their timestamps.
+ */
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+
+std::atomic<bool> tracer::m_enabled(false);
+std::mutex tracer::m_lock;
+std::vector<traceEvent> tracer::m_events;
+std::atomic<int64_t> tracer::m_origin(0);
+std::atomic<uint64_t> tracer::m_generation(0);
+
+namespace {
+
+// Traces the whole run into $PTENSOR_TRACE. Defined after the members above so it is destroyed before them
+struct environmentTrace {
+  environmentTrace() {
+      const char *path = std::getenv("PTENSOR_TRACE");
+      if (path != nullptr && *path != '\0') {
+          m_path = path;
+          tracer::start();
+      }
+  }
+  ~environmentTrace() {
+      if (m_path.empty()) {
+          return;
+      }
+      tracer::stop();
+      try {
+          tracer::save(m_path);
+      } catch (const std::runtime_error &e) {
+          std::cerr << e.what() << std::endl;
+      }
+  }
+  std::string m_path;
+} environmentTraceInstance;
+
+int64_t steadyNanoseconds() {
+    auto sinceEpoch = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(sinceEpoch).count();
+}
+
+// Microseconds with nanosecond precision, which is what the format expects. Times are never negative
+void writeMicroseconds(std::ostream &out, int64_t nanoseconds) {
+    nanoseconds = std::max<int64_t>(nanoseconds, 0);
+    out << nanoseconds / 1000 << '.';
+    auto fraction = std::to_string(nanoseconds % 1000);
+    out << std::string(3 - fraction.size(), '0') << fraction;
+}
+
+}  // namespace
+
+void tracer::start() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_events.clear();
+    m_origin.store(steadyNanoseconds(), std::memory_order_relaxed);
+    m_generation.fetch_add(1, std::memory_order_release);
+    m_enabled.store(true, std::memory_order_relaxed);
+}
+
+void tracer::stop() {
+    m_enabled.store(false, std::memory_order_relaxed);
+}
+
+void tracer::save(const std::string &path) {
+    auto recorded = events();
+    std::ofstream out(path, std::ios::trunc);
+    if (!out.is_open()) {
+        throw std::runtime_error("Could not open " + path + " for writing");
+    }
+    auto pid = static_cast<long>(::getpid());
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for (size_t i = 0; i < recorded.size(); ++i) {
+        const auto &event = recorded[i];
+        out << (i == 0 ? "\n" : ",\n") << "{\"name\": \"" << event.name << "\", \"cat\": \"" << event.category
+            << "\", \"ph\": \"X\", \"ts\": ";
+        writeMicroseconds(out, event.start);
+        out << ", \"dur\": ";
+        writeMicroseconds(out, event.duration);
+        out << ", \"pid\": " << pid << ", \"tid\": " << event.threadId << ", \"args\": {";
+        for (unsigned int a = 0; a < 2 && event.argNames[a] != nullptr; ++a) {
+            out << (a == 0 ? "" : ", ") << '"' << event.argNames[a] << "\": " << event.args[a];
+        }
+        out << "}}";
+    }
+    out << "\n]}\n";
+    if (!out) {
+        throw std::runtime_error("Failed to write " + path);
+    }
+}
+
+std::vector<traceEvent> tracer::events() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    return m_events;
+}
+
+void tracer::record(const traceEvent &event, uint64_t generation) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (generation != m_generation.load(std::memory_order_relaxed)) {
+        return;
+    }
+    m_events.emplace_back(event);
+}
+
+int64_t tracer::now() {
+    return steadyNanoseconds() - m_origin.load(std::memory_order_relaxed);
+}
+
+uint32_t tracer::threadId() {
+    static std::atomic<uint32_t> nextId(1);
+    thread_local uint32_t id = nextId.fetch_add(1);
+    return id;
+}
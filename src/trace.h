@@ -0,0 +1,139 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Opt-in timeline of what pTensor spends its time on. Every pTensor operator and every expensive PALISADE call
+ *  (EvalMult, EvalAtIndex / EvalFastRotation, EvalSum, Encrypt, Decrypt) opens a traceScope; while the tracer is
+ *  running each scope records its name, thread, shape (or ciphertext level) and duration. save() writes them as Chrome
+ *  trace-event JSON which opens in https://ui.perfetto.dev or chrome://tracing, with the PALISADE calls nested under
+ *  the operator that made them.
+ *
+ *  Start it from code with tracer::start() / tracer::stop() / tracer::save(path), or without touching the code by
+ *  setting PTENSOR_TRACE=<path> in the environment: the whole run is then traced and saved to path on exit.
+ *
+ *  While the tracer is stopped a traceScope costs a single relaxed atomic load.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Categories of the events, so that they can be told apart (and filtered on) in the viewer
+constexpr const char *kTracePTensor = "pTensor";
+constexpr const char *kTracePalisade = "palisade";
+
+/**
+ * A finished scope. The strings are never copied so they must be literals
+ */
+struct traceEvent {
+  const char *name;
+  const char *category;
+  // Up to two integer arguments, e.g. rows and cols. Unused ones have a null name
+  const char *argNames[2];
+  int64_t args[2];
+  // Nanoseconds since tracer::start()
+  int64_t start;
+  int64_t duration;
+  uint32_t threadId;
+};
+
+class tracer {
+ public:
+  /**
+   * Drop everything recorded so far and start recording
+   */
+  static void start();
+
+  /**
+   * Stop recording. What was recorded is kept until the next start()
+   */
+  static void stop();
+
+  static bool enabled() { return m_enabled.load(std::memory_order_relaxed); }
+
+  /**
+   * Write the recorded events as Chrome trace-event JSON
+   * @param path
+   */
+  static void save(const std::string &path);
+
+  /**
+   * @return
+   *    a copy of the events recorded since the last start(), in the order they finished
+   */
+  static std::vector<traceEvent> events();
+
+  /**
+   * @return
+   *    which start() we are recording for. Scopes opened before a start() belong to an older recording
+   */
+  static uint64_t generation() { return m_generation.load(std::memory_order_acquire); }
+
+  /**
+   * Called by traceScope when it closes. The event is dropped unless it was opened during the current recording,
+   *    since its start was measured from an older origin
+   */
+  static void record(const traceEvent &event, uint64_t generation);
+
+  /**
+   * @return
+   *    nanoseconds since the last start()
+   */
+  static int64_t now();
+
+  /**
+   * @return
+   *    a small id for the calling thread, assigned the first time it records something
+   */
+  static uint32_t threadId();
+
+ private:
+  static std::atomic<bool> m_enabled;
+  static std::mutex m_lock;
+  static std::vector<traceEvent> m_events;
+  // steady_clock time of the last start(), in nanoseconds
+  static std::atomic<int64_t> m_origin;
+  // Number of start() calls so far
+  static std::atomic<uint64_t> m_generation;
+};
+
+/**
+ * Records the time between its construction and destruction as a traceEvent, if the tracer is running
+ */
+class traceScope {
+ public:
+  traceScope(const char *name,
+             const char *category,
+             const char *arg0Name = nullptr,
+             int64_t arg0 = 0,
+             const char *arg1Name = nullptr,
+             int64_t arg1 = 0) : m_active(tracer::enabled()) {
+      if (m_active) {
+          // Before now(), so that the origin we measure from is at least as new as the generation
+          m_generation = tracer::generation();
+          m_event = {name, category, {arg0Name, arg1Name}, {arg0, arg1}, tracer::now(), 0, 0};
+      }
+  }
+
+  ~traceScope() {
+      if (m_active) {
+          m_event.duration = tracer::now() - m_event.start;
+          m_event.threadId = tracer::threadId();
+          tracer::record(m_event, m_generation);
+      }
+  }
+
+  traceScope(const traceScope &) = delete;
+  traceScope &operator=(const traceScope &) = delete;
+
+ private:
+  bool m_active;
+  uint64_t m_generation = 0;
+  traceEvent m_event;
+};
+
+#endif //TRACE_H
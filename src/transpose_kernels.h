@@ -0,0 +1,190 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Out-of-place transpose of a row-major matrix into preallocated row-major storage. A naive transpose reads one side
+ *  with a stride of a whole row, so every element touches a new cache line (and, for large matrices, a new page). We
+ *  instead walk the matrix in kTransposeTile x kTransposeTile tiles, small enough that the source and destination
+ *  lines of a tile both stay in L1, and transpose every tile with register-sized micro-kernels:
+ *      AVX-512: 8x8 doubles
+ *      AVX: 4x4 doubles, 8x8 floats, 2x2 complex doubles
+ *  picked at compile time (build with -march=native, or the PTENSOR_NATIVE_ARCH CMake option, to get them). Anything
+ *  else, and the ragged edges of the matrix, fall back to scalar code. Large matrices are split into bands of tile
+ *  rows that are transposed in parallel; every band writes its own columns of the output.
+ */
+#ifndef TRANSPOSE_KERNELS_H
+#define TRANSPOSE_KERNELS_H
+
+#include "parallel_utils.h"
+#include <complex>
+#include <cstddef>
+#if defined(__AVX__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// Edge of a tile, in elements. A tile of complex doubles is 16KB
+constexpr size_t kTransposeTile = 32;
+// Below this many elements a transpose is not worth handing to other threads
+constexpr size_t kParallelTransposeSize = size_t(1) << 16;
+
+/**
+ * Transpose a kernelSize x kernelSize block: out[c * outStride + r] = in[r * inStride + c]. The generic version
+ *    moves one element at a time
+ */
+template<class scalar>
+struct transposeKernel {
+  static constexpr size_t kernelSize = 1;
+  static void run(const scalar *in, std::ptrdiff_t, scalar *out, std::ptrdiff_t) { *out = *in; }
+};
+
+#if defined(__AVX512F__)
+template<>
+struct transposeKernel<double> {
+  static constexpr size_t kernelSize = 8;
+  static void run(const double *in, std::ptrdiff_t inStride, double *out, std::ptrdiff_t outStride) {
+      __m512d r[8];
+      for (int i = 0; i < 8; ++i) {
+          r[i] = _mm512_loadu_pd(in + i * inStride);
+      }
+      // Interleave pairs of rows, then move 128-bit lanes (pairs of values) around twice
+      __m512d t[8];
+      for (int i = 0; i < 4; ++i) {
+          t[2 * i] = _mm512_unpacklo_pd(r[2 * i], r[2 * i + 1]);
+          t[2 * i + 1] = _mm512_unpackhi_pd(r[2 * i], r[2 * i + 1]);
+      }
+      __m512d u[8];
+      for (int half = 0; half < 2; ++half) {
+          const __m512d *source = t + 4 * half;
+          u[4 * half] = _mm512_shuffle_f64x2(source[0], source[2], 0x88);
+          u[4 * half + 1] = _mm512_shuffle_f64x2(source[0], source[2], 0xDD);
+          u[4 * half + 2] = _mm512_shuffle_f64x2(source[1], source[3], 0x88);
+          u[4 * half + 3] = _mm512_shuffle_f64x2(source[1], source[3], 0xDD);
+      }
+      // u[0..3] hold columns {0, 4}, {2, 6}, {1, 5}, {3, 7} of rows 0-3 and u[4..7] the same for rows 4-7
+      const int firstColumn[4] = {0, 2, 1, 3};
+      for (int i = 0; i < 4; ++i) {
+          _mm512_storeu_pd(out + firstColumn[i] * outStride, _mm512_shuffle_f64x2(u[i], u[i + 4], 0x88));
+          _mm512_storeu_pd(out + (firstColumn[i] + 4) * outStride, _mm512_shuffle_f64x2(u[i], u[i + 4], 0xDD));
+      }
+  }
+};
+#elif defined(__AVX__)
+template<>
+struct transposeKernel<double> {
+  static constexpr size_t kernelSize = 4;
+  static void run(const double *in, std::ptrdiff_t inStride, double *out, std::ptrdiff_t outStride) {
+      __m256d r0 = _mm256_loadu_pd(in);
+      __m256d r1 = _mm256_loadu_pd(in + inStride);
+      __m256d r2 = _mm256_loadu_pd(in + 2 * inStride);
+      __m256d r3 = _mm256_loadu_pd(in + 3 * inStride);
+      __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+      __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+      __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+      __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+      _mm256_storeu_pd(out, _mm256_permute2f128_pd(t0, t2, 0x20));
+      _mm256_storeu_pd(out + outStride, _mm256_permute2f128_pd(t1, t3, 0x20));
+      _mm256_storeu_pd(out + 2 * outStride, _mm256_permute2f128_pd(t0, t2, 0x31));
+      _mm256_storeu_pd(out + 3 * outStride, _mm256_permute2f128_pd(t1, t3, 0x31));
+  }
+};
+#endif
+
+#if defined(__AVX__)
+template<>
+struct transposeKernel<float> {
+  static constexpr size_t kernelSize = 8;
+  static void run(const float *in, std::ptrdiff_t inStride, float *out, std::ptrdiff_t outStride) {
+      __m256 r[8];
+      for (int i = 0; i < 8; ++i) {
+          r[i] = _mm256_loadu_ps(in + i * inStride);
+      }
+      __m256 t[8];
+      for (int i = 0; i < 4; ++i) {
+          t[2 * i] = _mm256_unpacklo_ps(r[2 * i], r[2 * i + 1]);
+          t[2 * i + 1] = _mm256_unpackhi_ps(r[2 * i], r[2 * i + 1]);
+      }
+      __m256 s[8];
+      for (int half = 0; half < 2; ++half) {
+          const __m256 *source = t + 4 * half;
+          s[4 * half] = _mm256_shuffle_ps(source[0], source[2], _MM_SHUFFLE(1, 0, 1, 0));
+          s[4 * half + 1] = _mm256_shuffle_ps(source[0], source[2], _MM_SHUFFLE(3, 2, 3, 2));
+          s[4 * half + 2] = _mm256_shuffle_ps(source[1], source[3], _MM_SHUFFLE(1, 0, 1, 0));
+          s[4 * half + 3] = _mm256_shuffle_ps(source[1], source[3], _MM_SHUFFLE(3, 2, 3, 2));
+      }
+      for (int i = 0; i < 4; ++i) {
+          _mm256_storeu_ps(out + i * outStride, _mm256_permute2f128_ps(s[i], s[i + 4], 0x20));
+          _mm256_storeu_ps(out + (i + 4) * outStride, _mm256_permute2f128_ps(s[i], s[i + 4], 0x31));
+      }
+  }
+};
+
+template<>
+struct transposeKernel<std::complex<double>> {
+  static constexpr size_t kernelSize = 2;
+  static void run(const std::complex<double> *in,
+                  std::ptrdiff_t inStride,
+                  std::complex<double> *out,
+                  std::ptrdiff_t outStride) {
+      // A complex double is a (real, imag) pair, so a register holds two of them
+      __m256d r0 = _mm256_loadu_pd(reinterpret_cast<const double *>(in));
+      __m256d r1 = _mm256_loadu_pd(reinterpret_cast<const double *>(in + inStride));
+      _mm256_storeu_pd(reinterpret_cast<double *>(out), _mm256_permute2f128_pd(r0, r1, 0x20));
+      _mm256_storeu_pd(reinterpret_cast<double *>(out + outStride), _mm256_permute2f128_pd(r0, r1, 0x31));
+  }
+};
+#endif
+
+/**
+ * Transpose a single (rows, cols) tile with the micro-kernels, and the edges that do not fill one element-wise
+ */
+template<class scalar>
+void transposeTile(const scalar *in, std::ptrdiff_t inStride, scalar *out, std::ptrdiff_t outStride,
+                   size_t rows, size_t cols) {
+    constexpr size_t k = transposeKernel<scalar>::kernelSize;
+    size_t r = 0;
+    for (; r + k <= rows; r += k) {
+        size_t c = 0;
+        for (; c + k <= cols; c += k) {
+            transposeKernel<scalar>::run(in + r * inStride + c, inStride, out + c * outStride + r, outStride);
+        }
+        for (; c < cols; ++c) {
+            for (size_t i = r; i < r + k; ++i) {
+                out[c * outStride + i] = in[i * inStride + c];
+            }
+        }
+    }
+    for (; r < rows; ++r) {
+        for (size_t c = 0; c < cols; ++c) {
+            out[c * outStride + r] = in[r * inStride + c];
+        }
+    }
+}
+
+/**
+ * out[c * outStride + r] = in[r * inStride + c] for the (rows, cols) matrix in
+ * @param in
+ *    Row-major source whose rows are inStride elements apart
+ * @param out
+ *    Preallocated row-major destination of (cols, rows) whose rows are outStride elements apart
+ * @param numWorkers
+ *    Threads to use for large matrices (see resolveNumWorkers)
+ */
+template<class scalar>
+void blockedTranspose(const scalar *in, size_t rows, size_t cols, std::ptrdiff_t inStride,
+                      scalar *out, std::ptrdiff_t outStride, unsigned int numWorkers = 1) {
+    auto numBands = static_cast<unsigned int>((rows + kTransposeTile - 1) / kTransposeTile);
+    auto band = [&](unsigned int b) {
+        size_t r = b * kTransposeTile;
+        size_t bandRows = std::min(kTransposeTile, rows - r);
+        for (size_t c = 0; c < cols; c += kTransposeTile) {
+            transposeTile(in + r * inStride + c, inStride, out + c * outStride + r, outStride,
+                          bandRows, std::min(kTransposeTile, cols - c));
+        }
+    };
+    if (rows * cols < kParallelTransposeSize) {
+        numWorkers = 1;
+    }
+    parallelFor(numBands, numWorkers, band);
+}
+
+#endif //TRANSPOSE_KERNELS_H
@@ -6,6 +6,10 @@
 #define PTENSORUTILS_TESTING_H
 
 #include "../../src/p_tensor.h"
+#include "../../src/crypto_bundle.h"
+
+// Crypto context and keys shared by every fixture. Relative to where the tests are run, i.e. the build directory
+const char *const testCryptoBundlePath = "ptensor_test_crypto_bundle.bin";
 
 bool messageTensorEq(messageTensor arg1, messageTensor arg2);
 bool unorderedMessageTensorEq(messageTensor arg1, messageTensor arg2);
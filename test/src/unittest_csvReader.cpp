@@ -0,0 +1,160 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ */
+
+#include "gtest/gtest.h"
+#include "../../src/csv_reader.h"
+#include "../../src/datasetProvider.h"
+#include "pTensorUtils_testing.h"
+#include <cstdio>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+class csvReaderTest : public ::testing::Test {
+ protected:
+  std::string path = "/tmp/ptensor_unittest.csv";
+
+  void write(const std::string &contents) {
+      std::ofstream(path, std::ios::trunc | std::ios::binary) << contents;
+  }
+
+  void TearDown() {
+      std::remove(path.c_str());
+      std::remove((path + ".ptcols").c_str());
+      pTensor::m_numWorkers = 0;
+  }
+};
+
+TEST_F(csvReaderTest, TestFeatureMajor) {
+    write("a,b,c\n1,2.5,-3\r\n 4 , +5e-1,6\n\n7,8,9");
+
+    auto XT = readFeaturesT(path, false);
+    EXPECT_EQ(XT, realTensor({{1, 4, 7}, {2.5, 0.5, 8}, {-3, 6, 9}}));
+
+    auto withBias = readFeaturesT(path);
+    EXPECT_EQ(withBias.size(), 4u);
+    EXPECT_EQ(withBias[0], realVector({1, 1, 1}));
+
+    // The row-major readers are the transposes
+    EXPECT_EQ(readFeatures(path, false), messageTensor({{1, 2.5, -3}, {4, 0.5, 6}, {7, 8, 9}}));
+}
+
+TEST_F(csvReaderTest, TestLabels) {
+    write("y\n1.5\n-2\n3\n");
+    EXPECT_EQ(readLabelsT(path), realTensor({{1.5, -2, 3}}));
+    EXPECT_EQ(readLabels(path), messageTensor({{1.5}, {-2}, {3}}));
+
+    write("y,z\n1,2\n");
+    EXPECT_THROW(readLabelsT(path), std::runtime_error);
+}
+
+TEST_F(csvReaderTest, TestMalformed) {
+    write("a,b\n1,2\n3\n");
+    EXPECT_THROW(readFeaturesT(path), std::runtime_error);
+    write("a,b\n1,2\n3,4,5\n");
+    EXPECT_THROW(readFeaturesT(path), std::runtime_error);
+    write("a,b\n1,x\n");
+    EXPECT_THROW(readFeaturesT(path), std::runtime_error);
+    EXPECT_THROW(readFeaturesT("/tmp/ptensor_does_not_exist.csv"), std::runtime_error);
+}
+
+TEST_F(csvReaderTest, TestParallelChunksKeepRowOrder) {
+    // Big enough to be split into several chunks
+    std::string contents = "a,b,c\n";
+    unsigned int numRows = 5000;
+    for (unsigned int r = 0; r < numRows; ++r) {
+        contents += std::to_string(r) + "," + std::to_string(r * 0.25) + "," + std::to_string(-1.0 * r) + "\n";
+    }
+    write(contents);
+
+    for (unsigned int numWorkers: {1u, 4u}) {
+        pTensor::m_numWorkers = numWorkers;
+        auto XT = readFeaturesT(path, true, false);
+        ASSERT_EQ(XT.size(), 4u);
+        ASSERT_EQ(XT[1].size(), numRows);
+        for (unsigned int r = 0; r < numRows; ++r) {
+            EXPECT_EQ(XT[0][r], 1);
+            EXPECT_EQ(XT[1][r], r);
+            EXPECT_NEAR(XT[2][r], r * 0.25, 1e-6);
+            EXPECT_EQ(XT[3][r], -1.0 * r);
+        }
+    }
+}
+
+TEST_F(csvReaderTest, TestProviderFromFeatureMajor) {
+    write("a,b\n1,2\n3,4\n5,6\n");
+    auto XT = readFeaturesT(path, false);
+    realTensor yT = {{10, 20, 30}};
+
+    auto fromColumns = datasetProvider::fromFeatureMajor(XT, yT, 2).provide(42, false);
+    datasetProvider fromRows(pTensor(3, 2, readFeatures(path, false)), pTensor(3, 1, pTensor::plainT(yT)), 2);
+    auto expected = fromRows.provide(42, false);
+    for (unsigned int i = 0; i < 2; ++i) {
+        EXPECT_EQ(std::get<0>(fromColumns[i]).getMessage(), std::get<0>(expected[i]).getMessage());
+        EXPECT_EQ(std::get<1>(fromColumns[i]).getMessage(), std::get<1>(expected[i]).getMessage());
+    }
+}
+
+TEST_F(csvReaderTest, TestColumnarCache) {
+    write("a,b\n1,2.5\n3,-4\n");
+    std::string cachePath = path + ".ptcols";
+    std::remove(cachePath.c_str());
+
+    auto parsed = readFeaturesT(path);
+    EXPECT_TRUE(std::ifstream(cachePath).good());  // Written by the first load
+
+    // Later loads come from the cache. Prove it by corrupting the (otherwise still valid looking) source's text but
+    //  keeping its size and modification time
+    struct stat before{};
+    ::stat(path.c_str(), &before);
+    write("a,b\n9,9.9\n9,-9\n");
+    struct timespec times[2] = {before.st_atim, before.st_mtim};
+    ::utimensat(AT_FDCWD, path.c_str(), times, 0);
+    EXPECT_EQ(readFeaturesT(path), parsed);
+    EXPECT_EQ(readFeaturesT(path, false), realTensor({{1, 3}, {2.5, -4}}));
+
+    // A different source (size or time) invalidates it, and the cache is rewritten
+    write("a,b\n1,2\n3,4\n5,6\n");
+    EXPECT_EQ(readFeaturesT(path, false), realTensor({{1, 3, 5}, {2, 4, 6}}));
+    EXPECT_EQ(readFeaturesT(path, false), realTensor({{1, 3, 5}, {2, 4, 6}}));
+    EXPECT_EQ(readFeaturesT(path, false, false), realTensor({{1, 3, 5}, {2, 4, 6}}));
+
+    // A corrupt cache is ignored
+    std::ofstream(cachePath, std::ios::trunc) << "garbage";
+    EXPECT_EQ(readFeaturesT(path, false), realTensor({{1, 3, 5}, {2, 4, 6}}));
+}
+
+TEST_F(csvReaderTest, TestColumnsViewTheCache) {
+    write("a,b\n1,2.5\n3,-4\n5,6\n");
+    std::remove((path + ".ptcols").c_str());
+
+    // Parsed (and cached) the first time, read in place from the cache after that
+    auto parsed = readColumnsT(path);
+    EXPECT_FALSE(parsed.values.isExternal());
+    auto cached = readColumnsT(path);
+    EXPECT_TRUE(cached.values.isExternal());
+    for (auto *columns: {&parsed, &cached}) {
+        EXPECT_EQ(columns->names, std::vector<std::string>({"a", "b"}));
+        EXPECT_EQ(columns->values.precision(), messagePrecision::realDouble);
+        EXPECT_EQ(columns->values.to<realScalar>(), realTensor({{1, 3, 5}, {2.5, -4, 6}}));
+    }
+    EXPECT_FALSE(readColumnsT(path, false).values.isExternal());
+
+    // Views and copies share the mapping, which outlives the store it came from. Writing copies it out first
+    auto secondColumn = cached.values.rowRange(1, 2);
+    auto firstRow = cached.values.transposed().rowRange(0, 1);
+    cached = csvColumns();
+    EXPECT_TRUE(secondColumn.isExternal());
+    EXPECT_EQ(secondColumn.to<realScalar>(), realTensor({{2.5, -4, 6}}));
+    EXPECT_EQ(firstRow.contiguous().to<realScalar>(), realTensor({{1, 2.5}}));
+    secondColumn.mutableData<realScalar>()[0] = 7;
+    EXPECT_FALSE(secondColumn.isExternal());
+    EXPECT_EQ(secondColumn.to<realScalar>(), realTensor({{7, -4, 6}}));
+    EXPECT_EQ(readColumnsT(path).values.to<realScalar>(), realTensor({{1, 3, 5}, {2.5, -4, 6}}));
+
+    // ... and can be trained on without a copy into nested vectors
+    auto provider = datasetProvider::fromFeatureMajor(readColumnsT(path).values, realTensor{{10, 20, 30}}, 1);
+    EXPECT_EQ(std::get<0>(provider.provide(42, false)[0]).shape(), std::make_tuple(2u, 3u));
+}
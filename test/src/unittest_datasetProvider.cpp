@@ -32,29 +32,12 @@ class pTensor_datasetProvider : public ::testing::Test {
       uint8_t scalingFactorBits = 40;
       int batchSize = 4096;
 
-      cc =
-          lbcrypto::CryptoContextFactory<lbcrypto::DCRTPoly>::genCryptoContextCKKS(
-              multDepth, scalingFactorBits, batchSize
-          );
-
-      cc->Enable(ENCRYPTION);
-      cc->Enable(SHE);
-      cc->Enable(LEVELEDSHE);
-      auto keys = cc->KeyGen();
-      cc->EvalMultKeyGen(keys.secretKey);
-      cc->EvalSumKeyGen(keys.secretKey);
-
-      int ringDim = cc->GetRingDimension();
-      int rot = int(-ringDim / 4) + 1;
-      cc->EvalAtIndexKeyGen(keys.secretKey, {-1, 1, rot});
-
-      public_key = keys.publicKey;
-      private_key = keys.secretKey;
+      // Keys are generated on the first run and memory-mapped from the bundle after that
+      cc = cryptoBundle::loadOrGenerate(testCryptoBundlePath, multDepth, scalingFactorBits, batchSize);
+      public_key = pTensor::m_public_key;
+      private_key = pTensor::m_private_key;
 
       pTensor::m_cc = &cc;
-      pTensor::m_private_key = private_key;
-      pTensor::m_public_key = public_key;
-
   }
 
   void TearDown() {
@@ -112,4 +95,84 @@ TEST_F(pTensor_datasetProvider, testProvide) {
             }
         }
     }
-};
\ No newline at end of file
+};
+TEST_F(pTensor_datasetProvider, testStream) {
+    unsigned int numFolds = 4;
+    datasetProvider dp(X, y, numFolds);
+    auto expected = dp.provide(42, false);
+
+    // Same folds in the same order as provide(), whether they are built by one producer or several
+    for (unsigned int numProducers: {1u, 3u}) {
+        auto folds = dp.stream(42, true, pTensorLayout::rowPerCipher, 2, numProducers);
+        trainingPair fold;
+        for (unsigned int i = 0; i < numFolds; ++i) {
+            ASSERT_TRUE(folds->next(fold));
+            EXPECT_TRUE(std::get<0>(fold).cipherNotEmpty());
+            EXPECT_TRUE(messageTensorEq(std::get<0>(fold).decrypt().getMessage(),
+                                        std::get<0>(expected[i]).getMessage()));
+            EXPECT_TRUE(messageTensorEq(std::get<1>(fold).decrypt().getMessage(),
+                                        std::get<1>(expected[i]).getMessage()));
+        }
+        EXPECT_FALSE(folds->next(fold));
+    }
+
+    // Dropping a stream before it is drained stops the producers
+    auto abandoned = dp.stream(42, false, pTensorLayout::rowPerCipher, 1);
+    trainingPair first;
+    EXPECT_TRUE(abandoned->next(first));
+    EXPECT_EQ(std::get<0>(first).getMessage(), std::get<0>(expected[0]).getMessage());
+    abandoned.reset();
+}
+
+TEST_F(pTensor_datasetProvider, testFoldsAreGatheredPermutations) {
+    datasetProvider dp(X, y, 3);
+    auto first = dp.provide(7, false);
+    auto second = dp.provide(7, false);
+
+    ASSERT_EQ(first.size(), 3u);
+    for (unsigned int i = 0; i < first.size(); ++i) {
+        auto XT = std::get<0>(first[i]).getMessage();
+        auto yT = std::get<1>(first[i]).getMessage();
+        EXPECT_EQ(XT, std::get<0>(second[i]).getMessage());
+
+        // Column j of the fold is the observation with label yT[0][j], i.e. row (label - 1) of X
+        for (unsigned int j = 0; j < 3; ++j) {
+            auto row = static_cast<unsigned int>(yT[0][j].real()) - 1;
+            for (unsigned int f = 0; f < 3; ++f) {
+                EXPECT_EQ(XT[f][j], msgX[row][f]);
+            }
+        }
+    }
+}
+
+TEST_F(pTensor_datasetProvider, testMiniBatches) {
+    unsigned int numFolds = 3;
+    datasetProvider dp(X, y, numFolds);
+    auto folds = dp.provide(42, false);
+
+    // 3 observations in batches of 2: one batch per fold, the first 2 observations of the fold's shuffle
+    auto batches = dp.miniBatches(42, 2);
+    EXPECT_EQ(batches->size(), numFolds);
+    EXPECT_EQ(batches->batchSize(), 2u);
+    trainingPair batch;
+    for (unsigned int i = 0; i < numFolds; ++i) {
+        ASSERT_TRUE(batches->next(batch));
+        EXPECT_EQ(std::get<0>(batch).shape(), std::make_tuple(3u, 2u));
+        EXPECT_EQ(std::get<1>(batch).shape(), std::make_tuple(1u, 2u));
+
+        auto expectedX = std::get<0>(folds[i]).getMessage();
+        auto expectedY = std::get<1>(folds[i]).getMessage();
+        for (auto &row: expectedX) {
+            row.resize(2);
+        }
+        expectedY[0].resize(2);
+        EXPECT_TRUE(messageTensorEq(std::get<0>(batch).decrypt().getMessage(), expectedX));
+        EXPECT_TRUE(messageTensorEq(std::get<1>(batch).decrypt().getMessage(), expectedY));
+    }
+    EXPECT_FALSE(batches->next(batch));
+
+    // By default a batch fills a ciphertext, which is more than we have here
+    auto full = dp.miniBatches(42, 0, false);
+    EXPECT_EQ(full->batchSize(), 3u);
+    EXPECT_EQ(full->size(), numFolds);
+}
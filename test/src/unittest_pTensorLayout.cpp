@@ -0,0 +1,171 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Tests for the packed layouts. Every test checks the packed result against the plaintext we expect, which is the
+ * same thing the rowPerCipher layout returns.
+ */
+
+#include "gtest/gtest.h"
+#include "../../src/p_tensor.h"
+#include "pTensorUtils_testing.h"
+#include "palisade.h"
+
+class pTensor_LayoutTest : public ::testing::Test {
+
+ protected:
+  lbcrypto::CryptoContext<lbcrypto::DCRTPoly> cc;
+
+  shared_ptr<lbcrypto::LPPublicKeyImpl<lbcrypto::DCRTPoly>> public_key;
+  shared_ptr<lbcrypto::LPPrivateKeyImpl<lbcrypto::DCRTPoly>> private_key;
+
+  /////////////////////////////////////////////////////////////////
+  //Initialize from complex values
+  /////////////////////////////////////////////////////////////////
+  messageTensor cTensor = {{1, 2, 3}, {4, 5, 6}};
+  messageTensor cVector = {{1, 2, 3}};
+  messageTensor cScalar = messageTensor(1, messageVector(1, 2));
+
+  pTensor t1 = pTensor(2, 3, cTensor);
+  pTensor t2 = pTensor(1, 3, cVector);
+  pTensor t3 = pTensor(1, 1, cScalar);
+
+  void SetUp() {
+      uint8_t multDepth = 4;
+      uint8_t scalingFactorBits = 40;
+      int batchSize = 4096;
+
+      // Keys are generated on the first run and memory-mapped from the bundle after that
+      cc = cryptoBundle::loadOrGenerate(testCryptoBundlePath, multDepth, scalingFactorBits, batchSize);
+      public_key = pTensor::m_public_key;
+      private_key = pTensor::m_private_key;
+
+      pTensor::m_cc = &cc;
+  }
+
+  void TearDown() {
+      lbcrypto::CryptoContextFactory<lbcrypto::DCRTPoly>::ReleaseAllContexts();
+
+      cc->ClearEvalMultKeys();
+      cc->ClearEvalAutomorphismKeys();
+      cc = nullptr;
+      public_key = nullptr;
+      private_key = nullptr;
+  }
+};
+
+TEST_F(pTensor_LayoutTest, TestPackedEncryptionDecryption) {
+    auto bigTensor = pTensor::randomUniform(37, 10);
+    for (auto layout: {pTensorLayout::packedRows, pTensorLayout::packedCols}) {
+        auto packed = bigTensor.encrypt(layout);
+        EXPECT_EQ(packed.layout(), layout);
+        // Everything fits into a single ciphertext instead of 37 of them
+        EXPECT_EQ(packed.numCiphertexts(), 1);
+        EXPECT_TRUE(messageTensorEq(packed.decrypt().getMessage(), bigTensor.getMessage()));
+    }
+}
+
+TEST_F(pTensor_LayoutTest, TestPackedArithmetic) {
+    messageTensor expectedAdd = {{2, 4, 6}, {8, 10, 12}};
+    messageTensor expectedBroadcast = {{1, 4, 9}, {4, 10, 18}};
+    messageTensor expectedScalar = {{2, 4, 6}, {8, 10, 12}};
+
+    for (auto layout: {pTensorLayout::packedRows, pTensorLayout::packedCols}) {
+        auto packed = t1.encrypt(layout);
+
+        auto added = packed + packed;
+        EXPECT_TRUE(messageTensorEq(added.decrypt().getMessage(), expectedAdd));
+
+        auto broadcastPT = packed * cVector;
+        EXPECT_TRUE(messageTensorEq(broadcastPT.decrypt().getMessage(), expectedBroadcast));
+
+        auto scalar = t3.encrypt();
+        auto scaled = packed * scalar;
+        EXPECT_TRUE(messageTensorEq(scaled.decrypt().getMessage(), expectedScalar));
+    }
+
+    // A rowPerCipher row vector gets replicated into every block of a packedRows pTensor
+    auto packed = t1.encrypt(pTensorLayout::packedRows);
+    auto vector = t2.encrypt();
+    auto broadcastEnc = packed * vector;
+    EXPECT_TRUE(messageTensorEq(broadcastEnc.decrypt().getMessage(), expectedBroadcast));
+}
+
+TEST_F(pTensor_LayoutTest, TestPackedSum) {
+    for (auto layout: {pTensorLayout::packedRows, pTensorLayout::packedCols}) {
+        auto packed = t1.encrypt(layout);
+
+        auto allReduce = packed.sum().decrypt();
+        EXPECT_NEAR(allReduce.getMessage()[0][0].real(), 21.0, 0.001);
+
+        messageTensor expected0 = {{5, 7, 9}};
+        auto axis0 = packed.sum(0);
+        EXPECT_EQ(std::get<0>(axis0.shape()), 1);
+        EXPECT_TRUE(messageTensorEq(axis0.decrypt().getMessage(), expected0));
+
+        messageTensor expected1 = {{6}, {15}};
+        auto axis1 = packed.sum(1);
+        EXPECT_EQ(std::get<1>(axis1.shape()), 1);
+        EXPECT_TRUE(messageTensorEq(axis1.decrypt().getMessage(), expected1));
+    }
+}
+
+TEST_F(pTensor_LayoutTest, TestPackedTranspose) {
+    messageTensor expected = {{1, 4}, {2, 5}, {3, 6}};
+    auto packed = t1.encrypt(pTensorLayout::packedRows);
+    auto transposed = packed.T();
+
+    EXPECT_EQ(transposed.layout(), pTensorLayout::packedCols);
+    EXPECT_TRUE(messageTensorEq(transposed.decrypt().getMessage(), expected));
+    EXPECT_TRUE(messageTensorEq(transposed.T().decrypt().getMessage(), cTensor));
+}
+
+TEST_F(pTensor_LayoutTest, TestPackedDot) {
+    messageTensor expectedRowForm = {{14, 32}};
+    messageTensor expectedColForm = {{14}, {32}};
+
+    auto packed = t1.encrypt(pTensorLayout::packedRows);
+    auto vector = t2.encrypt();
+
+    EXPECT_TRUE(messageTensorEq(packed.dot(vector, false).decrypt().getMessage(), expectedColForm));
+    EXPECT_TRUE(messageTensorEq(packed.dot(vector, true).decrypt().getMessage(), expectedRowForm));
+
+    // Column major: the vector must hold one value per column (line)
+    messageScalar zero = 0.0;
+    auto packedCols = t1.encrypt(pTensorLayout::packedCols);
+    auto perColumn = packedCols.sum(0) * zero;  // (1, 3) packed the same way as packedCols
+    auto weights = perColumn + cVector;
+    EXPECT_TRUE(messageTensorEq(packedCols.dot(weights, false).decrypt().getMessage(), expectedColForm));
+    EXPECT_TRUE(messageTensorEq(packedCols.dot(weights, true).decrypt().getMessage(), expectedRowForm));
+}
+
+TEST_F(pTensor_LayoutTest, TestPackedVStack) {
+    // Lines of 600 values get a 1024 slot block so only 2 lines fit into a ciphertext and stacking 3 + 3 lines
+    // has to shift the lines of the second pTensor
+    auto top = pTensor::randomUniform(3, 600);
+    auto bottom = pTensor::randomUniform(3, 600, 2.0, 3.0);
+
+    auto stacked = pTensor::hstack(top.encrypt(pTensorLayout::packedRows), bottom.encrypt(pTensorLayout::packedRows));
+    EXPECT_EQ(stacked.numCiphertexts(), 3);
+
+    auto expected = top.getMessage();
+    for (auto &row: bottom.getMessage()) {
+        expected.emplace_back(row);
+    }
+    EXPECT_TRUE(messageTensorEq(stacked.decrypt().getMessage(), expected));
+}
+
+TEST_F(pTensor_LayoutTest, TestPackedApplyGradient) {
+    messageTensor _weights = {{1}, {2}, {3}};
+    auto weights = pTensor::generateWeights(3, 4, _weights);
+    messageTensor gradient = {{0.5, 1, 1.5}};
+    messageScalar zero = 0.0;
+
+    // (1, 3) with a block of 4 slots per feature, the same as the (3, 4) weights. This is what dot() hands back
+    auto gradients = pTensor::randomUniform(4, 3).encrypt(pTensorLayout::packedCols).sum(0) * zero;
+    gradients = gradients + gradient;
+
+    auto updated = pTensor::applyGradient(weights.encrypt(pTensorLayout::packedRows), gradients);
+    messageTensor expected = {{0.5, 0.5, 0.5, 0.5}, {1, 1, 1, 1}, {1.5, 1.5, 1.5, 1.5}};
+    EXPECT_TRUE(messageTensorEq(updated.decrypt().getMessage(), expected));
+}
@@ -0,0 +1,119 @@
+/**
+ * Author: Ian Quah
+ * Date: 10/16/26
+ *
+ * Tests for lazy evaluation. Every lazy result is checked against the plaintext we expect, which is what the eager
+ * operators return.
+ */
+
+#include "gtest/gtest.h"
+#include "../../src/p_tensor.h"
+#include "pTensorUtils_testing.h"
+#include "palisade.h"
+
+class pTensor_LazyTest : public ::testing::Test {
+
+ protected:
+  lbcrypto::CryptoContext<lbcrypto::DCRTPoly> cc;
+
+  shared_ptr<lbcrypto::LPPublicKeyImpl<lbcrypto::DCRTPoly>> public_key;
+  shared_ptr<lbcrypto::LPPrivateKeyImpl<lbcrypto::DCRTPoly>> private_key;
+
+  /////////////////////////////////////////////////////////////////
+  //Initialize from complex values
+  /////////////////////////////////////////////////////////////////
+  messageTensor cTensor = {{1, 2, 3}, {4, 5, 6}};
+  messageTensor cVector = {{1, 2, 3}};
+  messageTensor cScalar = messageTensor(1, messageVector(1, 2));
+
+  pTensor t1 = pTensor(2, 3, cTensor);
+  pTensor t2 = pTensor(1, 3, cVector);
+  pTensor t3 = pTensor(1, 1, cScalar);
+
+  void SetUp() {
+      uint8_t multDepth = 4;
+      uint8_t scalingFactorBits = 40;
+      int batchSize = 4096;
+
+      // Keys are generated on the first run and memory-mapped from the bundle after that
+      cc = cryptoBundle::loadOrGenerate(testCryptoBundlePath, multDepth, scalingFactorBits, batchSize);
+      public_key = pTensor::m_public_key;
+      private_key = pTensor::m_private_key;
+
+      pTensor::m_cc = &cc;
+
+      pTensor::m_lazy = true;
+  }
+
+  void TearDown() {
+      pTensor::m_lazy = false;
+      lbcrypto::CryptoContextFactory<lbcrypto::DCRTPoly>::ReleaseAllContexts();
+
+      cc->ClearEvalMultKeys();
+      cc->ClearEvalAutomorphismKeys();
+      cc = nullptr;
+      public_key = nullptr;
+      private_key = nullptr;
+  }
+};
+
+TEST_F(pTensor_LazyTest, TestLazyPendingUntilEvaluated) {
+    auto encrypted = t1.encrypt();
+    auto added = encrypted + cVector;
+    EXPECT_TRUE(added.isPending());
+    EXPECT_EQ(added.shape(), std::make_tuple(2u, 3u));
+
+    // Copies share the graph so both see the evaluated result
+    auto copy = added;
+    added.eval();
+    EXPECT_FALSE(added.isPending());
+
+    messageTensor expected = {{2, 4, 6}, {5, 7, 9}};
+    EXPECT_TRUE(messageTensorEq(added.decrypt().getMessage(), expected));
+    EXPECT_TRUE(messageTensorEq(copy.decrypt().getMessage(), expected));
+}
+
+TEST_F(pTensor_LazyTest, TestLazyConstantFolding) {
+    auto encrypted = t1.encrypt();
+    messageScalar two = 2.0;
+    messageScalar half = 0.5;
+    messageScalar one = 1.0;
+
+    // (x * 2 * [1, 2, 3] * 0.5) - 1 + x
+    auto result = encrypted * two * cVector * half - one + encrypted;
+    messageTensor expected = {{1, 5, 11}, {7, 14, 23}};
+    EXPECT_TRUE(messageTensorEq(result.decrypt().getMessage(), expected));
+}
+
+TEST_F(pTensor_LazyTest, TestLazyCommonSubexpressions) {
+    auto x = t1.encrypt();
+    auto a = t3.encrypt();
+
+    // Both products are built separately but are the same value, so it is only computed once
+    auto first = x * a;
+    auto second = x * a;
+    auto result = first + second - x;
+    messageTensor expected = {{3, 6, 9}, {12, 15, 18}};
+    EXPECT_TRUE(messageTensorEq(result.decrypt().getMessage(), expected));
+}
+
+TEST_F(pTensor_LazyTest, TestLazyReassociationSavesDepth) {
+    // Seven scalar multiplications in a row need a depth of 7 eagerly, but only 3 once balanced
+    auto x = t1.encrypt();
+    auto two = pTensor::encryptScalar(2.0, true);
+    auto half = pTensor::encryptScalar(0.5, true);
+
+    auto result = x * two * half * two * half * two * half * two;
+    messageTensor expected = {{2, 4, 6}, {8, 10, 12}};
+    EXPECT_TRUE(messageTensorEq(result.decrypt().getMessage(), expected));
+}
+
+TEST_F(pTensor_LazyTest, TestLazyForcedByNonElementwise) {
+    auto vector = t2.encrypt();
+    auto doubled = vector + vector;
+    EXPECT_TRUE(doubled.isPending());
+
+    auto stacked = pTensor::hstack(doubled, vector);
+    messageTensor expected = {{2, 4, 6}, {1, 2, 3}};
+    EXPECT_TRUE(messageTensorEq(stacked.decrypt().getMessage(), expected));
+}
@@ -8,6 +8,11 @@
 #include "../../src/p_tensor.h"
 #include "pTensorUtils_testing.h"
 #include "palisade.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sys/stat.h>
+#include <unistd.h>
 
 class pTensor_TensorMisc : public ::testing::Test {
 
@@ -33,29 +38,12 @@ class pTensor_TensorMisc : public ::testing::Test {
       uint8_t scalingFactorBits = 40;
       int batchSize = 4096;
 
-      cc =
-          lbcrypto::CryptoContextFactory<lbcrypto::DCRTPoly>::genCryptoContextCKKS(
-              multDepth, scalingFactorBits, batchSize
-          );
-
-      cc->Enable(ENCRYPTION);
-      cc->Enable(SHE);
-      cc->Enable(LEVELEDSHE);
-      auto keys = cc->KeyGen();
-      cc->EvalMultKeyGen(keys.secretKey);
-      cc->EvalSumKeyGen(keys.secretKey);
-
-      int ringDim = cc->GetRingDimension();
-      int rot = int(-ringDim / 4) + 1;
-      cc->EvalAtIndexKeyGen(keys.secretKey, {-1, 1, rot});
-
-      public_key = keys.publicKey;
-      private_key = keys.secretKey;
+      // Keys are generated on the first run and memory-mapped from the bundle after that
+      cc = cryptoBundle::loadOrGenerate(testCryptoBundlePath, multDepth, scalingFactorBits, batchSize);
+      public_key = pTensor::m_public_key;
+      private_key = pTensor::m_private_key;
 
       pTensor::m_cc = &cc;
-      pTensor::m_private_key = private_key;
-      pTensor::m_public_key = public_key;
-
   }
 
   void TearDown() {
@@ -176,6 +164,61 @@ TEST_F(pTensor_TensorMisc, TestDotVectorVector) {
             expectedRowForm)
     );
 }
+TEST_F(pTensor_TensorMisc, TestDotTallMatrix) {
+    auto tall = pTensor::randomUniform(9, 3);
+    messageTensor expectedColForm;
+    messageVector expectedRow;
+    for (auto &row: tall.getMessage()) {
+        std::complex<double> acc = 0;
+        for (unsigned int j = 0; j < row.size(); j++) {
+            acc += row[j] * cVector[0][j];
+        }
+        expectedColForm.emplace_back(messageVector(1, acc));
+        expectedRow.emplace_back(acc);
+    }
+    messageTensor expectedRowForm = {expectedRow};
+
+    auto toDot = tall.encrypt();
+    auto other = t2.encrypt();
+    EXPECT_TRUE(messageTensorEq(toDot.dot(other, false).decrypt().getMessage(), expectedColForm));
+    EXPECT_TRUE(messageTensorEq(toDot.dot(other, true).decrypt().getMessage(), expectedRowForm));
+}
+TEST_F(pTensor_TensorMisc, TestDotRowVectorWindow) {
+    // The single rotation form needs rows + cols <= getBatchSize(). It masks 2 * rows times, the fallback rows times
+    unsigned int rows = 8;
+    auto batchSize = static_cast<unsigned int>(pTensor::getBatchSize());
+    for (unsigned int cols: {batchSize - rows, batchSize - rows + 1}) {
+        auto X = pTensor::randomUniform(rows, cols);
+        auto w = pTensor::randomUniform(1, cols);
+        messageVector expectedRow;
+        for (auto &row: X.getMessage()) {
+            std::complex<double> acc = 0;
+            for (unsigned int j = 0; j < cols; j++) {
+                acc += row[j] * w.getMessage()[0][j];
+            }
+            expectedRow.emplace_back(acc);
+        }
+
+        auto encryptedX = X.encrypt();
+        auto encryptedW = w.encrypt();
+        pTensor::m_plaintextCache.clear();
+        tracer::start();
+        auto dotted = encryptedX.dot(encryptedW, true);
+        tracer::stop();
+        // Only the column mask goes through the cache, the slot masks are kept apart from it
+        EXPECT_EQ(pTensor::m_plaintextCache.size(), 1u) << "cols " << cols;
+        auto events = tracer::events();
+        auto numMults = std::count_if(events.begin(), events.end(), [](const traceEvent &e) {
+            return std::string(e.name) == "EvalMult";
+        });
+        bool fastPath = (rows + cols <= static_cast<unsigned int>(pTensor::getBatchSize()));
+        EXPECT_EQ(numMults, fastPath ? 2 * rows : rows) << "cols " << cols;
+        EXPECT_TRUE(messageTensorEq(dotted.decrypt().getMessage(), messageTensor{expectedRow})) << "cols " << cols;
+        // ... and re-used by the next dot of the same shape
+        EXPECT_TRUE(messageTensorEq(encryptedX.dot(encryptedW, true).decrypt().getMessage(),
+                                    messageTensor{expectedRow})) << "cols " << cols;
+    }
+}
 TEST_F(pTensor_TensorMisc, TestTransposeEnc) {
 
     messageTensor expectedTensorTranspose = {
@@ -192,24 +235,34 @@ TEST_F(pTensor_TensorMisc, TestTransposeEnc) {
     auto tensor = t1.encrypt();
     auto vector = t2.encrypt();
 
-    EXPECT_ANY_THROW(tensor.T());
-    EXPECT_ANY_THROW(vector.T());
-
-//    auto decTensorTransposed = transposedTensor.decrypt();
-//    auto decVectorTransposed = transposedVector.decrypt();
-//
-//    EXPECT_TRUE(
-//        messageTensorEq(
-//            decTensorTransposed.getMessage(),
-//            expectedTensorTranspose)
-//    );
-//
-//    EXPECT_TRUE(
-//        messageTensorEq(
-//            decVectorTransposed.getMessage(),
-//            expectedVectorTranspose)
-//    );
+    auto transposedTensor = tensor.T();
+    auto transposedVector = vector.T();
+    EXPECT_EQ(transposedTensor.shape(), std::make_tuple(3u, 2u));
+    EXPECT_EQ(transposedVector.shape(), std::make_tuple(3u, 1u));
+
+    auto decTensorTransposed = transposedTensor.decrypt();
+    auto decVectorTransposed = transposedVector.decrypt();
+
+    EXPECT_TRUE(
+        messageTensorEq(
+            decTensorTransposed.getMessage(),
+            expectedTensorTranspose)
+    );
+
+    EXPECT_TRUE(
+        messageTensorEq(
+            decVectorTransposed.getMessage(),
+            expectedVectorTranspose)
+    );
 
+    // And back again
+    auto roundTrip = transposedTensor.T().decrypt();
+    EXPECT_TRUE(messageTensorEq(roundTrip.getMessage(), t1.getMessage()));
+
+    // Something less square
+    auto tall = pTensor::randomUniform(7, 3);
+    auto decTall = tall.encrypt().T().decrypt();
+    EXPECT_TRUE(messageTensorEq(decTall.getMessage(), tall.plainT()));
 }
 TEST_F(pTensor_TensorMisc, DISABLED_TestSum) {
     /////////////////////////////////////////////////////////////////
@@ -232,7 +285,8 @@ TEST_F(pTensor_TensorMisc, DISABLED_TestSum) {
     cc->EvalMultKeyGen(keys.secretKey);
     cc->EvalSumKeyGen(keys.secretKey);
 
-    cc->EvalAtIndexKeyGen(keys.secretKey, {-1, 1});
+    pTensor::m_cc = &cc;
+    cc->EvalAtIndexKeyGen(keys.secretKey, pTensor::rotationIndices());
 
     public_key = keys.publicKey;
     private_key = keys.secretKey;
@@ -325,3 +379,512 @@ TEST_F(pTensor_TensorMisc, TestVStack) {
         expectedVV
     ));
 }
+TEST_F(pTensor_TensorMisc, TestParallelEncryptionDecryptionOrder) {
+    // Enough rows that every worker gets more than one, so any re-ordering would show up
+    auto original = pTensor::randomUniform(37, 5);
+    for (unsigned int numWorkers: {1, 4}) {
+        pTensor::m_numWorkers = numWorkers;
+        auto decrypted = original.encrypt().decrypt();
+        EXPECT_TRUE(messageTensorEq(original.getMessage(), decrypted.getMessage()));
+        EXPECT_GT(pTensor::getLastThroughput(), 0.0);
+    }
+    pTensor::m_numWorkers = 0;
+}
+TEST_F(pTensor_TensorMisc, TestNestedParallelForRunsInline) {
+    unsigned int outer = 4, inner = 8;
+    std::vector<std::thread::id> outerThreads(outer);
+    std::vector<std::vector<std::thread::id>> innerThreads(outer, std::vector<std::thread::id>(inner));
+    parallelFor(outer, 4, [&](unsigned int i) {
+        outerThreads[i] = std::this_thread::get_id();
+        parallelFor(inner, 4, [&](unsigned int j) {
+            innerThreads[i][j] = std::this_thread::get_id();
+        });
+    });
+    // Every index ran once, and the nested ones on the worker that made the call rather than on threads of their own
+    for (unsigned int i = 0; i < outer; i++) {
+        for (unsigned int j = 0; j < inner; j++) {
+            EXPECT_EQ(innerThreads[i][j], outerThreads[i]);
+        }
+    }
+    EXPECT_FALSE(insideParallelFor());
+
+    // ... including when the nested work throws
+    EXPECT_THROW(parallelFor(outer, 4, [&](unsigned int) {
+        parallelFor(inner, 4, [](unsigned int j) {
+            if (j == 3) {
+                throw std::runtime_error("failed");
+            }
+        });
+    }), std::runtime_error);
+    EXPECT_FALSE(insideParallelFor());
+}
+TEST_F(pTensor_TensorMisc, TestSumDeterministicAcrossWorkers) {
+    auto original = pTensor::randomUniform(37, 5);
+    messageVector colSums(5, 0.0);
+    messageTensor rowSums;
+    std::complex<double> total = 0;
+    for (auto &row: original.getMessage()) {
+        std::complex<double> rowSum = 0;
+        for (unsigned int j = 0; j < row.size(); j++) {
+            colSums[j] += row[j];
+            rowSum += row[j];
+        }
+        rowSums.emplace_back(messageVector(1, rowSum));
+        total += rowSum;
+    }
+
+    auto encrypted = original.encrypt();
+    std::vector<messageTensor> results;
+    for (unsigned int numWorkers: {1, 4}) {
+        pTensor::m_numWorkers = numWorkers;
+        auto axis0 = encrypted.sum(0).decrypt().getMessage();
+        auto axis1 = encrypted.sum(1).decrypt().getMessage();
+        auto all = encrypted.sum().decrypt().getMessage();
+        EXPECT_TRUE(messageTensorEq(axis0, messageTensor{colSums}));
+        EXPECT_TRUE(messageTensorEq(axis1, rowSums));
+        EXPECT_TRUE(messageTensorEq(all, messageTensor{messageVector(1, total)}));
+        results.emplace_back(axis0);
+        results.emplace_back(all);
+    }
+    pTensor::m_numWorkers = 0;
+
+    // Same reduction order regardless of the number of workers, so the results match exactly
+    EXPECT_EQ(results[0], results[2]);
+    EXPECT_EQ(results[1], results[3]);
+}
+TEST_F(pTensor_TensorMisc, TestPlaintextOperandCache) {
+    pTensor::m_plaintextCache.clear();
+    auto encrypted = t1.encrypt();
+
+    // A broadcast row is encoded once for both LHS rows
+    auto first = encrypted * cVector;
+    EXPECT_EQ(pTensor::m_plaintextCache.misses(), 1u);
+
+    // ... and re-used when we see the same values again
+    auto second = encrypted * cVector;
+    EXPECT_EQ(pTensor::m_plaintextCache.misses(), 1u);
+    EXPECT_GE(pTensor::m_plaintextCache.hits(), 1u);
+    EXPECT_TRUE(messageTensorEq(first.decrypt().getMessage(), second.decrypt().getMessage()));
+
+    // Different values are a different entry
+    messageScalar scalar = 3.0;
+    auto third = encrypted * scalar;
+    EXPECT_EQ(pTensor::m_plaintextCache.misses(), 2u);
+    messageTensor expected = {{3, 6, 9}, {12, 15, 18}};
+    EXPECT_TRUE(messageTensorEq(third.decrypt().getMessage(), expected));
+
+    // Bounded: the least recently used entry gets evicted
+    pTensor::m_plaintextCache.setCapacity(1);
+    EXPECT_EQ(pTensor::m_plaintextCache.size(), 1u);
+    pTensor::m_plaintextCache.setCapacity(128);
+}
+TEST_F(pTensor_TensorMisc, TestRotate) {
+    auto original = pTensor::randomUniform(1, 20);
+    auto encrypted = original.encrypt();
+
+    // Offsets that need a mix of positive and negative power-of-two steps
+    for (int offset: {1, -1, 7, 13, -11}) {
+        auto rotated = encrypted.rotate(offset).decrypt().getMessage();
+        messageTensor expected(1, messageVector(20, 0.0));
+        for (int col = 0; col < 20; ++col) {
+            int source = col + offset;
+            if (source >= 0 && source < 20) {
+                expected[0][col] = original.getMessage()[0][source];
+            }
+        }
+        EXPECT_TRUE(messageTensorEq(rotated, expected)) << "offset " << offset;
+    }
+}
+TEST_F(pTensor_TensorMisc, TestHoistedRotations) {
+    auto encrypted = t1.encrypt();
+    std::vector<int> offsets = {0, 1, 2, -1, 5};
+    auto rotated = encrypted.rotations(offsets);
+    ASSERT_EQ(rotated.size(), offsets.size());
+    for (unsigned int o = 0; o < offsets.size(); ++o) {
+        auto expected = encrypted.rotate(offsets[o]).decrypt().getMessage();
+        auto actual = rotated[o].decrypt().getMessage();
+        EXPECT_TRUE(messageTensorEq(actual, expected)) << "offset " << offsets[o];
+    }
+}
+TEST_F(pTensor_TensorMisc, TestApplyGradient) {
+    messageTensor seed = {{1}, {2}, {3}};
+    auto weights = pTensor::generateWeights(3, 4, seed).encrypt();
+    messageTensor gradient = {{0.5, -1, 2}};
+    auto encryptedGradient = pTensor(1, 3, gradient).encrypt();
+
+    auto updated = pTensor::applyGradient(weights, encryptedGradient).decrypt();
+    messageTensor expected = {{0.5, 0.5, 0.5, 0.5}, {3, 3, 3, 3}, {1, 1, 1, 1}};
+    EXPECT_TRUE(messageTensorEq(updated.getMessage(), expected));
+
+    pTensor::applyGradientInPlace(weights, encryptedGradient);
+    EXPECT_TRUE(messageTensorEq(weights.decrypt().getMessage(), expected));
+}
+TEST_F(pTensor_TensorMisc, TestDepthTracking) {
+    EXPECT_EQ(pTensor::m_multDepth, 4u);  // Set by the bundle SetUp loaded
+    auto encrypted = t2.encrypt();
+    EXPECT_EQ(encrypted.level(), 0u);
+    EXPECT_EQ(encrypted.remainingDepth(), 4u);
+    EXPECT_GT(encrypted.scale(), 0.0);
+
+    auto squared = encrypted * encrypted;
+    EXPECT_EQ(squared.level(), 1u);
+    EXPECT_EQ(squared.remainingDepth(), 3u);
+
+    // Only refreshed when the planned depth does not fit
+    auto refreshCount = pTensor::getRefreshCount();
+    auto kept = squared.refreshIfNeeded(3);
+    EXPECT_EQ(kept.level(), 1u);
+    EXPECT_EQ(pTensor::getRefreshCount(), refreshCount);
+    auto refreshed = squared.refreshIfNeeded(4);
+    EXPECT_EQ(refreshed.level(), 0u);
+    EXPECT_EQ(pTensor::getRefreshCount(), refreshCount + 1);
+    EXPECT_TRUE(messageTensorEq(refreshed.decrypt().getMessage(), squared.decrypt().getMessage()));
+
+    // Chains longer than the context supports throw instead of refreshing behind the caller's back ...
+    auto power = encrypted;
+    messageVector expected = {1, 2, 3};
+    for (int i = 0; i < 4; i++) {
+        power = power * encrypted;
+        for (unsigned int j = 0; j < expected.size(); j++) {
+            expected[j] *= cVector[0][j];
+        }
+    }
+    EXPECT_EQ(power.remainingDepth(), 0u);
+    refreshCount = pTensor::getRefreshCount();
+    EXPECT_THROW(power * encrypted, std::runtime_error);
+    EXPECT_THROW(encrypted * power, std::runtime_error);
+    EXPECT_THROW(power *= encrypted, std::runtime_error);
+    EXPECT_EQ(pTensor::getRefreshCount(), refreshCount);
+
+    // ... and carry on once the caller refreshes
+    power = power.refreshIfNeeded() * encrypted;
+    for (unsigned int j = 0; j < expected.size(); j++) {
+        expected[j] *= cVector[0][j];
+    }
+    EXPECT_EQ(power.level(), 1u);
+    EXPECT_TRUE(messageTensorEq(power.decrypt().getMessage(), messageTensor{expected}));
+}
+TEST_F(pTensor_TensorMisc, TestConstAndTemporaryOperands) {
+    const pTensor encrypted = t1.encrypt();
+
+    // Temporaries bind to the operators and to the static helpers
+    auto result = (encrypted + encrypted) * encrypted - t1;
+    messageTensor expected = {{1, 6, 15}, {28, 45, 66}};
+    EXPECT_TRUE(messageTensorEq(result.decrypt().getMessage(), expected));
+
+    auto stacked = pTensor::hstack(t2.encrypt(), t2.encrypt());
+    EXPECT_EQ(stacked.shape(), std::make_tuple(2u, 3u));
+
+    // Moving keeps the ciphertexts
+    pTensor copy = encrypted;
+    pTensor moved(std::move(copy));
+    EXPECT_TRUE(moved.cipherNotEmpty());
+    EXPECT_TRUE(messageTensorEq(moved.decrypt().getMessage(), t1.getMessage()));
+
+    // A pending pTensor can be read through a const reference
+    pTensor::m_lazy = true;
+    const pTensor pending = encrypted * encrypted;
+    EXPECT_TRUE(pending.isPending());
+    messageTensor squared = {{1, 4, 9}, {16, 25, 36}};
+    EXPECT_TRUE(messageTensorEq(pending.decrypt().getMessage(), squared));
+    EXPECT_EQ(pending.evaluated().level(), 1u);
+    pTensor::m_lazy = false;
+}
+TEST_F(pTensor_TensorMisc, TestCompoundAssignment) {
+    auto encrypted = t1.encrypt();
+    auto untouched = encrypted;  // Shares the ciphertexts, which must not change under it
+
+    auto other = t1.encrypt();
+    encrypted += other;
+    encrypted -= t2;  // Broadcast plaintext row
+    auto two = pTensor::encryptScalar(2.0, true);
+    encrypted *= two;
+    messageTensor expected = {{2, 4, 6}, {14, 16, 18}};
+    EXPECT_TRUE(messageTensorEq(encrypted.decrypt().getMessage(), expected));
+    EXPECT_TRUE(messageTensorEq(untouched.decrypt().getMessage(), t1.getMessage()));
+
+    // Accumulating into itself twice in a row only touches its own ciphertexts
+    auto accumulator = t2.encrypt();
+    auto row = t2.encrypt();
+    accumulator += row;
+    accumulator += row;
+    EXPECT_TRUE(messageTensorEq(accumulator.decrypt().getMessage(), messageTensor{{3, 6, 9}}));
+    EXPECT_TRUE(messageTensorEq(row.decrypt().getMessage(), t2.getMessage()));
+
+    // The result has to keep our shape
+    auto vector = t2.encrypt();
+    EXPECT_ANY_THROW(vector += other);
+}
+TEST_F(pTensor_TensorMisc, TestSumInPlace) {
+    auto original = t1.encrypt();
+
+    auto columns = original;
+    columns.sumInPlace(0);
+    EXPECT_EQ(columns.shape(), std::make_tuple(1u, 3u));
+    EXPECT_TRUE(messageTensorEq(columns.decrypt().getMessage(), messageTensor{{5, 7, 9}}));
+
+    auto rows = original;
+    rows.sumInPlace(1);
+    EXPECT_EQ(rows.shape(), std::make_tuple(2u, 1u));
+    EXPECT_TRUE(messageTensorEq(rows.decrypt().getMessage(), messageTensor{{6}, {15}}));
+
+    auto total = original;
+    total.sumInPlace();
+    EXPECT_TRUE(messageTensorEq(total.decrypt().getMessage(), messageTensor{{21}}));
+
+    // The copies we reduced in place shared their ciphertexts with the original
+    EXPECT_TRUE(messageTensorEq(original.decrypt().getMessage(), t1.getMessage()));
+}
+
+TEST_F(pTensor_TensorMisc, TestSaveLoad) {
+    std::string path = "/tmp/ptensor_unittest_save_load.bin";
+    auto original = pTensor::randomUniform(5, 3);
+
+    original.save(path);
+    auto plain = pTensor::load(path);
+    EXPECT_EQ(plain.shape(), original.shape());
+    EXPECT_EQ(plain.getMessage(), original.getMessage());  // Raw doubles so this is exact
+    EXPECT_EQ(plain.precision(), original.precision());
+
+    // Every precision comes back as it was stored, including complex values and rows of a transposed view
+    messageTensor complexValues = {{{1, 2}, {3, -4}}, {{5, 0}, {-6, 0.5}}};
+    for (auto &stored: {pTensor(2, 2, complexValues), pTensor(3, 2, realTensor{{1, 2}, {3, 4}, {5, 6}}),
+                        pTensor(2, 3, pTensor::plainT(messageStore(floatTensor{{0.1f, 2}, {3, 4}, {5, 6}})))}) {
+        stored.save(path);
+        auto reloaded = pTensor::load(path);
+        EXPECT_EQ(reloaded.precision(), stored.precision());
+        EXPECT_EQ(reloaded.shape(), stored.shape());
+        EXPECT_EQ(reloaded.getMessage(), stored.getMessage());
+        EXPECT_EQ(pTensor::loadRows(path, 1, 2).getMessage(), messageTensor{stored.getMessage()[1]});
+    }
+
+    original.encrypt().save(path);
+    auto cipher = pTensor::load(path);
+    EXPECT_TRUE(cipher.getMessage().empty());
+    EXPECT_EQ(cipher.shape(), original.shape());
+    EXPECT_TRUE(messageTensorEq(cipher.decrypt().getMessage(), original.getMessage()));
+
+    auto middle = pTensor::loadRows(path, 1, 4);
+    EXPECT_EQ(middle.shape(), std::make_tuple(3u, 3u));
+    auto expected = original.getMessage();
+    EXPECT_TRUE(messageTensorEq(middle.decrypt().getMessage(),
+                                messageTensor(expected.begin() + 1, expected.begin() + 4)));
+    EXPECT_THROW(pTensor::loadRows(path, 2, 6), std::runtime_error);
+
+    // The records are read out of the mapping, so a truncated file has to be caught up front
+    struct stat saved;
+    ASSERT_EQ(::stat(path.c_str(), &saved), 0);
+    ASSERT_EQ(::truncate(path.c_str(), saved.st_size / 2), 0);
+    EXPECT_THROW(pTensor::load(path), std::runtime_error);
+    EXPECT_NO_THROW(pTensor::loadRows(path, 0, 1));
+
+    std::ofstream(path, std::ios::trunc) << "not a pTensor";
+    EXPECT_THROW(pTensor::load(path), std::runtime_error);
+    std::remove(path.c_str());
+}
+
+TEST_F(pTensor_TensorMisc, TestCryptoBundle) {
+    std::string path = "/tmp/ptensor_unittest_crypto_bundle.bin";
+    cryptoBundle::generate(4, 40, 4096);
+    cryptoBundle::save(path);
+    auto encrypted = t1.encrypt();
+
+    // Loading replaces pTensor's context and keys with the deserialized ones, which decrypt what we encrypted before
+    auto &loaded = cryptoBundle::load(path);
+    EXPECT_EQ(pTensor::m_cc, &loaded);
+    EXPECT_TRUE(messageTensorEq(encrypted.decrypt().getMessage(), t1.getMessage()));
+
+    // ... and have every evaluation key
+    auto product = (encrypted * encrypted).sum(1);
+    EXPECT_TRUE(messageTensorEq(product.decrypt().getMessage(), messageTensor{{14}, {77}}));
+    EXPECT_TRUE(messageTensorEq(encrypted.T().decrypt().getMessage(), pTensor::plainT(t1.getMessage())));
+
+    // Different parameters than what is in the bundle so it is regenerated (and overwritten)
+    cryptoBundle::loadOrGenerate(path, 3, 40, 4096);
+    EXPECT_EQ(pTensor::m_multDepth, 3u);
+    EXPECT_TRUE(messageTensorEq(t1.encrypt().decrypt().getMessage(), t1.getMessage()));
+
+    // ... and so is a forced ring dimension, which is kept in the bundle
+    EXPECT_EQ(cryptoBundle::loadOrGenerate(path, 3, 40, 4096, 32768)->GetRingDimension(), 32768u);
+    EXPECT_EQ(cryptoBundle::load(path)->GetRingDimension(), 32768u);
+    EXPECT_EQ(pTensor::m_multDepth, 3u);
+
+    // Saving over a file others can read does not leave the keys readable by them
+    ::chmod(path.c_str(), 0644);
+    cryptoBundle::save(path);
+    struct stat info;
+    ASSERT_EQ(::stat(path.c_str(), &info), 0);
+    EXPECT_EQ(info.st_mode & 0777, 0600u);
+    EXPECT_EQ(cryptoBundle::load(path)->GetRingDimension(), 32768u);
+
+    std::ofstream(path, std::ios::trunc) << "not a crypto bundle";
+    EXPECT_THROW(cryptoBundle::load(path), std::runtime_error);
+    std::remove(path.c_str());
+}
+
+TEST_F(pTensor_TensorMisc, TestRealAndFloatStorage) {
+    realTensor rTensor = {{1, 2, 3}, {4, 5, 6}};
+    floatTensor fTensor = {{1, 2, 3}, {4, 5, 6}};
+    pTensor real(2, 3, rTensor);
+    pTensor single(2, 3, fTensor);
+    EXPECT_EQ(t1.precision(), messagePrecision::complexDouble);
+    EXPECT_EQ(real.precision(), messagePrecision::realDouble);
+    EXPECT_EQ(single.precision(), messagePrecision::realFloat);
+    EXPECT_EQ(real.messages().bytes() * 2, t1.messages().bytes());
+    EXPECT_EQ(single.messages().bytes() * 4, t1.messages().bytes());
+
+    // The values only become complex when they are encoded, so every precision behaves the same
+    EXPECT_EQ(real.getMessage(), cTensor);
+    EXPECT_EQ(single.getMessage(), cTensor);
+    EXPECT_EQ(t1.withPrecision(messagePrecision::realFloat).messages().to<floatScalar>(), fTensor);
+    for (auto &tensor: {real, single}) {
+        EXPECT_TRUE(messageTensorEq(tensor.encrypt().decrypt().getMessage(), cTensor));
+        EXPECT_TRUE(messageTensorEq(tensor.encrypt(pTensorLayout::packedRows).decrypt().getMessage(), cTensor));
+        EXPECT_TRUE(messageTensorEq((t1.encrypt() + tensor).decrypt().getMessage(), (t1.encrypt() + t1).decrypt()
+            .getMessage()));
+        EXPECT_EQ(tensor.plainT(), t1.plainT());
+    }
+    EXPECT_EQ(pTensor::plainT(rTensor), realTensor({{1, 4}, {2, 5}, {3, 6}}));
+
+    // Stacking keeps the precision unless it differs
+    EXPECT_EQ(pTensor::hstack(real, real).precision(), messagePrecision::realDouble);
+    EXPECT_EQ(pTensor::hstack(real, t1).precision(), messagePrecision::complexDouble);
+    EXPECT_EQ(pTensor::hstack(real, single).getMessage(), pTensor::hstack(t1, t1).getMessage());
+
+    // The plaintext helpers store reals
+    EXPECT_EQ(pTensor::identity(3).precision(), messagePrecision::realDouble);
+    EXPECT_EQ(pTensor::generateWeights(4, 8).precision(), messagePrecision::realDouble);
+    EXPECT_EQ(pTensor::generateWeights(2, 3, {{1}, {2}}).getMessage(), messageTensor({{1, 1, 1}, {2, 2, 2}}));
+}
+
+TEST_F(pTensor_TensorMisc, TestStridedMessageStore) {
+    messageStore store(realTensor{{1, 2, 3}, {4, 5, 6}});
+    EXPECT_TRUE(store.isContiguous());
+    EXPECT_EQ(store.rowStride(), 3);
+    EXPECT_EQ(store.data<realScalar>()[4], 5);
+    EXPECT_EQ(store.data<messageScalar>(), nullptr);
+
+    // Transposes and row ranges are views of the same values
+    auto transposed = store.transposed();
+    EXPECT_FALSE(transposed.isContiguous());
+    EXPECT_EQ(transposed.data<realScalar>(), store.data<realScalar>());
+    EXPECT_EQ(transposed.to<realScalar>(), realTensor({{1, 4}, {2, 5}, {3, 6}}));
+    EXPECT_EQ(transposed.row(2), messageVector({3, 6}));
+    EXPECT_EQ(transposed.rowRange(1, 3).to<realScalar>(), realTensor({{2, 5}, {3, 6}}));
+    EXPECT_EQ(store.rowRange(1, 2).at(0, 2), messageScalar(6));
+    EXPECT_THROW(store.rowRange(1, 3), std::runtime_error);
+
+    // Materializing a view lays it out row-major
+    auto materialized = transposed.contiguous();
+    EXPECT_TRUE(materialized.isContiguous());
+    EXPECT_EQ(realVector(materialized.data<realScalar>(), materialized.data<realScalar>() + 6),
+              realVector({1, 4, 2, 5, 3, 6}));
+
+    // Copies share the values until one of them is written to
+    auto copy = store;
+    EXPECT_EQ(copy.data<realScalar>(), store.data<realScalar>());
+    copy.mutableData<realScalar>()[0] = 10;
+    EXPECT_EQ(store.at(0, 0), messageScalar(1));
+    EXPECT_EQ(copy.at(0, 0), messageScalar(10));
+
+    // Stacking a view copies its values in order
+    EXPECT_EQ(messageStore::concatRows(store, transposed.transposed().rowRange(1, 2)).to<realScalar>(),
+              realTensor({{1, 2, 3}, {4, 5, 6}, {4, 5, 6}}));
+    EXPECT_THROW(messageStore::concatRows(store, transposed), std::runtime_error);
+    EXPECT_THROW(messageStore(messageTensor{{1, 2}, {3}}), std::runtime_error);
+
+    // pTensors built from the nested messages use the same storage
+    pTensor fromStore(3, 2, transposed);
+    EXPECT_TRUE(messageTensorEq(fromStore.encrypt().decrypt().getMessage(), pTensor::plainT(cTensor)));
+    EXPECT_TRUE(fromStore.encrypt().decrypt().messages().isContiguous());
+}
+
+TEST_F(pTensor_TensorMisc, TestBlockedTranspose) {
+    // Shapes around the tile and micro-kernel sizes, plus one big enough to be split across threads
+    std::vector<std::pair<unsigned int, unsigned int>> shapes = {{1, 1}, {3, 5}, {8, 8}, {33, 70}, {64, 31}, {300, 257}};
+    for (unsigned int numWorkers: {1u, 4u}) {
+        pTensor::m_numWorkers = numWorkers;
+        for (auto &shape: shapes) {
+            realTensor reals(shape.first, realVector(shape.second));
+            floatTensor floats(shape.first, floatVector(shape.second));
+            messageTensor complexes(shape.first, messageVector(shape.second));
+            for (unsigned int r = 0; r < shape.first; ++r) {
+                for (unsigned int c = 0; c < shape.second; ++c) {
+                    reals[r][c] = r * 1000.0 + c;
+                    floats[r][c] = static_cast<float>(r * 1000 + c);
+                    complexes[r][c] = messageScalar(r, c);
+                }
+            }
+            auto realsT = pTensor::plainT(reals);
+            auto floatsT = pTensor::plainT(floats);
+            auto complexesT = pTensor::plainT(complexes);
+            ASSERT_EQ(realsT.size(), shape.second);
+            for (unsigned int r = 0; r < shape.first; ++r) {
+                for (unsigned int c = 0; c < shape.second; ++c) {
+                    ASSERT_EQ(realsT[c][r], reals[r][c]);
+                    ASSERT_EQ(floatsT[c][r], floats[r][c]);
+                    ASSERT_EQ(complexesT[c][r], complexes[r][c]);
+                }
+            }
+            // Transposing back gives the original, stored contiguously
+            auto roundTrip = pTensor::plainT(pTensor::plainT(messageStore(reals)));
+            EXPECT_TRUE(roundTrip.isContiguous());
+            EXPECT_EQ(roundTrip.to<realScalar>(), reals);
+        }
+    }
+    pTensor::m_numWorkers = 0;
+}
+
+TEST_F(pTensor_TensorMisc, TestTracer) {
+    auto encrypted = t1.encrypt();
+    auto named = [](const std::vector<traceEvent> &events, const std::string &name) {
+        return std::find_if(events.begin(), events.end(), [&](const traceEvent &e) { return name == e.name; });
+    };
+
+    tracer::start();
+    auto product = (encrypted * encrypted).sum(1);
+    tracer::stop();
+    auto events = tracer::events();
+
+    auto mult = named(events, "operator*");
+    ASSERT_NE(mult, events.end());
+    EXPECT_STREQ(mult->category, kTracePTensor);
+    EXPECT_STREQ(mult->argNames[0], "rows");
+    EXPECT_EQ(mult->args[0], 2);
+    EXPECT_EQ(mult->args[1], 3);
+    EXPECT_NE(named(events, "sum(1)"), events.end());
+    EXPECT_NE(named(events, "EvalSum"), events.end());
+
+    // The PALISADE calls nest inside the operator that made them
+    auto evalMult = named(events, "EvalMult");
+    ASSERT_NE(evalMult, events.end());
+    EXPECT_STREQ(evalMult->category, kTracePalisade);
+    EXPECT_GE(evalMult->start, mult->start);
+    EXPECT_LE(evalMult->start + evalMult->duration, mult->start + mult->duration);
+
+    // Nothing is recorded while the tracer is stopped
+    product.decrypt();
+    EXPECT_EQ(tracer::events().size(), events.size());
+
+    // A scope that was already open when the tracer (re)started is dropped instead of recorded against the new origin
+    tracer::start();
+    {
+        traceScope stale("stale", kTracePTensor);
+        tracer::start();
+    }
+    tracer::stop();
+    EXPECT_TRUE(tracer::events().empty());
+    tracer::start();
+    product.decrypt();
+    tracer::stop();
+    events = tracer::events();
+
+    std::string path = "/tmp/ptensor_unittest_trace.json";
+    tracer::save(path);
+    std::ifstream in(path);
+    std::string json((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(json.rfind("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", 0), 0u);
+    EXPECT_NE(json.find("{\"name\": \"Decrypt\", \"cat\": \"palisade\", \"ph\": \"X\", \"ts\": "), std::string::npos);
+    EXPECT_NE(json.find("\"args\": {\"rows\": 2, \"cols\": 1}}"), std::string::npos);
+    std::remove(path.c_str());
+}
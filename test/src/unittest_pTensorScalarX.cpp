@@ -32,30 +32,12 @@ class pTensor_ScalarTest : public ::testing::Test {
       uint8_t scalingFactorBits = 40;
       int batchSize = 4096;
 
-      cc =
-          lbcrypto::CryptoContextFactory<lbcrypto::DCRTPoly>::genCryptoContextCKKS(
-              multDepth, scalingFactorBits, batchSize
-          );
-
-      cc->Enable(ENCRYPTION);
-      cc->Enable(SHE);
-      cc->Enable(LEVELEDSHE);
-      auto keys = cc->KeyGen();
-      cc->EvalMultKeyGen(keys.secretKey);
-      cc->EvalSumKeyGen(keys.secretKey);
-
-      int ringDim = cc->GetRingDimension();
-      int rot = int(-ringDim / 4) + 1;
-      cc->EvalAtIndexKeyGen(keys.secretKey, {-1, 1, rot});
-
-      public_key = keys.publicKey;
-      private_key = keys.secretKey;
+      // Keys are generated on the first run and memory-mapped from the bundle after that
+      cc = cryptoBundle::loadOrGenerate(testCryptoBundlePath, multDepth, scalingFactorBits, batchSize);
+      public_key = pTensor::m_public_key;
+      private_key = pTensor::m_private_key;
 
       pTensor::m_cc = &cc;
-      pTensor::m_private_key = private_key;
-      pTensor::m_public_key = public_key;
-
-
   }
 
   void TearDown() {
@@ -224,3 +206,26 @@ TEST_F(pTensor_ScalarTest, TestMultScalarScalar) {
     auto resp = multValPt.decrypt();
     EXPECT_TRUE(messageTensorEq(resp.getMessage(), expected));
 }
+TEST_F(pTensor_ScalarTest, TestReplicatedScalarReuse) {
+    // The scalar is replicated once and then re-used: across rows, across ops, and by copies of it
+    auto scalar = t3.encrypt();
+    auto copy = scalar;
+    auto tensor = t1.encrypt();
+    auto vector = t2.encrypt();
+
+    messageTensor expectedTensor = {{2, 4, 6}, {8, 10, 12}};
+    messageTensor expectedVector = {{3, 4, 5}};
+    for (int epoch = 0; epoch < 2; ++epoch) {
+        auto multTensor = tensor * scalar;
+        EXPECT_TRUE(messageTensorEq(multTensor.decrypt().getMessage(), expectedTensor));
+
+        auto addVector = vector + copy;
+        EXPECT_TRUE(messageTensorEq(addVector.decrypt().getMessage(), expectedVector));
+    }
+
+    // A new scalar must not hand back the old replica
+    copy = scalar * scalar;
+    messageTensor expectedScaled = {{4, 8, 12}};
+    auto scaled = vector * copy;
+    EXPECT_TRUE(messageTensorEq(scaled.decrypt().getMessage(), expectedScaled));
+}
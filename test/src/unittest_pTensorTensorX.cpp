@@ -32,30 +32,12 @@ class pTensor_TensorTest : public ::testing::Test {
       uint8_t scalingFactorBits = 40;
       int batchSize = 4096;
 
-      cc =
-          lbcrypto::CryptoContextFactory<lbcrypto::DCRTPoly>::genCryptoContextCKKS(
-              multDepth, scalingFactorBits, batchSize
-          );
-
-      cc->Enable(ENCRYPTION);
-      cc->Enable(SHE);
-      cc->Enable(LEVELEDSHE);
-      auto keys = cc->KeyGen();
-      cc->EvalMultKeyGen(keys.secretKey);
-      cc->EvalSumKeyGen(keys.secretKey);
-
-      int ringDim = cc->GetRingDimension();
-      int rot = int(-ringDim / 4) + 1;
-      cc->EvalAtIndexKeyGen(keys.secretKey, {-1, 1, rot});
-
-      public_key = keys.publicKey;
-      private_key = keys.secretKey;
+      // Keys are generated on the first run and memory-mapped from the bundle after that
+      cc = cryptoBundle::loadOrGenerate(testCryptoBundlePath, multDepth, scalingFactorBits, batchSize);
+      public_key = pTensor::m_public_key;
+      private_key = pTensor::m_private_key;
 
       pTensor::m_cc = &cc;
-      pTensor::m_private_key = private_key;
-      pTensor::m_public_key = public_key;
-
-
   }
 
   void TearDown() {